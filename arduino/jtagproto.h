@@ -0,0 +1,282 @@
+/**
+ *  Binary wire protocol between svf-player and the Arduino sketch.
+ *  This header is included by both sides, so keep it plain C.
+ *
+ *  Every packet, in either direction, looks like:
+ *    byte 0    JP_SYNC
+ *    byte 1    opcode (JP_OP_*)
+ *    byte 2-3  payload length, little endian
+ *    byte 4-   payload
+ *  JP_SYNC is not printable, so the sketch can tell a binary packet
+ *  from a legacy ASCII "$..." command by looking at the first byte.
+ *
+ *  Bit vectors are packed LSB first: clock i lives in bit (i%8) of
+ *  byte (i/8), which is also how svfData stores shift data.
+ */
+#ifndef __JTAGPROTO_H
+#define __JTAGPROTO_H
+
+#define JP_SYNC         0xA5
+#define JP_HDR_LEN      4
+
+// Largest payload the sketch will accept; bounded by the Uno's 2K of RAM
+#define JP_MAX_PAYLOAD  130
+// Clocks per JP_OP_SHIFT packet: 2 bytes of count + TMS and TDI vectors
+#define JP_MAX_CLOCKS   ((JP_MAX_PAYLOAD-2)/2*8)
+
+/** JP_OP_SHIFT
+ *  request:  clocks (uint16 LE), tms[(clocks+7)/8], tdi[(clocks+7)/8]
+ *  response: tdo[(clocks+7)/8], sampled before each rising edge of TCK
+ */
+#define JP_OP_SHIFT     'S'
+/** JP_OP_ERROR
+ *  response only: one byte error code (JP_ERR_*)
+ */
+#define JP_OP_ERROR     'E'
+
+/** JP_OP_BATCH
+ *  request:  a sequence of sub-ops (JP_SUB_*), each an opcode byte and
+ *            its arguments. The programmer tracks the TAP state itself
+ *            (jp_tap_step), so moving between states only names the
+ *            destination
+ *  response: TDO of every JP_SUB_SHIFT, JP_SUB_ZSHIFT and JP_SUB_RAW clock,
+ *            in order and packed back to back; at most JP_MAX_CLOCKS of
+ *            them. Other clocks aren't sampled
+ *  An empty batch gets an empty response; hosts use it to probe for
+ *  support, as older sketches answer JP_ERR_OPCODE.
+ */
+#define JP_OP_BATCH     'B'
+// state (JP_ST_*): walk the shortest TMS path to it, TDI low
+#define JP_SUB_GOTO     'g'
+// flags (JP_CLK_*), count (uint16 LE): count clocks of constant TMS/TDI
+#define JP_SUB_CLOCK    'c'
+#define JP_CLK_TMS      0x01
+#define JP_CLK_TDI      0x02
+// flags (JP_SHIFT_*), count (uint16 LE), tdi[(count+7)/8]: shift in
+// Shift-DR/IR, with TMS high on the last clock if JP_SHIFT_EXIT
+#define JP_SUB_SHIFT    's'
+#define JP_SHIFT_EXIT   0x01
+// count (uint8), tms[(count+7)/8], tdi[(count+7)/8]: anything else
+#define JP_SUB_RAW      'r'
+
+/** JP_OP_BAUD
+ *  request:  baud rate (uint32 LE)
+ *  response: the baud rate the programmer switches to (uint32 LE), or 0 if
+ *            it can't run at that rate. The response is sent at the old
+ *            rate and the switch happens right after it; the host then
+ *            switches too and checks the link with an empty batch
+ */
+#define JP_OP_BAUD      'U'
+/** JP_OP_FREQ
+ *  request:  highest TCK frequency in Hz (uint32 LE); 0 for as fast as
+ *            the programmer goes
+ *  response: the TCK frequency the programmer now stays at or below
+ *            (uint32 LE), 0 if it doesn't pace TCK
+ *  The setting holds for every kind of packet until the next JP_OP_FREQ.
+ */
+#define JP_OP_FREQ      'F'
+/** JP_OP_CREDIT
+ *  request:  empty
+ *  response: how many bytes the programmer's receive buffer holds
+ *            (uint16 LE)
+ *  That is the host's credit. A request leaves the buffer as a whole before
+ *  it runs, and its response hands its bytes back, so all unanswered
+ *  requests but the oldest one may take up at most this many bytes. A
+ *  sketch without JP_OP_CREDIT on an Uno has JP_DEFAULT_CREDIT.
+ */
+#define JP_OP_CREDIT    'C'
+#define JP_DEFAULT_CREDIT 63
+/** JP_OP_VERIFY
+ *  request:  sub-ops as in JP_OP_BATCH, plus JP_SUB_EXPECT and
+ *            JP_SUB_ZEXPECT. The programmer compares TDO itself, so a
+ *            matching packet sends nothing back
+ *  response: empty if every checked clock matched. Otherwise the offset of
+ *            the first mismatching clock among the packet's sampled ones
+ *            (uint16 LE), then the TDO of the sampled clocks up to the
+ *            failed JP_SUB_EXPECT, packed as in a JP_OP_BATCH response. The
+ *            rest of the packet isn't run
+ *  A mismatch also sets a sticky error flag. While it is set, every
+ *  JP_OP_VERIFY is answered with JP_ERR_VERIFY without running, so nothing
+ *  the host streamed after the failure reaches the part. An empty request
+ *  clears the flag and gets an empty response; hosts use it to probe for
+ *  support.
+ */
+#define JP_OP_VERIFY    'V'
+// flags (JP_EXPECT_*), count (uint16 LE), tdo[(count+7)/8], mask[(count+7)/8]:
+// TDO expected from the last count sampled clocks, checked where mask is set.
+// Length: jp_expect_len()
+#define JP_SUB_EXPECT   'x'
+#define JP_EXPECT_ALL   0x01  // no mask; every clock is checked
+#define JP_EXPECT_FILL  0x02  // no tdo; every checked clock reads JP_EXPECT_ONES
+#define JP_EXPECT_ONES  0x04
+// flags (JP_SHIFT_*), count (uint16 LE), size (uint8), tdi packed into size
+// bytes (jp_pack()): JP_SUB_SHIFT with packed TDI. A shift of no clocks does
+// nothing, in any state; hosts send one in a JP_OP_BATCH to probe for
+// support, as older sketches answer JP_ERR_OPCODE
+#define JP_SUB_ZSHIFT   'z'
+// flags (JP_EXPECT_*), count (uint16 LE), size (uint8), then the vectors of
+// a JP_SUB_EXPECT with the same flags, packed together into size bytes
+#define JP_SUB_ZEXPECT  'y'
+
+#define JP_ERR_LENGTH   1   // payload too long or truncated
+#define JP_ERR_OPCODE   2   // unknown opcode
+#define JP_ERR_STATE    3   // sub-op not possible in the current TAP state
+#define JP_ERR_VERIFY   4   // skipped: an earlier JP_OP_VERIFY mismatched
+
+#define JP_BYTES(clocks) (((clocks)+7)/8)
+
+static inline unsigned long jp_get_u32(const unsigned char* p){
+  return p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+static inline void jp_put_u32(unsigned char* p, unsigned long v){
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = (v >> 24) & 0xff;
+}
+
+// Bytes of vectors a JP_SUB_EXPECT carries
+static inline unsigned int jp_expect_vectors(unsigned char flags, unsigned int count){
+  return (!(flags & JP_EXPECT_ALL) + !(flags & JP_EXPECT_FILL)) * JP_BYTES(count);
+}
+// Size of a JP_SUB_EXPECT with its opcode
+static inline unsigned int jp_expect_len(unsigned char flags, unsigned int count){
+  return 4 + jp_expect_vectors(flags, count);
+}
+
+/**
+ *  Packed vectors (JP_SUB_ZSHIFT, JP_SUB_ZEXPECT). Flash images are mostly
+ *  runs of 0x00 or 0xff and repeated words, so the bytes of a vector go out
+ *  as a sequence of tokens:
+ *    0x00-0x3f  literal: the next token+1 bytes, as they are
+ *    0x40-0x7f  run: the next byte, (token&0x3f)+1 times
+ *    0x80-0xff  copy: ((token>>3)&0x0f)+2 bytes from (token&7)+1 bytes back
+ *               in the output, which may overlap the bytes being copied
+ *  Copies reach back JP_PACK_WINDOW bytes at most, so a 16 or 32 bit word
+ *  repeating costs one byte per 17 bytes, and decoding needs nothing but
+ *  the output itself.
+ */
+#define JP_PACK_RUN       0x40
+#define JP_PACK_COPY      0x80
+#define JP_PACK_MAX_RUN   64
+#define JP_PACK_MAX_COPY  17
+#define JP_PACK_WINDOW    8
+
+// Packs the n bytes at in into out; returns the packed size, or 0 if that
+// would be more than max
+static inline unsigned int jp_pack(const unsigned char* in, unsigned int n, unsigned char* out, unsigned int max){
+  unsigned int i = 0, len = 0, literal = 0, run, copy, dist, d, k;
+  while (i < n) {
+    for (run = 1; i + run < n && run < JP_PACK_MAX_RUN && in[i + run] == in[i]; run++);
+    copy = dist = 0;
+    for (d = 1; d <= JP_PACK_WINDOW && d <= i; d++) {
+      for (k = 0; i + k < n && k < JP_PACK_MAX_COPY && in[i + k] == in[i + k - d]; k++);
+      if (k > copy) {
+        copy = k;
+        dist = d;
+      }
+    }
+    // A copy takes one byte and a run two
+    if (copy >= 2 && 2 * copy >= run) {
+      if (len + 1 > max) return 0;
+      out[len++] = JP_PACK_COPY | ((copy - 2) << 3) | (dist - 1);
+      i += copy;
+      literal = 0;
+    } else if (run >= 3) {
+      if (len + 2 > max) return 0;
+      out[len++] = JP_PACK_RUN | (run - 1);
+      out[len++] = in[i];
+      i += run;
+      literal = 0;
+    } else {
+      // Extends the literal just written, if there is one with room
+      if (literal == 0 || out[literal - 1] == JP_PACK_RUN - 1) {
+        if (len + 2 > max) return 0;
+        out[len++] = 0;
+        literal = len;
+      } else {
+        if (len + 1 > max) return 0;
+        out[literal - 1]++;
+      }
+      out[len++] = in[i++];
+    }
+  }
+  return len;
+}
+
+// Unpacks the len bytes at in into out, which they must fill with exactly
+// n bytes; returns 0 if they don't. With out NULL it only checks
+static inline unsigned char jp_unpack(const unsigned char* in, unsigned int len, unsigned char* out, unsigned int n){
+  unsigned int i = 0, o = 0, c, d, k;
+  while (i < len) {
+    unsigned char token = in[i++];
+    if (token < JP_PACK_RUN) {
+      c = token + 1;
+      if (i + c > len || o + c > n) return 0;
+      if (out) for (k = 0; k < c; k++) out[o + k] = in[i + k];
+      i += c;
+    } else if (token < JP_PACK_COPY) {
+      c = (token & 0x3f) + 1;
+      if (i >= len || o + c > n) return 0;
+      if (out) for (k = 0; k < c; k++) out[o + k] = in[i];
+      i++;
+    } else {
+      c = ((token >> 3) & 0x0f) + 2;
+      d = (token & 7) + 1;
+      if (d > o || o + c > n) return 0;
+      if (out) for (k = 0; k < c; k++) out[o + k] = out[o + k - d];
+    }
+    o += c;
+  }
+  return o == n;
+}
+
+/**
+ *  TAP states, numbered like svfState in libsvfplayer.h
+ */
+#define JP_ST_UNKNOWN   1
+#define JP_ST_RESET     2
+#define JP_ST_IDLE      3
+#define JP_ST_DRSHIFT   6
+#define JP_ST_DRPAUSE   8
+#define JP_ST_IRSHIFT   13
+#define JP_ST_IRPAUSE   15
+#define JP_ST_COUNT     18
+
+// next state for TMS 0 and 1; UNDEFINED and UNKNOWN never leave
+#define JP_TAP_TRANSITIONS { \
+  {0, 0},   {1, 1},   {3, 2},   {3, 4},   {5, 11},  {6, 7},   {6, 7}, \
+  {8, 10},  {8, 9},   {6, 10},  {3, 4},   {12, 2},  {13, 14}, {13, 14}, \
+  {15, 17}, {15, 16}, {13, 17}, {3, 4} }
+static const unsigned char jp_tap_next[JP_ST_COUNT][2] = JP_TAP_TRANSITIONS;
+
+// State after one clock; five TMS highs in a row reset the TAP from
+// anywhere, which is also how an UNKNOWN state becomes known
+static inline unsigned char jp_tap_step(unsigned char state, unsigned char tms, unsigned char* ones){
+  if (!tms) *ones = 0;
+  else if (*ones < 5) (*ones)++;
+  return *ones >= 5 ? JP_ST_RESET : jp_tap_next[state][tms ? 1 : 0];
+}
+
+// Fills dist with the number of clocks from every state to dst (0xff if
+// unreachable). Shortest paths between TAP states are unique, and they are
+// the paths the svf spec mandates, so stepping to whichever next state is
+// closer to dst follows the svf path
+static inline void jp_tap_distances(unsigned char dst, unsigned char* dist){
+  unsigned char s, t, changed = 1;
+  for (s = 0; s < JP_ST_COUNT; s++) dist[s] = 0xff;
+  dist[dst] = 0;
+  while (changed) {
+    changed = 0;
+    for (s = JP_ST_RESET; s < JP_ST_COUNT; s++)
+      for (t = 0; t < 2; t++) {
+        unsigned char d = dist[jp_tap_next[s][t]];
+        if (d != 0xff && d + 1 < dist[s]) {
+          dist[s] = d + 1;
+          changed = 1;
+        }
+      }
+  }
+}
+
+#endif
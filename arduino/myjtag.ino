@@ -1,3 +1,5 @@
+#include "jtagproto.h"
+
 /** 
  *  Arduino's Pin Assignment
  */
@@ -6,12 +8,39 @@
 #define PIN_TCK 4
 #define PIN_TDO 5
 
+/**
+ *  Direct port I/O. On the ATmega328P/168 (Uno, Nano) digital pins 0-7
+ *  are bits 0-7 of PORTD, so a pin access is one sbi/cbi/sbis instruction
+ *  instead of a digitalWrite()/digitalRead() call taking microseconds.
+ *  Other boards use the Arduino calls.
+ */
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__)
+#if PIN_TDI > 7 || PIN_TMS > 7 || PIN_TCK > 7 || PIN_TDO > 7
+#error JTAG pins must be on PORTD (digital pins 0-7) for direct port I/O
+#endif
+#define JTAG_WRITE(pin, v)  do { if (v) PORTD |= _BV(pin); else PORTD &= ~_BV(pin); } while (0)
+#define JTAG_READ(pin)      ((PIND >> (pin)) & 1)
+#else
+#define JTAG_WRITE(pin, v)  digitalWrite(pin, v)
+#define JTAG_READ(pin)      digitalRead(pin)
+#endif
+
 /** 
  *  Arduino's JTAG Software Configuration
  */
 bool PULLUP   = false;
-bool DELAY    = false;
-long DELAYUS  = 50;
+bool DELAY    = false;  // pace TCK, set by JP_OP_FREQ
+long DELAYUS  = 50;     // shortest TCK period while DELAY is set
+// The shift engine's tightest loop takes well over 16 CPU cycles per clock,
+// so rates from here on need no pacing
+#define TCK_MAX_HZ    (F_CPU / 16)
+// The Uno's UART tops out at F_CPU / 8 in double speed mode
+#define MAX_BAUD      (F_CPU / 8)
+#define MIN_BAUD      1200
+// The core's receive ring, which keeps one slot free
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE 64
+#endif
 #define MAX_DEV_NR 4
 #define IDCODE_LEN 32
 // Target specific, check your documentation or guess
@@ -22,24 +51,77 @@ long DELAYUS  = 50;
 #define IR_SAMPLE                "10100" // always 101
 #define IR_PRELOAD               IR_SAMPLE
 
+/**
+ * Our copy of the TAP state, kept up to date by every clock the svf player
+ * sends. The legacy helpers below don't track it, so commands using them
+ * set it to JP_ST_UNKNOWN when they're done.
+ */
+byte jtag_tap = JP_ST_UNKNOWN;
+byte jtag_ones = 0;
+// Set when a JP_OP_VERIFY mismatches; cleared by an empty one
+bool verify_failed = false;
+
+// Binary packet buffers (see jtagproto.h)
+byte pkt[JP_MAX_PAYLOAD];
+byte pkt_out[JP_BYTES(JP_MAX_CLOCKS)];
+// A JP_SUB_ZSHIFT's TDI or a JP_SUB_ZEXPECT, unpacked; the latter is laid
+// out as the JP_SUB_EXPECT it stands for
+byte pkt_unpacked[4 + 2 * JP_BYTES(JP_MAX_CLOCKS)];
+
 /** 
  *  LOW-LEVEL JTAG SIGNALLING
  */
+// Waits out one TCK period; delayMicroseconds() is only accurate up to 16383
+static inline void tck_delay(){
+  if (!DELAY) return;
+  if (DELAYUS < 16384) {
+    delayMicroseconds(DELAYUS);
+  } else {
+    delay(DELAYUS / 1000);
+    delayMicroseconds(DELAYUS % 1000);
+  }
+}
 void pulse_tms(int s_tms) {
-  digitalWrite(PIN_TCK, LOW);
-  digitalWrite(PIN_TMS, s_tms);
-  digitalWrite(PIN_TCK, HIGH);
+  JTAG_WRITE(PIN_TCK, LOW);
+  JTAG_WRITE(PIN_TMS, s_tms);
+  JTAG_WRITE(PIN_TCK, HIGH);
 }
 void pulse_tdi(int s_tdi) {
-  if (DELAY) delayMicroseconds(DELAYUS);
-  digitalWrite(PIN_TCK, LOW);
-  digitalWrite(PIN_TDI, s_tdi);
-  digitalWrite(PIN_TCK, HIGH);
+  tck_delay();
+  JTAG_WRITE(PIN_TCK, LOW);
+  JTAG_WRITE(PIN_TDI, s_tdi);
+  JTAG_WRITE(PIN_TCK, HIGH);
 }
 byte pulse_tdo(){
   byte tdo_read;
-  if (DELAY) delayMicroseconds(DELAYUS);
-  digitalWrite(PIN_TCK, LOW); // read in TDO on falling edge
+  tck_delay();
+  JTAG_WRITE(PIN_TCK, LOW); // read in TDO on falling edge
+  tdo_read = JTAG_READ(PIN_TDO);
+  JTAG_WRITE(PIN_TCK, HIGH);
+  return tdo_read;
+}
+
+/**
+ * The shift engine: one TCK cycle. TMS and TDI are set up and TDO is
+ * sampled while TCK is low; the target latches TMS/TDI on the rising edge.
+ */
+static inline byte jtag_clock(byte tms, byte tdi){
+  byte tdo_read;
+  tck_delay();
+  JTAG_WRITE(PIN_TCK, LOW);
+  JTAG_WRITE(PIN_TMS, tms);
+  JTAG_WRITE(PIN_TDI, tdi);
+  tdo_read = JTAG_READ(PIN_TDO);
+  JTAG_WRITE(PIN_TCK, HIGH);
+  return tdo_read;
+}
+
+// jtag_clock() as it was with digitalWrite(), for $BENCH to compare against
+byte jtag_clock_portable(byte tms, byte tdi){
+  byte tdo_read;
+  digitalWrite(PIN_TCK, LOW);
+  digitalWrite(PIN_TMS, tms);
+  digitalWrite(PIN_TDI, tdi);
   tdo_read = digitalRead(PIN_TDO);
   digitalWrite(PIN_TCK, HIGH);
   return tdo_read;
@@ -61,10 +143,10 @@ byte pulse_tdo(){
 void tap_state(String tap_state){
   int tap_state_length = tap_state.length();
   for (int i=0; i < tap_state_length; i++) {
-    if (DELAY) delayMicroseconds(DELAYUS);
-    digitalWrite(PIN_TCK, LOW);
-    digitalWrite(PIN_TMS, tap_state[i] - '0'); // conv from ascii pattern
-    digitalWrite(PIN_TCK, HIGH); // rising edge shifts in TMS
+    tck_delay();
+    JTAG_WRITE(PIN_TCK, LOW);
+    JTAG_WRITE(PIN_TMS, tap_state[i] - '0'); // conv from ascii pattern
+    JTAG_WRITE(PIN_TCK, HIGH); // rising edge shifts in TMS
   }
 }
 
@@ -77,11 +159,11 @@ void ir_state(String state) {
 
   tap_state(TAP_SHIFTIR);
   for (int i = 0; i < IR_LEN; i++) {
-    if (DELAY) delayMicroseconds(DELAYUS);
+    tck_delay();
     // TAP/TMS changes to Exit IR state (1) must be executed
     // at same time that the last TDI bit is sent:
     if (i == IR_LEN-1) {
-      digitalWrite(PIN_TMS, HIGH); // ExitIR
+      JTAG_WRITE(PIN_TMS, HIGH); // ExitIR
     }
     pulse_tdi(state[i] - '0');
     // TMS already set to 0 "shiftir" state to shift in bit to IR
@@ -110,7 +192,7 @@ void scan_idcode(){
     for(j = 0; j < IDCODE_LEN;j++) {
       /* we send '0' in */
       pulse_tdi(0);
-      tdo_read = digitalRead(PIN_TDO);
+      tdo_read = JTAG_READ(PIN_TDO);
       if (tdo_read)
         idcodes[i] |= ( (uint32_t) 1 ) << j;
     } /* for(j=0; ... ) */
@@ -130,7 +212,7 @@ void scan_idcode(){
   } else {
     Serial.println("No JTAG Devices");
   }
-  
+  jtag_tap = JP_ST_UNKNOWN;
 }
 
 
@@ -149,6 +231,7 @@ static void sample(int iterations){
     if (i % 32  == 31 ) Serial.print(" ");
     if (i % 128 == 127) Serial.println();
   }
+  jtag_tap = JP_ST_UNKNOWN;
 }
 
 void boundary_scan(){
@@ -174,31 +257,393 @@ void exec(){
   }
 }
 
+byte exec_svf_bit(byte tms, byte tdi){
+  jtag_tap = jp_tap_step(jtag_tap, tms, &jtag_ones);
+  return jtag_clock(tms, tdi);
+}
+
+// ASCII "$<tms><tdi><tdo>"; a TDI of 'x' leaves the pin as it was
 byte exec_svf_cmd(char tms, char tdi){
-  byte tdo_read;
-  if (DELAY) delayMicroseconds(DELAYUS);
-  digitalWrite(PIN_TCK, LOW);
-  //////////////////////////////////////
-  // PUT TMS
-  if (tms == '0')
-    digitalWrite(PIN_TMS, LOW);
-  else if (tms == '1')
-    digitalWrite(PIN_TMS, HIGH);
-  // PUT TDI
-    if (tdi == '0')
-      digitalWrite(PIN_TDI, LOW);
-  else if (tdi == '1')
-    digitalWrite(PIN_TDI, HIGH);
-  // READ TDO
-  tdo_read = digitalRead(PIN_TDO);
-  ///////////////////////////////////
-  digitalWrite(PIN_TCK, HIGH);
-  return tdo_read;
+  return exec_svf_bit(tms == '1', (tdi == '0' || tdi == '1') ? tdi - '0' : JTAG_READ(PIN_TDI));
+}
+
+/**
+ * Clocks count bits of packed TMS and TDI (tms NULL: TMS low throughout),
+ * storing TDO packed from bit pos of tdo on, which must be zeroed
+ */
+void jtag_shift(const byte* tms, const byte* tdi, unsigned int count, byte* tdo, unsigned int pos){
+  byte tms_byte = 0, tdi_byte = 0, in_mask = 0;
+  byte out_mask = 1 << (pos & 7);
+  byte* out = tdo + (pos >> 3);
+  if (!tms && count > 0) jtag_ones = 0;  // TMS low: the state doesn't change
+  while (count--) {
+    if (!in_mask) {
+      tms_byte = tms ? *tms++ : 0;
+      tdi_byte = *tdi++;
+      in_mask = 1;
+    }
+    byte tms_bit = (tms_byte & in_mask) != 0;
+    if (tms) jtag_tap = jp_tap_step(jtag_tap, tms_bit, &jtag_ones);
+    if (jtag_clock(tms_bit, (tdi_byte & in_mask) != 0))
+      *out |= out_mask;
+    in_mask <<= 1;
+    out_mask <<= 1;
+    if (!out_mask) {
+      out_mask = 1;
+      out++;
+    }
+  }
+}
+
+// $BENCH: TCK rate of the shift engine against jtag_clock_portable(), with
+// no DELAY pacing. Leaves the TAP in an unknown state
+void bench_tck(){
+  const unsigned int n = 8 * sizeof(pkt_out);
+  unsigned long t, fast, slow;
+  byte r;
+  bool delay = DELAY;
+  DELAY = false;
+  memset(pkt, 0, sizeof(pkt_out));
+  memset(pkt_out, 0, sizeof(pkt_out));
+  t = micros();
+  for (r = 0; r < 16; r++)
+    jtag_shift(NULL, pkt, n, pkt_out, 0);
+  fast = micros() - t;
+  t = micros();
+  for (r = 0; r < 16; r++)
+    for (unsigned int i = 0; i < n; i++)
+      jtag_clock_portable(0, 0);
+  slow = micros() - t;
+  DELAY = delay;
+  jtag_tap = JP_ST_UNKNOWN;
+  Serial.print("TCK kHz: shift engine ");
+  Serial.print(16000UL * n / fast);
+  Serial.print(", digitalWrite ");
+  Serial.println(16000UL * n / slow);
+}
+
+/**
+ * Binary packet interface (see jtagproto.h)
+ */
+
+void send_packet(byte op, const byte* payload, unsigned int len){
+  byte hdr[JP_HDR_LEN] = {JP_SYNC, op, (byte)(len & 0xff), (byte)(len >> 8)};
+  Serial.write(hdr, JP_HDR_LEN);
+  if (len > 0) Serial.write(payload, len);
+}
+
+void send_error(byte code){
+  send_packet(JP_OP_ERROR, &code, 1);
+}
+
+void exec_shift(unsigned int len){
+  unsigned int clocks, nbytes;
+  if (len < 2) { send_error(JP_ERR_LENGTH); return; }
+  clocks = pkt[0] | ((unsigned int)pkt[1] << 8);
+  nbytes = JP_BYTES(clocks);
+  if (clocks > JP_MAX_CLOCKS || len != 2 + 2 * nbytes) {
+    send_error(JP_ERR_LENGTH);
+    return;
+  }
+  memset(pkt_out, 0, nbytes);
+  jtag_shift(pkt + 2, pkt + 2 + nbytes, clocks, pkt_out, 0);
+  send_packet(JP_OP_SHIFT, pkt_out, nbytes);
+}
+
+// Checks a JP_OP_BATCH or JP_OP_VERIFY payload before anything runs;
+// returns the number of TDO bits it captures, or -1 after sending the error.
+// Counts are checked against JP_MAX_CLOCKS before anything is computed from
+// them, as JP_BYTES() and the sums wrap around in 16 bits
+int check_batch(unsigned int len, bool verify){
+  unsigned int i = 0, n, count;
+  unsigned int captured = 0;
+  while (i < len) {
+    n = 0;
+    switch (pkt[i]) {
+      case JP_SUB_GOTO:
+        n = 2;
+        break;
+      case JP_SUB_CLOCK:
+        n = 4;
+        break;
+      case JP_SUB_SHIFT:
+        if (i + 4 > len) break;
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        if (count > JP_MAX_CLOCKS) break;
+        n = 4 + JP_BYTES(count);
+        captured += count;
+        break;
+      case JP_SUB_ZSHIFT:
+        if (i + 5 > len || i + 5 + pkt[i + 4] > len) break;
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        if (count > JP_MAX_CLOCKS) break;
+        if (jp_unpack(pkt + i + 5, pkt[i + 4], NULL, JP_BYTES(count)))
+          n = 5 + pkt[i + 4];
+        captured += count;
+        break;
+      case JP_SUB_RAW:
+        if (i + 2 > len) break;
+        count = pkt[i + 1];
+        n = 2 + 2 * JP_BYTES(count);
+        captured += count;
+        break;
+      case JP_SUB_EXPECT:
+      case JP_SUB_ZEXPECT:
+        if (!verify) {
+          send_error(JP_ERR_OPCODE);
+          return -1;
+        }
+        if (i + 4 > len) break;
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        if (count > JP_MAX_CLOCKS) break;
+        if (pkt[i] == JP_SUB_EXPECT)
+          n = jp_expect_len(pkt[i + 1], count);
+        else if (i + 5 <= len && i + 5 + pkt[i + 4] <= len &&
+            jp_unpack(pkt + i + 5, pkt[i + 4], NULL, jp_expect_vectors(pkt[i + 1], count)))
+          n = 5 + pkt[i + 4];
+        if (count > captured) n = 0;
+        break;
+      default:
+        send_error(JP_ERR_OPCODE);
+        return -1;
+    }
+    if (n == 0 || i + n > len || captured > JP_MAX_CLOCKS) {
+      send_error(JP_ERR_LENGTH);
+      return -1;
+    }
+    i += n;
+  }
+  return captured;
+}
+
+bool exec_goto(byte dst){
+  byte dist[JP_ST_COUNT];
+  if (dst < JP_ST_RESET || dst >= JP_ST_COUNT || jtag_tap < JP_ST_RESET)
+    return false;
+  jp_tap_distances(dst, dist);
+  while (jtag_tap != dst) {
+    const byte* next = jp_tap_next[jtag_tap];
+    exec_svf_bit(dist[next[1]] < dist[next[0]], 0);
+  }
+  return true;
+}
+
+// JP_SUB_EXPECT at sub: compares its TDO with the last count bits captured
+// in pkt_out; returns the offset of the first mismatch, or -1
+int check_expect(const byte* sub, unsigned int captured){
+  byte flags = sub[1];
+  unsigned int count = sub[2] | ((unsigned int)sub[3] << 8);
+  unsigned int pos = captured - count;
+  const byte* tdo = (flags & JP_EXPECT_FILL) ? NULL : sub + 4;
+  const byte* mask = (flags & JP_EXPECT_ALL) ? NULL : sub + 4 + (tdo ? JP_BYTES(count) : 0);
+  byte fill = (flags & JP_EXPECT_ONES) != 0;
+  for (unsigned int k = 0; k < count; k++) {
+    if (mask && !mask[k >> 3]) {
+      k |= 7;  // nothing checked in this byte
+      continue;
+    }
+    byte bit = 1 << (k & 7);
+    if (mask && !(mask[k >> 3] & bit)) continue;
+    unsigned int p = pos + k;
+    if (((pkt_out[p >> 3] >> (p & 7)) & 1) != (tdo ? (tdo[k >> 3] & bit) != 0 : fill))
+      return p;
+  }
+  return -1;
+}
+
+// Shifts count clocks of tdiv in Shift-DR/IR, with TMS high on the last one
+// if JP_SHIFT_EXIT is in flags; false if the TAP isn't in either state
+bool shift_sub(byte flags, unsigned int count, const byte* tdiv, unsigned int* captured){
+  unsigned int k;
+  if (jtag_tap != JP_ST_DRSHIFT && jtag_tap != JP_ST_IRSHIFT)
+    return false;
+  k = (flags & JP_SHIFT_EXIT) && count > 0 ? count - 1 : count;
+  jtag_shift(NULL, tdiv, k, pkt_out, *captured);
+  *captured += k;
+  if (k < count) {
+    if (exec_svf_bit(1, (tdiv[k >> 3] >> (k & 7)) & 1))
+      pkt_out[*captured >> 3] |= 1 << (*captured & 7);
+    (*captured)++;
+  }
+  return true;
+}
+
+// The JP_OP_VERIFY response for a mismatch at bad: the offset goes in front
+// of the TDO captured so far
+void send_mismatch(int bad, unsigned int captured){
+  byte hdr[JP_HDR_LEN + 2] = {JP_SYNC, JP_OP_VERIFY, (byte)(2 + JP_BYTES(captured)), 0,
+                              (byte)(bad & 0xff), (byte)(bad >> 8)};
+  verify_failed = true;
+  Serial.write(hdr, sizeof(hdr));
+  Serial.write(pkt_out, JP_BYTES(captured));
+}
+
+// JP_OP_BATCH, or JP_OP_VERIFY if verify: the same sub-ops, but TDO is
+// checked here and only a mismatch is sent back
+void exec_batch(unsigned int len, bool verify){
+  unsigned int i = 0, k, count, captured = 0;
+  byte flags, tms, tdi;
+  int total, bad;
+  if (verify && len == 0) {
+    verify_failed = false;
+    send_packet(JP_OP_VERIFY, pkt_out, 0);
+    return;
+  }
+  if (verify && verify_failed) { send_error(JP_ERR_VERIFY); return; }
+  total = check_batch(len, verify);
+  if (total < 0) return;
+  memset(pkt_out, 0, JP_BYTES(total));
+  while (i < len) {
+    switch (pkt[i]) {
+      case JP_SUB_GOTO:
+        if (!exec_goto(pkt[i + 1])) { send_error(JP_ERR_STATE); return; }
+        i += 2;
+        break;
+      case JP_SUB_CLOCK:
+        flags = pkt[i + 1];
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        tms = (flags & JP_CLK_TMS) != 0;
+        tdi = (flags & JP_CLK_TDI) != 0;
+        // The state settles within five clocks of constant TMS
+        for (k = 0; k < count && k < 8; k++)
+          exec_svf_bit(tms, tdi);
+        for (; k < count; k++)
+          jtag_clock(tms, tdi);
+        i += 4;
+        break;
+      case JP_SUB_SHIFT:
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        if (!shift_sub(pkt[i + 1], count, pkt + i + 4, &captured)) {
+          send_error(JP_ERR_STATE);
+          return;
+        }
+        i += 4 + JP_BYTES(count);
+        break;
+      case JP_SUB_ZSHIFT:
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        if (count > 0) {
+          jp_unpack(pkt + i + 5, pkt[i + 4], pkt_unpacked, JP_BYTES(count));
+          if (!shift_sub(pkt[i + 1], count, pkt_unpacked, &captured)) {
+            send_error(JP_ERR_STATE);
+            return;
+          }
+        }
+        i += 5 + pkt[i + 4];
+        break;
+      case JP_SUB_RAW: {
+        count = pkt[i + 1];
+        const byte* tmsv = pkt + i + 2;
+        const byte* tdiv = tmsv + JP_BYTES(count);
+        jtag_shift(tmsv, tdiv, count, pkt_out, captured);
+        captured += count;
+        i += 2 + 2 * JP_BYTES(count);
+        break;
+      }
+      case JP_SUB_EXPECT:
+        bad = check_expect(pkt + i, captured);
+        if (bad >= 0) {
+          send_mismatch(bad, captured);
+          return;
+        }
+        i += jp_expect_len(pkt[i + 1], pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8));
+        break;
+      case JP_SUB_ZEXPECT:
+        count = pkt[i + 2] | ((unsigned int)pkt[i + 3] << 8);
+        memcpy(pkt_unpacked, pkt + i, 4);
+        jp_unpack(pkt + i + 5, pkt[i + 4], pkt_unpacked + 4, jp_expect_vectors(pkt[i + 1], count));
+        bad = check_expect(pkt_unpacked, captured);
+        if (bad >= 0) {
+          send_mismatch(bad, captured);
+          return;
+        }
+        i += 5 + pkt[i + 4];
+        break;
+    }
+  }
+  if (verify)
+    send_packet(JP_OP_VERIFY, pkt_out, 0);
+  else
+    send_packet(JP_OP_BATCH, pkt_out, JP_BYTES(total));
+}
+
+// JP_OP_BAUD: answers at the current rate, then switches
+void exec_baud(unsigned int len){
+  byte resp[4];
+  unsigned long baud;
+  if (len != 4) { send_error(JP_ERR_LENGTH); return; }
+  baud = jp_get_u32(pkt);
+  if (baud < MIN_BAUD || baud > MAX_BAUD) baud = 0;
+  jp_put_u32(resp, baud);
+  send_packet(JP_OP_BAUD, resp, 4);
+  if (baud) {
+    Serial.flush();
+    Serial.end();
+    Serial.begin(baud);
+  }
+}
+
+// JP_OP_FREQ: every TCK period becomes at least DELAYUS long
+void exec_freq(unsigned int len){
+  byte resp[4];
+  unsigned long hz;
+  if (len != 4) { send_error(JP_ERR_LENGTH); return; }
+  hz = jp_get_u32(pkt);
+  DELAY = hz > 0 && hz < TCK_MAX_HZ;
+  if (DELAY) {
+    DELAYUS = (1000000UL + hz - 1) / hz;
+    hz = 1000000UL / DELAYUS;
+  }
+  jp_put_u32(resp, DELAY ? hz : 0);
+  send_packet(JP_OP_FREQ, resp, 4);
+}
+
+// JP_OP_CREDIT: how much the host may queue up behind the running packet
+void exec_credit(unsigned int len){
+  byte resp[2] = {(SERIAL_RX_BUFFER_SIZE - 1) & 0xff, (SERIAL_RX_BUFFER_SIZE - 1) >> 8};
+  if (len != 0) { send_error(JP_ERR_LENGTH); return; }
+  send_packet(JP_OP_CREDIT, resp, 2);
+}
+
+// Called once the sync byte has been consumed; reads the rest of the packet
+void exec_packet(){
+  byte hdr[JP_HDR_LEN - 1];
+  unsigned int len;
+  if (Serial.readBytes((char*)hdr, sizeof(hdr)) != sizeof(hdr)) return;
+  len = hdr[1] | ((unsigned int)hdr[2] << 8);
+  if (len > JP_MAX_PAYLOAD || Serial.readBytes((char*)pkt, len) != len) {
+    send_error(JP_ERR_LENGTH);
+    return;
+  }
+  switch (hdr[0]) {
+    case JP_OP_SHIFT:
+      exec_shift(len);
+      break;
+    case JP_OP_BATCH:
+      exec_batch(len, false);
+      break;
+    case JP_OP_VERIFY:
+      exec_batch(len, true);
+      break;
+    case JP_OP_BAUD:
+      exec_baud(len);
+      break;
+    case JP_OP_FREQ:
+      exec_freq(len);
+      break;
+    case JP_OP_CREDIT:
+      exec_credit(len);
+      break;
+    default:
+      send_error(JP_ERR_OPCODE);
+      break;
+  }
 }
 
 void setup() {
   // Serial
   Serial.begin(115200);
+  // Don't wait forever on a truncated binary packet
+  Serial.setTimeout(100);
   // Initialize JTAG PINS
   pinMode(PIN_TCK, OUTPUT);
   pinMode(PIN_TMS, OUTPUT);
@@ -213,13 +658,20 @@ void loop() {
   char inp;
   char tms, tdi;
   byte tdo;
-  if (Serial.available() && cmd_indx < CMDLEN - 1){
+  // Drain everything that has arrived, so the receive buffer frees up as
+  // fast as the host's credit assumes
+  while (Serial.available()){
     inp = Serial.read();
-    if (inp == '\n' || inp == '\r'){
+    if (cmd_indx == 0 && (byte)inp == JP_SYNC){
+      // Binary packet; never part of an ASCII command
+      exec_packet();
+    } else if (inp == '\n' || inp == '\r'){
       if (!strncmp(command, "$RST", 4)){
         // Command: Reset the JTAG Programming.
         // We send the JTAG.IDCODE as response
         scan_idcode();
+      } else if (!strncmp(command, "$BENCH", 6)){
+        bench_tck();
       } else if (cmd_indx == 4 && command[0]=='$'){
         // It's a valid command sent by our svf player
         tms = command[1];
@@ -238,7 +690,9 @@ void loop() {
       Serial.flush();
     } else {
 //      Serial.println(inp); // Disabled echo back
-      command[cmd_indx++] = inp;
+      // Overlong lines are cut short rather than stalling the reader
+      if (cmd_indx < CMDLEN - 1)
+        command[cmd_indx++] = inp;
     }
   }
 }
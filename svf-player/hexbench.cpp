@@ -0,0 +1,92 @@
+// hexbench: checks the hex decoders in libsvfplayer.h against the original
+// nibble-at-a-time svfParseHex() and measures their throughput.
+#include "libsvfplayer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+using namespace std;
+
+// svfParseHex() as it was before the table/SIMD decoders
+string svfParseHexLegacy(const char* s, int len) {
+	string out;
+	bool incomplete=false;
+	for(const char* ch=s+len-1;ch>=s;ch--) {
+		uchar halfByte=parseHexChar(*ch);
+		if(halfByte==255) return string();
+		if(incomplete) {
+			out[out.length()-1]=((uchar)out[out.length()-1])|(halfByte<<4);
+		} else {
+			out+=halfByte;
+		}
+		incomplete=!incomplete;
+	}
+	return out;
+}
+
+double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+string randomHex(int len) {
+	static const char digits[]="0123456789abcdefABCDEF";
+	string s(len,0);
+	for(int i=0;i<len;i++) s[i]=digits[rand()%22];
+	return s;
+}
+
+bool check(svfDecodeHexFn fn, const char* name) {
+	for(int len=0;len<300;len++) {
+		for(int iter=0;iter<20;iter++) {
+			string s=randomHex(len);
+			if(len>0 && iter%4==3) s[rand()%len]="g/:@G \x80"[rand()%7];
+			string expect=svfParseHexLegacy(s.data(),len);
+			string got((len+1)/2,0);
+			bool ok=fn(s.data(),len,(uchar*)&got[0]);
+			if(!ok) got.clear();
+			if(got!=expect) {
+				fprintf(stderr,"%s: mismatch for \"%s\"\n",name,s.c_str());
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	int len=argc>1?atoi(argv[1]):4<<20;	//digits per value; default is a 16 Mbit SDR
+	int reps=argc>2?atoi(argv[2]):20;
+	srand(1);
+	string s=randomHex(len);
+	string out;
+
+	struct {
+		const char* name;
+		svfDecodeHexFn fn;
+	} impls[]={
+		{"scalar",svfDecodeHexScalar},
+#if defined(__x86_64__) || defined(__i386__)
+		{"ssse3",__builtin_cpu_supports("ssse3")?svfDecodeHexSSSE3:NULL},
+#endif
+	};
+	for(auto& impl: impls) {
+		if(impl.fn && !check(impl.fn,impl.name)) return EXIT_FAILURE;
+	}
+
+	double t=now();
+	for(int i=0;i<reps;i++) out=svfParseHexLegacy(s.data(),len);
+	double base=(now()-t)/reps;
+	printf("%-8s %8.1f MB/s\n","legacy",len/base/1e6);
+	for(auto& impl: impls) {
+		if(!impl.fn) continue;
+		out.resize((len+1)/2);
+		t=now();
+		for(int i=0;i<reps;i++) impl.fn(s.data(),len,(uchar*)&out[0]);
+		double dt=(now()-t)/reps;
+		printf("%-8s %8.1f MB/s (%.1fx)\n",impl.name,len/dt/1e6,base/dt);
+	}
+	printf("svfDecodeHex uses %s\n",svfDecodeHex==svfDecodeHexScalar?"scalar":"ssse3");
+	return EXIT_SUCCESS;
+}
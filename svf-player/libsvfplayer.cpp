@@ -0,0 +1,277 @@
+// libsvfplayer: the parts of libsvfplayer.h that aren't inline. Built into
+// libsvfplayer.a and libsvfplayer.so; link one of them into every program
+// that includes the header.
+#include "libsvfplayer.h"
+#include <thread>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+svfState svfLookupState(string_view s) {
+	int cnt=ARRSIZE(svfStates);
+	for(int i=0;i<cnt;i++) {
+		if(s==svfStates[i])
+			return (svfState)i;
+	}
+	return svfState::UNDEFINED;
+}
+svfOp svfLookupOp(string_view s) {
+	int cnt=ARRSIZE(svfOps);
+	for(int i=0;i<cnt;i++) {
+		if(s==svfOps[i])
+			return (svfOp)i;
+	}
+	return svfOp::UNDEFINED;
+}
+uchar parseHexChar(char c) {
+	uchar c2=(uchar)c;
+	if(c2>=(uchar)'0' && c2<=(uchar)'9') return c2-(uchar)'0';
+	if(c2>=(uchar)'a' && c2<=(uchar)'f') return c2-(uchar)'a'+10;
+	if(c2>=(uchar)'A' && c2<=(uchar)'F') return c2-(uchar)'A'+10;
+	return 255;
+}
+
+const svfHexTable svfHexDigits;
+
+bool svfDecodeHexScalar(const char* s, size_t len, uchar* out) {
+	const uchar* t=svfHexDigits.v;
+	const uchar* p=(const uchar*)s+len;
+	uchar bad=0;
+	for(size_t i=0;i<len/2;i++) {
+		uchar lo=t[*--p],hi=t[*--p];
+		bad|=lo|hi;
+		out[i]=lo|(hi<<4);
+	}
+	if(len&1) {
+		uchar lo=t[*--p];
+		bad|=lo;
+		out[len/2]=lo;
+	}
+	return !(bad&0xf0);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//16 digits per step: validate and convert to nibbles, pair them up with
+//pmaddubsw and reverse the byte order with pshufb
+__attribute__((target("ssse3")))
+bool svfDecodeHexSSSE3(const char* s, size_t len, uchar* out) {
+	const __m128i c0=_mm_set1_epi8('0'-1),c9=_mm_set1_epi8('9'+1);
+	const __m128i ca=_mm_set1_epi8('a'-1),cf=_mm_set1_epi8('f'+1);
+	const __m128i lower=_mm_set1_epi8(0x20);
+	const __m128i digitBias=_mm_set1_epi8('0'),alphaBias=_mm_set1_epi8('a'-10);
+	const __m128i weights=_mm_set1_epi16(0x0110);		//bytes: 16, 1
+	const __m128i reverse=_mm_setr_epi8(14,12,10,8,6,4,2,0,
+		-1,-1,-1,-1,-1,-1,-1,-1);
+	size_t n=0;
+	for(;len-n*2>=16;n+=8) {
+		__m128i v=_mm_loadu_si128((const __m128i*)(s+len-n*2-16));
+		__m128i l=_mm_or_si128(v,lower);
+		__m128i isDigit=_mm_and_si128(_mm_cmpgt_epi8(v,c0),_mm_cmplt_epi8(v,c9));
+		__m128i isAlpha=_mm_and_si128(_mm_cmpgt_epi8(l,ca),_mm_cmplt_epi8(l,cf));
+		if(_mm_movemask_epi8(_mm_or_si128(isDigit,isAlpha))!=0xffff) return false;
+		__m128i nib=_mm_or_si128(
+			_mm_and_si128(isDigit,_mm_sub_epi8(v,digitBias)),
+			_mm_and_si128(isAlpha,_mm_sub_epi8(l,alphaBias)));
+		__m128i pairs=_mm_maddubs_epi16(nib,weights);
+		_mm_storel_epi64((__m128i*)(out+n),_mm_shuffle_epi8(pairs,reverse));
+	}
+	return svfDecodeHexScalar(s,len-n*2,out+n);
+}
+#endif
+
+static svfDecodeHexFn svfSelectDecodeHex() {
+#if defined(__x86_64__) || defined(__i386__)
+	if(__builtin_cpu_supports("ssse3")) return svfDecodeHexSSSE3;
+#endif
+	return svfDecodeHexScalar;
+}
+const svfDecodeHexFn svfDecodeHex=svfSelectDecodeHex();
+
+void svfParseHex(const char* s, int len, string& out) {
+	out.resize((len+1)/2);
+	if(!svfDecodeHex(s,len,(uchar*)&out[0])) out.clear();
+}
+string svfParseHex(const char* s, int len) {
+	string out;
+	svfParseHex(s,len,out);
+	return out;
+}
+
+//64 bit FNV-1a
+uint64_t svfHash(const void* data, size_t len) {
+	const uchar* p=(const uchar*)data;
+	uint64_t h=0xcbf29ce484222325ULL;
+	for(size_t i=0;i<len;i++) {
+		h^=p[i];
+		h*=0x100000001b3ULL;
+	}
+	return h;
+}
+
+//##########################################################################################
+/***************** parallel parsing *****************/
+//##########################################################################################
+//svfParser::processBufferParallel(): the buffer is cut into chunks of about
+//svfParallelChunk bytes, each ending on a ';' that ends a command. worker
+//threads take the chunks in order and parse them with svfParsers of their
+//own, a few chunks ahead of nextCommand(), which hands their commands out
+//in order. a command doesn't depend on the ones before it, so only the line
+//numbers need fixing up: each chunk counts from 0 and nextCommand() adds the
+//lines of the chunks before it
+struct svfParsedCommand {
+	svfCommand cmd;
+	int line;				//lineNum after it, counting from the chunk's start
+	size_t end;				//cmdEnd after it
+};
+struct svfParseChunk {
+	//the first count are the chunk's; the rest are kept for their storage
+	vector<svfParsedCommand> cmds;
+	size_t count=0;
+	int lines=0;			//newlines in the chunk
+	bool failed=false;		//parsing threw on the command at errPos, errLine
+	size_t errPos=0;
+	int errLine=0;
+	atomic<bool> done{false};
+};
+struct svfParallelParse {
+	const char* data;
+	size_t len,chunkSize;
+	vector<svfParseChunk> slots;		//chunk k is in slots[k%slots.size()]
+	mutex claimLock;
+	int64_t claimed=0;					//chunks handed to the workers
+	size_t claimEnd=0;					//where the next chunk starts
+	atomic<int64_t> total{-1};			//number of chunks, once they're all handed out
+	atomic<int64_t> consumed{0};		//chunks nextCommand() is done with
+	atomic<bool> stopping{false};
+	vector<thread> workers;
+	//nextCommand()'s position: command index of chunk current
+	int64_t current=0;
+	size_t index=0;
+	int lineBase=1;
+	
+	svfParallelParse(const char* s, size_t n, int threads, size_t chunk):
+		data(s),len(n),chunkSize(max<size_t>(chunk,1)),slots(threads*4) {
+		for(int i=0;i<threads;i++) workers.emplace_back(&svfParallelParse::work,this);
+	}
+	~svfParallelParse() {
+		stopping=true;
+		for(thread& t: workers) t.join();
+	}
+	//end of the chunk starting at from: just past the first ';' from
+	//chunkSize bytes on, skipping those on // comment lines as svfParser does
+	size_t boundary(size_t from) {
+		size_t i=from+chunkSize-1;
+		while(i<len) {
+			const char* semi=(const char*)memchr(data+i,';',len-i);
+			if(semi==NULL) break;
+			size_t pos=semi-data;
+			const char* nl=(const char*)memrchr(data,'\n',pos);
+			size_t line=nl?(size_t)(nl-data)+1:0;
+			if(!(data[line]=='/' && line+1<len && data[line+1]=='/')) return pos+1;
+			i=pos+1;
+		}
+		return len;
+	}
+	void work() {
+		svfBackoff backoff;
+		while(!stopping) {
+			int64_t k;
+			size_t from,to;
+			{
+				lock_guard<mutex> lock(claimLock);
+				if(total>=0) return;
+				if(claimEnd>=len) {
+					total=claimed;
+					return;
+				}
+				from=claimEnd;
+				to=boundary(from);
+				k=claimed++;
+				claimEnd=to;
+			}
+			while(k-consumed.load(memory_order_acquire)>=(int64_t)slots.size()) {
+				if(stopping) return;
+				backoff.wait();
+			}
+			backoff.reset();
+			svfParseChunk& c=slots[k%slots.size()];
+			parse(c,from,to);
+			c.done.store(true,memory_order_release);
+		}
+	}
+	void parse(svfParseChunk& c, size_t from, size_t to) {
+		svfParser p;
+		p.reset();
+		p.quiet=true;
+		p.processBuffer(data,len);
+		p.dataPos=from;
+		p.dataStop=to;
+		p.lineNum=0;
+		c.count=0;
+		c.failed=false;
+		while(!stopping) {
+			size_t pos=p.dataPos;
+			int line=p.lineNum;
+			if(c.count==c.cmds.size()) c.cmds.emplace_back();
+			svfParsedCommand& pc=c.cmds[c.count];
+			try {
+				if(!p.nextCommand(pc.cmd)) break;
+			} catch(...) {
+				c.failed=true;
+				c.errPos=pos;
+				c.errLine=line;
+				break;
+			}
+			pc.line=p.lineNum;
+			pc.end=p.cmdEnd;
+			c.count++;
+		}
+		c.lines=p.lineNum;
+	}
+};
+
+void svfParser::processBufferParallel(const char* s, size_t len, int threads, size_t chunk) {
+	processBuffer(s,len);
+	if(threads>1) _parallel=make_shared<svfParallelParse>(s,len,threads,chunk);
+}
+
+bool svfParser::_nextParallelCommand(svfCommand& out) {
+	svfParallelParse& pp=*_parallel;
+	svfBackoff backoff;
+	while(true) {
+		int64_t total=pp.total.load(memory_order_acquire);
+		if(total>=0 && pp.current>=total) {
+			lineNum=pp.lineBase;
+			dataPos=dataLen;
+			_parallel.reset();
+			return false;
+		}
+		svfParseChunk& c=pp.slots[pp.current%pp.slots.size()];
+		if(!c.done.load(memory_order_acquire)) {
+			backoff.wait();
+			continue;
+		}
+		backoff.reset();
+		if(pp.index<c.count) {
+			svfParsedCommand& pc=c.cmds[pp.index++];
+			swap(out,pc.cmd);
+			lineNum=pp.lineBase+pc.line;
+			cmdEnd=pc.end;
+			return true;
+		}
+		if(c.failed) {
+			//parse the command that failed again, here, and go on without
+			//threads: the error is then thrown just as processBuffer() would
+			dataPos=c.errPos;
+			lineNum=pp.lineBase+c.errLine;
+			_parallel.reset();
+			return nextCommand(out);
+		}
+		pp.lineBase+=c.lines;
+		c.done.store(false,memory_order_relaxed);
+		pp.index=0;
+		pp.current++;
+		pp.consumed.store(pp.current,memory_order_release);
+	}
+}
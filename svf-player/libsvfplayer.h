@@ -5,8 +5,18 @@
 #include <limits.h>
 #include <memory.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <stdexcept>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <atomic>
+#include <functional>
+#include <memory>
 using namespace std;
 
 
@@ -17,7 +27,7 @@ typedef unsigned char uchar;
 //##########################################################################################
 /***************** constants and stateless utility functions *****************/
 //##########################################################################################
-const char* svfStates[] = {"UNDEFINED","UNKNOWN","RESET","IDLE","DRSELECT",
+inline const char* svfStates[] = {"UNDEFINED","UNKNOWN","RESET","IDLE","DRSELECT",
 	"DRCAPTURE","DRSHIFT","DREXIT1","DRPAUSE","DREXIT2","DRUPDATE",
 	"IRSELECT","IRCAPTURE","IRSHIFT","IREXIT1","IRPAUSE","IREXIT2",
 	"IRUPDATE"};
@@ -29,49 +39,9 @@ enum class svfState {
 	IRSELECT,IRCAPTURE,IRSHIFT,IREXIT1,IRPAUSE,IREXIT2,
 	IRUPDATE
 };
-vector<svfState> svfAllStates={svfState::UNDEFINED};
-#define svfIRStates svfState::IRSELECT, \
-		svfState::IRCAPTURE, \
-		svfState::IRSHIFT, \
-		svfState::IREXIT1, \
-		svfState::IRPAUSE, \
-		svfState::IREXIT2, \
-		svfState::IRUPDATE
-#define svfDRStates svfState::DRSELECT, \
-		svfState::DRCAPTURE, \
-		svfState::DRSHIFT, \
-		svfState::DREXIT1, \
-		svfState::DRPAUSE, \
-		svfState::DREXIT2, \
-		svfState::DRUPDATE
+constexpr int svfNumStates=int(svfState::IRUPDATE)+1;
 
-//at each source state, the list of dst states that you should output '0' (on tms) on
-vector<svfState> svfPathTable[]={
-	{},											//UNDEFINED
-	{},											//UNKNOWN
-	svfAllStates,								//RESET
-	{},											//IDLE
-	{svfDRStates},								//DRSELECT
-	{svfState::DRSHIFT},						//DRCAPTURE
-	{},											//DRSHIFT
-	{svfState::DRSHIFT,svfState::DRPAUSE,
-		svfState::DREXIT2},						//DREXIT1
-	{},											//DRPAUSE
-	{svfState::DRSHIFT,svfState::DRPAUSE,
-		svfState::DREXIT1},						//DREXIT2
-	{svfState::IDLE},							//DRUPDATE
-	
-	{svfIRStates},								//IRSELECT
-	{svfState::IRSHIFT},						//IRCAPTURE
-	{},											//IRSHIFT
-	{svfState::IRSHIFT,svfState::IRPAUSE,
-		svfState::IREXIT2},						//IREXIT1
-	{},											//IRPAUSE
-	{svfState::IRSHIFT,svfState::IRPAUSE,
-		svfState::IREXIT1},						//IREXIT2
-	{svfState::IDLE}							//IRUPDATE
-};
-svfState svfTransitionTable[] = {
+inline constexpr svfState svfTransitionTable[] = {
 	//	0						1
 	svfState::UNDEFINED,	svfState::UNDEFINED,	//UNDEFINED
 	svfState::UNKNOWN,		svfState::UNKNOWN,		//UNKNOWN
@@ -92,52 +62,183 @@ svfState svfTransitionTable[] = {
 	svfState::IRSHIFT,		svfState::IRUPDATE,		//IREXIT2
 	svfState::IDLE,			svfState::DRSELECT		//IRUPDATE
 };
+static_assert(ARRSIZE(svfTransitionTable)==svfNumStates*2,"svfTransitionTable size");
 
-const char* svfOps[] = {"UNDEFINED","ENDDR","ENDIR","FREQUENCY",
-	"HDR","HIR","RUNTEST","SDR","SIR","STATE","TDR","TIR","TRST"};
-enum class svfOp {
-	UNDEFINED=0,ENDDR,ENDIR,FREQUENCY,
-	HDR,HIR,RUNTEST,SDR,SIR,STATE,TDR,TIR,TRST
+//the tms value to output at src on the way to dst. this is the routing the
+//svf spec mandates: pause and exit states loop back through shift/pause
+//rather than update, and everything else takes the shortest path
+constexpr int svfTmsToward(svfState src, svfState dst) {
+	bool dr=dst>=svfState::DRSELECT && dst<=svfState::DRUPDATE;
+	bool ir=dst>=svfState::IRSELECT && dst<=svfState::IRUPDATE;
+	switch(src) {
+		case svfState::RESET: return 0;
+		case svfState::DRSELECT: return dr?0:1;
+		case svfState::DRCAPTURE: return dst==svfState::DRSHIFT?0:1;
+		case svfState::DREXIT1: return (dst==svfState::DRSHIFT||dst==svfState::DRPAUSE||
+			dst==svfState::DREXIT2)?0:1;
+		case svfState::DREXIT2: return (dst==svfState::DRSHIFT||dst==svfState::DRPAUSE||
+			dst==svfState::DREXIT1)?0:1;
+		case svfState::DRUPDATE: return dst==svfState::IDLE?0:1;
+		case svfState::IRSELECT: return ir?0:1;
+		case svfState::IRCAPTURE: return dst==svfState::IRSHIFT?0:1;
+		case svfState::IREXIT1: return (dst==svfState::IRSHIFT||dst==svfState::IRPAUSE||
+			dst==svfState::IREXIT2)?0:1;
+		case svfState::IREXIT2: return (dst==svfState::IRSHIFT||dst==svfState::IRPAUSE||
+			dst==svfState::IREXIT1)?0:1;
+		case svfState::IRUPDATE: return dst==svfState::IDLE?0:1;
+		default: return 1;
+	}
+}
+
+//tms bits (LSB first) that move the TAP from one state to another
+struct svfTmsPath {
+	uint16_t bits;
+	uint8_t len;
+	bool valid;		//false if dst can't be reached from src
 };
-svfState svfLookupState(const char* s) {
-	int cnt=ARRSIZE(svfStates);
-	for(int i=0;i<cnt;i++) {
-		if(strcmp(s,svfStates[i])==0)
-			return (svfState)i;
+struct svfTmsPathTable {
+	svfTmsPath path[svfNumStates][svfNumStates];
+	
+	constexpr const svfTmsPath& operator()(svfState src, svfState dst) const {
+		return path[int(src)][int(dst)];
+	}
+};
+constexpr svfTmsPathTable svfBuildTmsPaths() {
+	svfTmsPathTable t{};
+	for(int src=int(svfState::RESET);src<svfNumStates;src++)
+		for(int dst=int(svfState::RESET);dst<svfNumStates;dst++) {
+			svfTmsPath& p=t.path[src][dst];
+			svfState s=svfState(src);
+			while(s!=svfState(dst) && p.len<16) {
+				int tms=svfTmsToward(s,svfState(dst));
+				p.bits|=uint16_t(tms<<p.len);
+				p.len++;
+				s=svfTransitionTable[int(s)*2+tms];
+			}
+			p.valid=(s==svfState(dst));
+		}
+	//from UNKNOWN, five or more 1s get to RESET from anywhere
+	const int resetLen=6;
+	t.path[int(svfState::UNKNOWN)][int(svfState::UNKNOWN)]={0,0,true};
+	for(int dst=int(svfState::RESET);dst<svfNumStates;dst++) {
+		const svfTmsPath& r=t.path[int(svfState::RESET)][dst];
+		t.path[int(svfState::UNKNOWN)][dst]={uint16_t(((1<<resetLen)-1)|(r.bits<<resetLen)),
+			uint8_t(resetLen+r.len),r.valid};
 	}
-	return svfState::UNDEFINED;
+	return t;
 }
-svfOp svfLookupOp(const char* s) {
-	int cnt=ARRSIZE(svfOps);
-	for(int i=0;i<cnt;i++) {
-		if(strcmp(s,svfOps[i])==0)
-			return (svfOp)i;
+inline constexpr svfTmsPathTable svfTmsPaths=svfBuildTmsPaths();
+
+//compile time checks of svfTmsPaths against svfTransitionTable: every path
+//must end at its destination without passing it, and be no longer than the
+//shortest one (the svf routing rules never take a detour), which must be
+//unique so a programmer can find the same path on its own. paths out of
+//UNKNOWN must work whatever state the TAP is really in
+constexpr svfState svfWalkTms(svfState s, uint16_t bits, int len) {
+	for(int i=0;i<len;i++) s=svfTransitionTable[int(s)*2+((bits>>i)&1)];
+	return s;
+}
+constexpr int svfShortestPath(svfState src, svfState dst) {
+	int dist[svfNumStates]={};
+	for(int i=0;i<svfNumStates;i++) dist[i]=-1;
+	int queue[svfNumStates]={},head=0,tail=0;
+	dist[int(src)]=0;
+	queue[tail++]=int(src);
+	while(head<tail) {
+		int s=queue[head++];
+		for(int tms=0;tms<2;tms++) {
+			int next=int(svfTransitionTable[s*2+tms]);
+			if(dist[next]<0) {
+				dist[next]=dist[s]+1;
+				queue[tail++]=next;
+			}
+		}
 	}
-	return svfOp::UNDEFINED;
+	return dist[int(dst)];
 }
-uchar parseHexChar(char c) {
-	uchar c2=(uchar)c;
-	if(c2>=(uchar)'0' && c2<=(uchar)'9') return c2-(uchar)'0';
-	if(c2>=(uchar)'a' && c2<=(uchar)'f') return c2-(uchar)'a'+10;
-	if(c2>=(uchar)'A' && c2<=(uchar)'F') return c2-(uchar)'A'+10;
-	return 255;
+constexpr int svfShortestPathCount(svfState src, svfState dst) {
+	int dist[svfNumStates]={},count[svfNumStates]={};
+	for(int i=0;i<svfNumStates;i++) dist[i]=-1;
+	int queue[svfNumStates]={},head=0,tail=0;
+	dist[int(src)]=0;
+	count[int(src)]=1;
+	queue[tail++]=int(src);
+	while(head<tail) {
+		int s=queue[head++];
+		for(int tms=0;tms<2;tms++) {
+			int next=int(svfTransitionTable[s*2+tms]);
+			if(dist[next]<0) {
+				dist[next]=dist[s]+1;
+				queue[tail++]=next;
+			}
+			if(dist[next]==dist[s]+1) count[next]+=count[s];
+		}
+	}
+	return count[int(dst)];
 }
-//returns empty string on error
-string svfParseHex(const char* s, int len) {
-	string out;
-	bool incomplete=false;
-	for(const char* ch=s+len-1;ch>=s;ch--) {
-		uchar halfByte=parseHexChar(*ch);
-		if(halfByte==255) return string();
-		if(incomplete) {
-			out[out.length()-1]=((uchar)out[out.length()-1])|(halfByte<<4);
-		} else {
-			out+=halfByte;
+constexpr bool svfCheckTmsPaths() {
+	for(int dst=int(svfState::RESET);dst<svfNumStates;dst++) {
+		for(int src=int(svfState::RESET);src<svfNumStates;src++) {
+			const svfTmsPath& p=svfTmsPaths.path[src][dst];
+			if(!p.valid) return false;
+			if(svfWalkTms(svfState(src),p.bits,p.len)!=svfState(dst)) return false;
+			for(int i=1;i<p.len;i++)
+				if(svfWalkTms(svfState(src),p.bits,i)==svfState(dst)) return false;
+			if(p.len!=svfShortestPath(svfState(src),svfState(dst))) return false;
+			if(src!=dst && svfShortestPathCount(svfState(src),svfState(dst))!=1) return false;
+			const svfTmsPath& u=svfTmsPaths.path[int(svfState::UNKNOWN)][dst];
+			if(!u.valid || svfWalkTms(svfState(src),u.bits,u.len)!=svfState(dst)) return false;
 		}
-		incomplete=!incomplete;
 	}
-	return out;
+	return true;
 }
+static_assert(svfCheckTmsPaths(),"svfTmsPaths disagrees with svfTransitionTable");
+//paths given as examples in the svf spec
+static_assert(svfTmsPaths(svfState::RESET,svfState::IDLE).bits==0b0 &&
+	svfTmsPaths(svfState::RESET,svfState::IDLE).len==1,"RESET->IDLE");
+static_assert(svfTmsPaths(svfState::IDLE,svfState::DRPAUSE).bits==0b0101 &&
+	svfTmsPaths(svfState::IDLE,svfState::DRPAUSE).len==4,"IDLE->DRPAUSE");
+static_assert(svfTmsPaths(svfState::DRPAUSE,svfState::IRPAUSE).bits==0b0101111 &&
+	svfTmsPaths(svfState::DRPAUSE,svfState::IRPAUSE).len==7,"DRPAUSE->IRPAUSE");
+static_assert(svfTmsPaths(svfState::IRPAUSE,svfState::DRSHIFT).bits==0b00111 &&
+	svfTmsPaths(svfState::IRPAUSE,svfState::DRSHIFT).len==5,"IRPAUSE->DRSHIFT");
+static_assert(svfTmsPaths(svfState::DREXIT1,svfState::DRPAUSE).bits==0b0 &&
+	svfTmsPaths(svfState::DREXIT1,svfState::DRPAUSE).len==1,"DREXIT1->DRPAUSE");
+
+inline const char* svfOps[] = {"UNDEFINED","ENDDR","ENDIR","FREQUENCY",
+	"HDR","HIR","RUNTEST","SDR","SIR","STATE","TDR","TIR","TRST"};
+enum class svfOp {
+	UNDEFINED=0,ENDDR,ENDIR,FREQUENCY,
+	HDR,HIR,RUNTEST,SDR,SIR,STATE,TDR,TIR,TRST
+};
+//the lookups and hex decoders are compiled into the library (libsvfplayer.cpp)
+svfState svfLookupState(string_view s);
+svfOp svfLookupOp(string_view s);
+uchar parseHexChar(char c);
+
+//the value of every hex digit, 255 for other characters
+struct svfHexTable {
+	uchar v[256];
+	svfHexTable() {
+		for(int i=0;i<256;i++) v[i]=parseHexChar((char)i);
+	}
+};
+extern const svfHexTable svfHexDigits;
+
+//hex decoders: s holds len digits, most significant first; out receives
+//(len+1)/2 bytes, least significant first. they return false on a bad digit
+bool svfDecodeHexScalar(const char* s, size_t len, uchar* out);
+#if defined(__x86_64__) || defined(__i386__)
+bool svfDecodeHexSSSE3(const char* s, size_t len, uchar* out);
+#endif
+typedef bool (*svfDecodeHexFn)(const char* s, size_t len, uchar* out);
+//the fastest decoder this cpu supports, picked at startup
+extern const svfDecodeHexFn svfDecodeHex;
+
+//decodes into out, reusing its storage; out is left empty on error
+void svfParseHex(const char* s, int len, string& out);
+//returns empty string on error
+string svfParseHex(const char* s, int len);
 
 //##########################################################################################
 /***************** parser *****************/
@@ -153,9 +254,28 @@ struct svfCommand {
 	//in the case of RUNTEST, data.dataLen specifies the number of
 	//clock rising edges while in RUN-TEST/IDLE state
 	svfData data;
-	double frequency;
+	double frequency;		//FREQUENCY in Hz, 0 for full speed
 	vector<svfState> states;
 };
+//stream mode: input is read this much at a time, and a hex value still open
+//when more than svfStreamHexText of text is waiting is decoded on the spot
+constexpr size_t svfStreamChunk=1<<18;
+constexpr size_t svfStreamHexText=1<<18;
+//how much of the current line is kept for currentLine()
+constexpr size_t svfStreamLineKeep=256;
+//stream mode: leading digits of a hex value, packed two per byte with the
+//most significant (first) digit in the high nibble of nibbles[0]
+struct svfHexPrefix {
+	int value;				//which hex value of the command, counting from 0
+	string nibbles;
+	int64_t digits=0;
+};
+//fills buf with up to n bytes of input; returns 0 at the end
+typedef function<size_t(char* buf, size_t n)> svfReadFn;
+//processBufferParallel(): the buffer is parsed this much at a time
+constexpr size_t svfParallelChunk=1<<18;
+struct svfParallelParse;
+
 struct svfParser {
 	//usage: call reset(), then read one line at a time from the svf file;
 	//each time a line is read,
@@ -163,17 +283,56 @@ struct svfParser {
 	//		the parser will retain a reference to the line; do not free it yet
 	//2. repeatedly call nextCommand() until false is returned
 	//3. free the line
+	//
+	//alternatively, call reset() and then processBuffer() once with the whole
+	//file (e.g. memory mapped), and call nextCommand() until false is returned.
+	//commands are then scanned in place and tokens point into the buffer;
+	//the buffer must stay valid until parsing is done
+	//
+	//or call reset() and then processStream() with a function that reads the
+	//input, e.g. from a decompressor. the parser pulls svfStreamChunk bytes
+	//at a time as nextCommand() needs them, so memory use doesn't depend on
+	//the size of the file or of its largest command
+	//
+	//or call reset() and then processBufferParallel(), which is like
+	//processBuffer() but parses with several threads (see libsvfplayer.cpp).
+	//nextCommand() returns the same commands, line numbers and errors
 	
 	int lineNum=0;
 	const char* curLine=NULL;
 	int curLineLen=0;
-	string buf;
+	string buf;				//command text spanning several lines (line mode)
+	string hexBuf;			//hex values spanning several words
+	string_view cmdText;	//text of the command being parsed
 	int bufI;
+	//buffer mode
+	const char* data=NULL;
+	size_t dataLen=0,dataPos=0;
+	size_t cmdEnd=0;		//offset of the ';' ending the last command
+	size_t dataStop=SIZE_MAX;	//parse only up to here (a chunk of a parallel parse)
+	//stream mode; data points into window
+	svfReadFn readFn;
+	string window;			//input read so far from the start of the current line on
+	bool streamEnd=false;
+	vector<svfHexPrefix> hexParts;	//of the command at dataPos
+	int hexValue=0;			//hex values read from cmdText so far
+	bool quiet=false;		//nothing on stderr (the threads of a parallel parse)
+	shared_ptr<svfParallelParse> _parallel;
+	
 	void reset() {
 		lineNum=0;
 		curLine=NULL;
 		curLineLen=0;
 		buf.clear();
+		cmdText=string_view();
+		data=NULL;
+		dataLen=dataPos=cmdEnd=0;
+		readFn=nullptr;
+		window.clear();
+		streamEnd=false;
+		hexParts.clear();
+		dataStop=SIZE_MAX;
+		_parallel.reset();
 	}
 	void processLine(const char* line, int len) {
 		lineNum++;
@@ -181,35 +340,67 @@ struct svfParser {
 		curLine=line;
 		curLineLen=len;
 	}
+	void processBuffer(const char* s, size_t len) {
+		data=s;
+		dataLen=len;
+		dataPos=0;
+		lineNum=1;
+	}
+	void processStream(svfReadFn read) {
+		processBuffer(NULL,0);
+		readFn=read;
+		window.clear();
+		streamEnd=false;
+	}
+	void processBufferParallel(const char* s, size_t len, int threads, size_t chunk=svfParallelChunk);
+	//in buffer and stream mode, the source line the last command ended on.
+	//a stream only has what's left of it in the window
+	string_view currentLine() const {
+		if(data==NULL) return string_view(curLine,curLine?curLineLen:0);
+		size_t b=cmdEnd,e=cmdEnd;
+		while(b>0 && data[b-1]!='\n') b--;
+		while(e<dataLen && data[e]!='\n') e++;
+		if(e<dataLen) e++;
+		return string_view(data+b,e-b);
+	}
 	bool nextCommand(svfCommand& out) {
-		if(!_readCommand()) return false;
-		//command text is in buf
+		if(_parallel) return _nextParallelCommand(out);
+		if(readFn) {
+			if(!_readStreamCommand()) return false;
+		} else if(data!=NULL) {
+			if(!_readBufferCommand()) return false;
+		} else if(!_readCommand()) return false;
+		//command text is in cmdText
 		_beginRead();
-		string cmd=_readWord();
-		out.op=svfLookupOp(cmd.c_str());
+		string_view cmd=_readWord();
+		out.op=svfLookupOp(cmd);
 		switch(out.op) {
 		case svfOp::UNDEFINED:
-			_parseError("unknown svf command: "+cmd);
+			_parseError("unknown svf command: "+string(cmd));
 			break;
 		case svfOp::ENDDR:
 		case svfOp::ENDIR:
 		{
-			string st=_readWord();
+			string_view st=_readWord();
 			out.states.clear();
-			out.states.push_back(svfLookupState(st.c_str()));
+			out.states.push_back(svfLookupState(st));
 			if(out.states[0]==svfState::UNDEFINED)
-				_parseError("unknown state: "+st);
+				_parseError("unknown state: "+string(st));
 			break;
 		}
 		case svfOp::FREQUENCY:
-			out.frequency=_readDouble();
-			_expect("HZ");
+			//no argument: back to full speed
+			out.frequency=0;
+			if(_readWord(true).length()>0) {
+				out.frequency=_readDouble();
+				_expect("HZ");
+			}
 			break;
 		case svfOp::RUNTEST:
 		{
-			string st=_readWord(true);
+			string_view st=_readWord(true);
 			out.states.clear();
-			out.states.push_back(svfLookupState(st.c_str()));
+			out.states.push_back(svfLookupState(st));
 			if(out.states[0]!=svfState::UNDEFINED)
 				_readWord();
 			out.data.dataLen=_readInt();
@@ -219,11 +410,11 @@ struct svfParser {
 		case svfOp::STATE:
 		{
 			out.states.clear();
-			string tmp;
+			string_view tmp;
 			while((tmp=_readWord()).length()>0) {
-				svfState st=svfLookupState(tmp.c_str());
+				svfState st=svfLookupState(tmp);
 				if(st==svfState::UNDEFINED)
-					_parseError("unknown state: "+tmp);
+					_parseError("unknown state: "+string(tmp));
 				out.states.push_back(st);
 			}
 			break;
@@ -240,18 +431,18 @@ struct svfParser {
 			out.data.tdoData.clear();
 			out.data.tdiMask.clear();
 			out.data.tdoMask.clear();
-			string tmp;
+			string_view tmp;
 			while((tmp=_readWord()).length()>0) {
-				if(tmp.compare("TDI")==0) {
-					out.data.tdiData=_readHexValue();
-				} else if(tmp.compare("TDO")==0) {
-					out.data.tdoData=_readHexValue();
-				} else if(tmp.compare("MASK")==0) {
-					out.data.tdoMask=_readHexValue();
-				} else if(tmp.compare("SMASK")==0) {
-					out.data.tdiMask=_readHexValue();
+				if(tmp=="TDI") {
+					_readHexValue(out.data.tdiData);
+				} else if(tmp=="TDO") {
+					_readHexValue(out.data.tdoData);
+				} else if(tmp=="MASK") {
+					_readHexValue(out.data.tdoMask);
+				} else if(tmp=="SMASK") {
+					_readHexValue(out.data.tdiMask);
 				} else {
-					_parseError("unknown attribute: "+tmp);
+					_parseError("unknown attribute: "+string(tmp));
 				}
 			}
 			// if TDO was specified but not MASK, assume a mask of all 1s
@@ -265,24 +456,26 @@ struct svfParser {
 			_expect_either("OFF", "ABSENT");
 			break;
 		default:
-			_parseError("unknown svf command: "+cmd);
+			_parseError("unknown svf command: "+string(cmd));
 			break;
 		}
 		_skipSpaces();
-		if(bufI<(int)buf.length()) {
-			fprintf(stderr,"%d %d %d\n",bufI,(int)buf.length(),(int)buf[bufI]);
-			_parseError("garbage after command: "+buf.substr(bufI));
+		if(bufI<(int)cmdText.length()) {
+			if(!quiet) fprintf(stderr,"%d %d %d\n",bufI,(int)cmdText.length(),(int)cmdText[bufI]);
+			_parseError("garbage after command: "+string(cmdText.substr(bufI)));
 		}
 		buf.clear();
+		hexParts.clear();
 		return true;
 	}
+	bool _nextParallelCommand(svfCommand& out);
 	int _findChr(const char* s, int len, char c) {
 		const void* tmp=memchr(s,c,len);
 		if(tmp==NULL) return -1;
 		return ((char*)tmp)-s;
 	}
 	
-	//reads the next command text and stores it in buf
+	//reads the next command text and points cmdText at it
 	bool _readCommand() {
 		if(curLine==NULL || curLineLen==0) return false;
 		int semiColon=_findChr(curLine,curLineLen,';');
@@ -293,46 +486,246 @@ struct svfParser {
 			curLineLen=0;
 			return false;
 		}
-		buf.append(curLine,semiColon);
+		if(buf.empty()) {
+			//whole command is on this line; no need to copy it
+			cmdText=string_view(curLine,semiColon);
+		} else {
+			buf.append(curLine,semiColon);
+			cmdText=buf;
+		}
 		curLine+=semiColon+1;
 		curLineLen-=(semiColon+1);
 		if(curLineLen==0) curLine=NULL;
 		return true;
 	}
+	//buffer mode version of _readCommand(). like processLine(), lines
+	//starting with // are skipped; a command is only copied into buf in
+	//the rare case that such a line sits in the middle of it
+	bool _readBufferCommand() {
+		size_t start=dataPos;
+		size_t stop=min(dataLen,dataStop);
+		buf.clear();
+		while(true) {
+			if(dataPos>=stop) {
+				dataPos=stop;
+				return false;
+			}
+			const char* semi=(const char*)memchr(data+dataPos,';',stop-dataPos);
+			size_t end=semi?(size_t)(semi-data):stop;
+			size_t comment=_findComment(dataPos,end);
+			if(comment<end) {
+				//keep what came before the comment, skip the comment line
+				buf.append(data+start,comment-start);
+				lineNum+=_countLines(dataPos,comment);
+				const char* nl=(const char*)memchr(data+comment,'\n',dataLen-comment);
+				dataPos=nl?(size_t)(nl-data)+1:stop;
+				if(nl) lineNum++;
+				start=dataPos;
+				continue;
+			}
+			if(semi==NULL) {
+				lineNum+=_countLines(dataPos,stop);
+				dataPos=stop;
+				return false;
+			}
+			lineNum+=_countLines(dataPos,end);
+			if(buf.empty()) {
+				cmdText=string_view(data+start,end-start);
+			} else {
+				buf.append(data+start,end-start);
+				cmdText=buf;
+			}
+			cmdEnd=end;
+			dataPos=end+1;
+			return true;
+		}
+	}
+	//stream mode version of _readBufferCommand(): reads more input until
+	//the window holds a whole command
+	bool _readStreamCommand() {
+		while(true) {
+			size_t pos=dataPos;
+			int line=lineNum;
+			data=window.data();
+			dataLen=window.size();
+			if(_readBufferCommand()) return true;
+			if(streamEnd) return false;
+			dataPos=pos;
+			lineNum=line;
+			_fillWindow();
+		}
+	}
+	void _fillWindow() {
+		//drop what has been parsed, but keep the start of the line so that
+		//comments are still recognized at the start of the window
+		size_t keep=dataPos;
+		while(keep>0 && dataPos-keep<svfStreamLineKeep && window[keep-1]!='\n') keep--;
+		window.erase(0,keep);
+		dataPos-=keep;
+		cmdEnd=cmdEnd>keep?cmdEnd-keep:0;
+		if(window.size()-dataPos>svfStreamHexText) _decodeOpenHex();
+		size_t n=window.size();
+		window.resize(n+svfStreamChunk);
+		size_t got=readFn(&window[n],svfStreamChunk);
+		window.resize(n+got);
+		if(got==0) streamEnd=true;
+	}
+	//moves the digits of a hex value still open at the end of the window
+	//into hexParts, so a huge SDR isn't held as text. whole // comment
+	//lines go too; a line with anything else on it is left for
+	//_readBufferCommand(), along with the newline before it
+	void _decodeOpenHex() {
+		//the last ( that no ) follows, and how many values come before it;
+		//parentheses on comment lines don't count, as for _readBufferCommand()
+		size_t end=window.size(),open=string::npos;
+		int value=-1;
+		for(size_t i=dataPos;i<end;i++) {
+			if(_isCommentAt(i)) {
+				i=window.find('\n',i);
+				if(i==string::npos) break;
+				continue;
+			}
+			if(window[i]=='(') {
+				open=i;
+				value++;
+			} else if(window[i]==')') {
+				open=string::npos;
+			}
+		}
+		if(open==string::npos) return;
+		size_t cut=open+1;
+		for(size_t i=open+1;i<end;) {
+			if(_isCommentAt(i)) {
+				size_t nl=window.find('\n',i);
+				if(nl==string::npos) break;
+				i=cut=nl+1;
+				continue;
+			}
+			size_t j=i;
+			while(j<end && window[j]!='\n' && (isspace(window[j]) || svfHexDigits.v[(uchar)window[j]]<16)) j++;
+			if(j<end && window[j]!='\n') break;
+			i=cut=(j<end)?j+1:j;
+		}
+		if(cut<end && window[cut-1]=='\n') cut--;
+		if(cut<=open+1) return;
+		if(hexParts.empty() || hexParts.back().value!=value) {
+			hexParts.emplace_back();
+			hexParts.back().value=value;
+		}
+		svfHexPrefix& p=hexParts.back();
+		for(size_t i=open+1;i<cut;i++) {
+			if(_isCommentAt(i)) {
+				i=window.find('\n',i);
+				lineNum++;
+				continue;
+			}
+			uchar c=(uchar)window[i];
+			if(c=='\n') lineNum++;
+			uchar v=svfHexDigits.v[c];
+			if(v>=16) continue;
+			if(p.digits&1) p.nibbles.back()|=v;
+			else p.nibbles+=(char)(v<<4);
+			p.digits++;
+		}
+		window.erase(open+1,cut-open-1);
+	}
+	bool _isCommentAt(size_t i) {
+		return (i==0 || window[i-1]=='\n') && i+1<window.size() && window[i]=='/' && window[i+1]=='/';
+	}
+	//decodes a hex value whose leading digits are in p and the rest in s
+	void _joinHex(svfHexPrefix& p, string_view s, string& out) {
+		for(char c: s) {
+			uchar v=svfHexDigits.v[(uchar)c];
+			if(v>=16) {
+				out.clear();
+				return;
+			}
+			if(p.digits&1) p.nibbles.back()|=v;
+			else p.nibbles+=(char)(v<<4);
+			p.digits++;
+		}
+		auto nibble=[&](int64_t k) {
+			return k<0?0:((uchar)p.nibbles[k>>1]>>((k&1)?0:4))&0xf;
+		};
+		out.resize((p.digits+1)/2);
+		for(int64_t i=0;i<(int64_t)out.size();i++)
+			out[i]=(char)(nibble(p.digits-1-2*i)|(nibble(p.digits-2-2*i)<<4));
+	}
+	//offset of the first line in [from,to) that starts with //, or to
+	size_t _findComment(size_t from, size_t to) {
+		size_t i=from;
+		while(i<to) {
+			const char* slash=(const char*)memchr(data+i,'/',to-i);
+			if(slash==NULL) return to;
+			size_t pos=slash-data;
+			if((pos==0 || data[pos-1]=='\n') && pos+1<dataLen && data[pos+1]=='/')
+				return pos;
+			i=pos+1;
+		}
+		return to;
+	}
+	int _countLines(size_t from, size_t to) {
+		int n=0;
+		const char* p=data+from;
+		const char* e=data+to;
+		while((p=(const char*)memchr(p,'\n',e-p))!=NULL) {
+			n++;
+			p++;
+		}
+		return n;
+	}
 	
 	//cmd buffer manipulation functions
 	void _beginRead() {
 		bufI=0;
+		hexValue=0;
 	}
 	void _skipSpaces() {
-		while(bufI<(int)buf.length() && isspace(buf[bufI])) bufI++;
+		while(bufI<(int)cmdText.length() && isspace(cmdText[bufI])) bufI++;
 	}
-	string _readWord(bool peek=false) {
+	string_view _readWord(bool peek=false) {
 		_skipSpaces();
 		int i=bufI;
-		while(i<(int)buf.length() && !isspace(buf[i])) i++;
-		string s=buf.substr(bufI,i-bufI);
+		while(i<(int)cmdText.length() && !isspace(cmdText[i])) i++;
+		string_view s=cmdText.substr(bufI,i-bufI);
 		if(!peek) bufI=i;
 		return s;
 	}
-	string _readHexValue() {
+	//decodes "(hex digits)"; the digits may be split by whitespace
+	void _readHexValue(string& out) {
+		int value=hexValue++;
 		_expectChar('(');
-		string s=_readWord();
-		while(s.length()>0 && s[s.length()-1]!=')') {
-			string tmp=_readWord();
-			if(tmp.length()<=0) break;
-			s+=tmp;
-		}
-		if(s[s.length()-1]!=')') {
+		int close=_findChr(cmdText.data()+bufI,cmdText.length()-bufI,')');
+		if(close<0) {
+			bufI=cmdText.length();
 			_expectChar(')');
-			return svfParseHex(s.data(),s.length());
 		}
-		return svfParseHex(s.data(),s.length()-1);
+		string_view s=cmdText.substr(bufI,close);
+		bufI+=close+1;
+		bool split=false;
+		for(char c: s) if(isspace(c)) { split=true; break; }
+		if(split) {
+			hexBuf.clear();
+			for(char c: s) if(!isspace(c)) hexBuf+=c;
+			s=hexBuf;
+		}
+		if(!hexParts.empty() && hexParts.front().value==value) {
+			_joinHex(hexParts.front(),s,out);
+			hexParts.erase(hexParts.begin());
+			return;
+		}
+		svfParseHex(s.data(),s.length(),out);
+	}
+	//copies a numeric token into a small stack buffer for strtol/strtod
+	void _readNumber(char* tmp, int size, const char* what) {
+		string_view s=_readWord();
+		if(s.length()==0 || (int)s.length()>=size) _parseError(string("expected ")+what);
+		memcpy(tmp,s.data(),s.length());
+		tmp[s.length()]=0;
 	}
 	int _readInt() {
-		string s=_readWord();
-		if(s.length()==0) _parseError("expected integer");
-		const char* nptr=s.c_str();
+		char nptr[32];
+		_readNumber(nptr,sizeof(nptr),"integer");
 		char* endptr=NULL;
 		long tmp=strtol(nptr,&endptr,10);
 		if(endptr==nptr) _parseError("expected integer");
@@ -340,26 +733,25 @@ struct svfParser {
 		return (int)tmp;
 	}
 	double _readDouble() {
-		string s=_readWord();
-		if(s.length()==0) _parseError("expected number");
-		const char* nptr=s.c_str();
+		char nptr[64];
+		_readNumber(nptr,sizeof(nptr),"number");
 		char* endptr=NULL;
 		double tmp=strtod(nptr,&endptr);
 		if(endptr==nptr) _parseError("expected number");
 		return tmp;
 	}
 	void _expect(const char* x) {
-		string s=_readWord();
-		if(s.compare(x)!=0) _parseError("expecting: "+string(x));
+		string_view s=_readWord();
+		if(s!=x) _parseError("expecting: "+string(x));
 	}
 	void _expect_either(const char* x1, const char* x2){
-		string s=_readWord();
-		if(s.compare(x1)!=0 && s.compare(x2)!=0)
+		string_view s=_readWord();
+		if(s!=x1 && s!=x2)
 			_parseError("expecting: " + string(x1) + " or " + string(x2));
 	}
 	void _expectChar(char c) {
 		_skipSpaces();
-		if(bufI>=(int)buf.length() || buf[bufI]!=c) _parseError(string("expecting: ")+c);
+		if(bufI>=(int)cmdText.length() || cmdText[bufI]!=c) _parseError(string("expecting: ")+c);
 		bufI++;
 	}
 	//misc
@@ -371,24 +763,637 @@ struct svfParser {
 };
 
 //##########################################################################################
-/***************** player *****************/
+/***************** packed vectors *****************/
 //##########################################################################################
-struct svfPlayer {
-	svfState endDR,endIR,runTestState;
-	svfState deviceState;
-	svfData headerIR,headerDR,trailerIR,trailerDR,defaultIR,defaultDR;
+//read-only packed bits; bit i is in words[i/64], LSB first. the words
+//may belong to an svfBitVector or to a memory mapped file
+struct svfBitView {
+	const uint64_t* words=NULL;
+	int64_t len=0;
 	
-	//one byte per clock cycle; format of each byte:
+	bool get(int64_t i) const {
+		return (words[i>>6]>>(i&63))&1;
+	}
+	//bits [pos,pos+n) as n<=64 bits right aligned
+	uint64_t getBits(int64_t pos, int n) const {
+		if(n<=0) return 0;
+		int off=pos&63;
+		uint64_t v=words[pos>>6]>>off;
+		if(off+n>64) v|=words[(pos>>6)+1]<<(64-off);
+		if(n<64) v&=(uint64_t(1)<<n)-1;
+		return v;
+	}
+	//copies bits [pos,pos+n) into a packed LSB-first byte array
+	void copyBytes(int64_t pos, int64_t n, uchar* out) const {
+		for(int64_t i=0;i<n;i+=8) {
+			int cnt=(n-i<8)?int(n-i):8;
+			out[i/8]=(uchar)getBits(pos+i,cnt);
+		}
+	}
+};
+
+//growable bit vector. bits past len are always zero
+struct svfBitVector {
+	vector<uint64_t> words;
+	int64_t len=0;
+	
+	svfBitView view() const {
+		svfBitView v;
+		v.words=words.data();
+		v.len=len;
+		return v;
+	}
+	void clear() {
+		words.clear();
+		len=0;
+	}
+	bool get(int64_t i) const {
+		return (words[i>>6]>>(i&63))&1;
+	}
+	void set(int64_t i, bool v) {
+		if(v) words[i>>6]|=uint64_t(1)<<(i&63);
+		else words[i>>6]&=~(uint64_t(1)<<(i&63));
+	}
+	//appends the low n bits of v (n<=64)
+	void appendBits(uint64_t v, int n) {
+		if(n<=0) return;
+		if(n<64) v&=(uint64_t(1)<<n)-1;
+		int off=len&63;
+		if(off==0) words.push_back(v);
+		else {
+			words.back()|=v<<off;
+			if(off+n>64) words.push_back(v>>(64-off));
+		}
+		len+=n;
+	}
+	//removes the first n bits
+	void dropFront(int64_t n) {
+		if(n>=len) {
+			clear();
+			return;
+		}
+		int64_t skip=n>>6;
+		int off=n&63;
+		int64_t newLen=len-n;
+		int64_t newWords=(newLen+63)/64;
+		for(int64_t i=0;i<newWords;i++) {
+			uint64_t v=words[i+skip]>>off;
+			if(off && i+skip+1<(int64_t)words.size()) v|=words[i+skip+1]<<(64-off);
+			words[i]=v;
+		}
+		words.resize(newWords);
+		len=newLen;
+		if(len&63) words.back()&=(uint64_t(1)<<(len&63))-1;
+	}
+	void appendRun(bool v, int64_t n) {
+		uint64_t w=v?~uint64_t(0):0;
+		for(;n>=64;n-=64) appendBits(w,64);
+		appendBits(w,n);
+	}
+	//appends n bits from a packed LSB-first byte array
+	void appendBytes(const uchar* data, int64_t n) {
+		int64_t i=0;
+		for(;i+64<=n;i+=64) {
+			uint64_t w=0;
+			for(int b=7;b>=0;b--) w=(w<<8)|data[i/8+b];
+			appendBits(w,64);
+		}
+		for(;i<n;i+=8) {
+			int cnt=(n-i<8)?int(n-i):8;
+			appendBits(data[i/8],cnt);
+		}
+	}
+	//appends bits [pos,pos+n) of src
+	void appendView(const svfBitView& src, int64_t pos, int64_t n) {
+		for(;n>=64;n-=64,pos+=64) appendBits(src.getBits(pos,64),64);
+		appendBits(src.getBits(pos,int(n)),int(n));
+	}
+};
+
+//the parallel bit streams of svfVectors, read-only
+struct svfVectorsView {
+	svfBitView tms,tdi,tdo,tdiCare,tdoCare;
+	
+	int64_t length() const {
+		return tms.len;
+	}
+	//legacy one byte per clock format:
 	//	bit 0: value to put on tms
 	//	bit 1: value to put on tdi
 	//	bit 2: value expected on tdo
 	//	bit 3: 0 if tdi is don't care, 1 otherwise
 	//	bit 4: 0 if tdo is don't care, 1 otherwise
-	string outBuffer;
+	uchar byteAt(int64_t i) const {
+		return uchar(tms.get(i)|(tdi.get(i)<<1)|(tdo.get(i)<<2)|
+			(tdiCare.get(i)<<3)|(tdoCare.get(i)<<4));
+	}
+	//first clock in [from,to) where received differs from tdo and tdo is
+	//cared about, or -1. works a word at a time as (received^tdo)&tdoCare
+	int64_t firstMismatch(const svfBitView& received, int64_t from, int64_t to) const {
+		if(to>received.len) to=received.len;
+		int64_t pos=from;
+		while(pos<to) {
+			if((pos&63)==0 && to-pos>=64) {
+				int64_t w=pos>>6;
+				uint64_t diff=(received.words[w]^tdo.words[w])&tdoCare.words[w];
+				if(diff) return pos+__builtin_ctzll(diff);
+				pos+=64;
+				continue;
+			}
+			int n=int(min<int64_t>(64-(pos&63),to-pos));
+			uint64_t diff=(received.getBits(pos,n)^tdo.getBits(pos,n))&tdoCare.getBits(pos,n);
+			if(diff) return pos+__builtin_ctzll(diff);
+			pos+=n;
+		}
+		return -1;
+	}
+};
+
+struct svfVectors;
+//where svfPlayer puts the clocks it generates, as they are generated.
+//svfVectors keeps them all; a sink can as well send them on, write them out,
+//check or count them, and then a long scan or RUNTEST is never held whole
+struct svfSink {
+	virtual ~svfSink() {}
+	//n clocks with a constant tms and nothing driven or checked: RUNTEST
+	virtual void appendTms(bool v, int64_t n)=0;
+	//n<=64 clocks with the given tms bits (LSB first) and nothing else:
+	//moves between states
+	virtual void appendTmsBits(uint64_t bits, int n)=0;
+	//n<=64 clocks given as the bits of each stream, in the order tms, tdi,
+	//tdo, tdiCare, tdoCare: scans from svfPlayer's segment cache
+	virtual void appendStreams(const uint64_t bits[5], int n)=0;
+	//the data.dataLen clocks of a shift: tms is low but on the last clock,
+	//where it's exit, and tdi, tdo and the masks come from data. values
+	//with fewer bits than dataLen are padded with zeros (see svfVectors)
+	virtual void appendShift(const svfData& data, bool exit)=0;
+	//the clocks so far if the sink keeps them, else NULL
+	virtual svfVectors* vectors() {
+		return NULL;
+	}
+};
+
+//one entry per clock cycle in each of the parallel bit streams
+struct svfVectors: svfSink {
+	svfBitVector tms;			//value to put on tms
+	svfBitVector tdi;			//value to put on tdi
+	svfBitVector tdo;			//value expected on tdo
+	svfBitVector tdiCare;		//0 if tdi is don't care, 1 otherwise
+	svfBitVector tdoCare;		//0 if tdo is don't care, 1 otherwise
+	
+	svfVectorsView view() const {
+		svfVectorsView v;
+		v.tms=tms.view(); v.tdi=tdi.view(); v.tdo=tdo.view();
+		v.tdiCare=tdiCare.view(); v.tdoCare=tdoCare.view();
+		return v;
+	}
+	int64_t length() const {
+		return tms.len;
+	}
+	void clear() {
+		tms.clear(); tdi.clear(); tdo.clear();
+		tdiCare.clear(); tdoCare.clear();
+	}
+	void dropFront(int64_t n) {
+		tms.dropFront(n); tdi.dropFront(n); tdo.dropFront(n);
+		tdiCare.dropFront(n); tdoCare.dropFront(n);
+	}
+	//appends clocks [pos,pos+n) of src
+	void append(const svfVectorsView& src, int64_t pos, int64_t n) {
+		tms.appendView(src.tms,pos,n); tdi.appendView(src.tdi,pos,n);
+		tdo.appendView(src.tdo,pos,n); tdiCare.appendView(src.tdiCare,pos,n);
+		tdoCare.appendView(src.tdoCare,pos,n);
+	}
+	void appendStreams(const uint64_t bits[5], int n) override {
+		tms.appendBits(bits[0],n); tdi.appendBits(bits[1],n);
+		tdo.appendBits(bits[2],n); tdiCare.appendBits(bits[3],n);
+		tdoCare.appendBits(bits[4],n);
+	}
+	void appendTms(bool v, int64_t n) override {
+		tms.appendRun(v,n);
+		tdi.appendRun(0,n); tdo.appendRun(0,n);
+		tdiCare.appendRun(0,n); tdoCare.appendRun(0,n);
+	}
+	void appendTmsBits(uint64_t bits, int n) override {
+		tms.appendBits(bits,n);
+		tdi.appendRun(0,n); tdo.appendRun(0,n);
+		tdiCare.appendRun(0,n); tdoCare.appendRun(0,n);
+	}
+	void appendShift(const svfData& data, bool exit) override {
+		appendShift(data,0,data.dataLen,exit);
+	}
+	//clocks [from,from+n) of a shift, for sinks that take a long one in
+	//pieces. from must be a multiple of 8
+	void appendShift(const svfData& data, int64_t from, int64_t n, bool exit) {
+		if(n<=0) return;
+		bool last=from+n==data.dataLen;
+		tms.appendRun(0,n-1);
+		tms.appendBits(exit && last,1);
+		_appendData(tdi,data.tdiData,from,n);
+		_appendData(tdo,data.tdoData,from,n);
+		_appendData(tdiCare,data.tdiMask,from,n);
+		_appendData(tdoCare,data.tdoMask,from,n);
+	}
+	//hex values may have fewer digits than the length calls for; the rest is 0
+	static void _appendData(svfBitVector& dst, const string& data, int64_t from, int64_t n) {
+		int64_t avail=min(n,(int64_t)data.length()*8-from);
+		if(avail>0) dst.appendBytes((const uchar*)data.data()+from/8,avail);
+		else avail=0;
+		dst.appendRun(0,n-avail);
+	}
+	svfVectors* vectors() override {
+		return this;
+	}
+	//legacy one byte per clock view, see svfVectorsView::byteAt()
+	uchar byteAt(int64_t i) const {
+		return view().byteAt(i);
+	}
+	string toBytes() const {
+		string out(length(),0);
+		svfVectorsView v=view();
+		for(int64_t i=0;i<length();i++) out[i]=v.byteAt(i);
+		return out;
+	}
+};
+
+//maps clock offsets back to the svf command (and its line) that generated them
+struct svfLineMark {
+	int64_t clock;		//first clock of the command
+	int32_t line;		//line number the command ends on
+	int32_t op;			//svfOp
+};
+//a FREQUENCY command: the highest TCK rate from clock on
+struct svfFreqMark {
+	int64_t clock;
+	double hz;			//0: no limit
+};
+struct svfLineIndex {
+	vector<svfLineMark> marks;
+	vector<svfFreqMark> freqs;
+	
+	void clear() {
+		marks.clear();
+		freqs.clear();
+	}
+	void add(int64_t clock, int line, svfOp op) {
+		svfLineMark m;
+		m.clock=clock;
+		m.line=line;
+		m.op=(int32_t)op;
+		marks.push_back(m);
+	}
+	void addFrequency(int64_t clock, double hz) {
+		freqs.push_back({clock,hz});
+	}
+	//index of the mark covering clock, or -1 if it's before the first mark
+	static int64_t lookup(const svfLineMark* marks, int64_t count, int64_t clock) {
+		int64_t lo=0,hi=count;
+		while(lo<hi) {
+			int64_t mid=(lo+hi)/2;
+			if(marks[mid].clock<=clock) lo=mid+1;
+			else hi=mid;
+		}
+		return lo-1;
+	}
+};
+
+//##########################################################################################
+/***************** pipeline utilities *****************/
+//##########################################################################################
+//bounded lock-free single-producer single-consumer queue. push() and pop()
+//never block; they return false when the ring is full/empty and the caller
+//backs off (see svfBackoff) and retries
+template<class T> struct svfRing {
+	vector<T> slots;
+	alignas(64) atomic<size_t> head{0};		//next slot to pop, owned by the consumer
+	alignas(64) atomic<size_t> tail{0};		//next slot to push, owned by the producer
+	
+	explicit svfRing(size_t capacity): slots(capacity+1) {}
+	//moves v into the ring on success
+	bool push(T& v) {
+		size_t t=tail.load(memory_order_relaxed);
+		size_t next=(t+1)%slots.size();
+		if(next==head.load(memory_order_acquire)) return false;
+		slots[t]=std::move(v);
+		tail.store(next,memory_order_release);
+		return true;
+	}
+	bool pop(T& v) {
+		size_t h=head.load(memory_order_relaxed);
+		if(h==tail.load(memory_order_acquire)) return false;
+		v=std::move(slots[h]);
+		head.store((h+1)%slots.size(),memory_order_release);
+		return true;
+	}
+};
+//spin briefly, then yield the cpu, then sleep; for waiting on an svfRing
+struct svfBackoff {
+	int spins=0;
+	void wait() {
+		spins++;
+		if(spins<16) return;
+		if(spins<256) sched_yield();
+		else usleep(50);
+	}
+	void reset() {
+		spins=0;
+	}
+};
+
+//##########################################################################################
+/***************** compiled vector files *****************/
+//##########################################################################################
+//a compiled svf file: the header, the five bit streams of svfVectors
+//((clocks+63)/64 little endian words each), an array of svfLineMark and
+//an array of svfFreqMark. all sections are 8 byte aligned so the file can
+//be used in place via mmap
+#define SVF_VECFILE_MAGIC "SVFVEC02"
+struct svfVecFileHeader {
+	char magic[8];
+	uint64_t sourceHash;		//svfHash() of the svf text it was compiled from
+	uint64_t sourceSize;
+	uint64_t clocks;
+	uint64_t commands;
+	uint64_t streamOffset[5];	//tms,tdi,tdo,tdiCare,tdoCare
+	uint64_t indexOffset;
+	uint64_t indexCount;
+	uint64_t freqOffset;
+	uint64_t freqCount;
+};
+
+//64 bit FNV-1a
+uint64_t svfHash(const void* data, size_t len);
+
+//a whole file mapped read-only, e.g. to feed svfParser::processBuffer()
+struct svfMappedFile {
+	const char* data=NULL;
+	size_t len=0;
+	void* _map=NULL;
+	
+	~svfMappedFile() {
+		close();
+	}
+	//returns false if the file can't be opened or mapped
+	bool open(const char* path) {
+		close();
+		int fd=::open(path,O_RDONLY);
+		if(fd<0) return false;
+		struct stat st;
+		if(fstat(fd,&st)<0) {
+			::close(fd);
+			return false;
+		}
+		len=st.st_size;
+		if(len==0) {
+			//mmap can't map empty files
+			::close(fd);
+			data="";
+			return true;
+		}
+		_map=mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+		::close(fd);
+		if(_map==MAP_FAILED) {
+			_map=NULL;
+			len=0;
+			return false;
+		}
+		madvise(_map,len,MADV_SEQUENTIAL);
+		data=(const char*)_map;
+		return true;
+	}
+	void close() {
+		if(_map!=NULL) munmap(_map,len);
+		_map=NULL;
+		data=NULL;
+		len=0;
+	}
+};
+
+struct svfVecFile {
+	svfVecFileHeader hdr;
+	svfVectorsView vectors;
+	const svfLineMark* index=NULL;
+	const svfFreqMark* freqs=NULL;
+	const uchar* map=NULL;
+	size_t mapLen=0;
+	
+	~svfVecFile() {
+		close();
+	}
+	static bool isVecFile(const char* path) {
+		char magic[8];
+		FILE* f=fopen(path,"rb");
+		if(f==NULL) return false;
+		bool ok=fread(magic,1,8,f)==8 && memcmp(magic,SVF_VECFILE_MAGIC,8)==0;
+		fclose(f);
+		return ok;
+	}
+	void open(const char* path) {
+		close();
+		int fd=::open(path,O_RDONLY);
+		if(fd<0) _err(string("could not open ")+path);
+		struct stat st;
+		if(fstat(fd,&st)<0 || st.st_size<(off_t)sizeof(hdr)) {
+			::close(fd);
+			_err(string(path)+": not a compiled vector file");
+		}
+		void* m=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+		::close(fd);
+		if(m==MAP_FAILED) _err(string("could not map ")+path);
+		map=(const uchar*)m;
+		mapLen=st.st_size;
+		memcpy(&hdr,map,sizeof(hdr));
+		uint64_t words=(hdr.clocks+63)/64;
+		bool ok=memcmp(hdr.magic,SVF_VECFILE_MAGIC,8)==0;
+		for(int i=0;i<5 && ok;i++)
+			ok=hdr.streamOffset[i]%8==0 && hdr.streamOffset[i]+words*8<=mapLen;
+		ok=ok && hdr.indexOffset%8==0 &&
+			hdr.indexOffset+hdr.indexCount*sizeof(svfLineMark)<=mapLen;
+		ok=ok && hdr.freqOffset%8==0 &&
+			hdr.freqOffset+hdr.freqCount*sizeof(svfFreqMark)<=mapLen;
+		if(!ok) {
+			close();
+			_err(string(path)+": not a compiled vector file or truncated");
+		}
+		svfBitView* streams[5]={&vectors.tms,&vectors.tdi,&vectors.tdo,
+			&vectors.tdiCare,&vectors.tdoCare};
+		for(int i=0;i<5;i++) {
+			streams[i]->words=(const uint64_t*)(map+hdr.streamOffset[i]);
+			streams[i]->len=hdr.clocks;
+		}
+		index=(const svfLineMark*)(map+hdr.indexOffset);
+		freqs=(const svfFreqMark*)(map+hdr.freqOffset);
+	}
+	void close() {
+		if(map!=NULL) munmap((void*)map,mapLen);
+		map=NULL;
+		mapLen=0;
+		index=NULL;
+		freqs=NULL;
+		vectors=svfVectorsView();
+	}
+	//writes to a temporary file first, so readers never see a partial file
+	static void write(const char* path, const svfVectors& v, const svfLineIndex& idx,
+			uint64_t sourceHash, uint64_t sourceSize, uint64_t commands) {
+		svfVecFileHeader h;
+		memset(&h,0,sizeof(h));
+		memcpy(h.magic,SVF_VECFILE_MAGIC,8);
+		h.sourceHash=sourceHash;
+		h.sourceSize=sourceSize;
+		h.clocks=v.length();
+		h.commands=commands;
+		uint64_t words=(h.clocks+63)/64;
+		const svfBitVector* streams[5]={&v.tms,&v.tdi,&v.tdo,&v.tdiCare,&v.tdoCare};
+		uint64_t off=sizeof(h);
+		for(int i=0;i<5;i++) {
+			h.streamOffset[i]=off;
+			off+=words*8;
+		}
+		h.indexOffset=off;
+		h.indexCount=idx.marks.size();
+		h.freqOffset=off+h.indexCount*sizeof(svfLineMark);
+		h.freqCount=idx.freqs.size();
+		
+		string tmp=string(path)+".tmp";
+		FILE* f=fopen(tmp.c_str(),"wb");
+		if(f==NULL) _err("could not create "+tmp);
+		bool ok=fwrite(&h,sizeof(h),1,f)==1;
+		for(int i=0;i<5 && ok;i++)
+			ok=words==0 || fwrite(streams[i]->words.data(),8,words,f)==words;
+		if(ok && h.indexCount>0)
+			ok=fwrite(idx.marks.data(),sizeof(svfLineMark),h.indexCount,f)==h.indexCount;
+		if(ok && h.freqCount>0)
+			ok=fwrite(idx.freqs.data(),sizeof(svfFreqMark),h.freqCount,f)==h.freqCount;
+		if(fclose(f)!=0) ok=false;
+		if(!ok || rename(tmp.c_str(),path)!=0) {
+			unlink(tmp.c_str());
+			_err(string("could not write ")+path);
+		}
+	}
+	static void _err(string msg) {
+		throw runtime_error("error: "+msg);
+	}
+};
+
+//##########################################################################################
+/***************** clock traces *****************/
+//##########################################################################################
+//every clock played and the TDO read back: the magic, then blocks that
+//follow each other from clock 0 on. a block is an svfTraceBlockHeader, five
+//bit streams ((clocks+63)/64 little endian words each: tms, tdi, tdo,
+//tdoCare and received) and markCount svfLineMark with trace clocks. the TAP
+//state isn't stored; it follows from tms, starting out UNKNOWN
+#define SVF_TRACE_MAGIC "SVFTRC01"
+struct svfTraceBlockHeader {
+	uint64_t clock;			//first clock of the block
+	uint64_t clocks;
+	uint64_t markCount;
+};
+struct svfTraceBlock {
+	svfTraceBlockHeader hdr;
+	svfBitVector streams[5];	//tms,tdi,tdo,tdoCare,received
+	vector<svfLineMark> marks;
+	
+	//clocks [from,to) of v, with received indexed like v, as trace clocks
+	//from clock on
+	void assign(const svfVectorsView& v, const svfBitView& received, int64_t from, int64_t to, int64_t clock) {
+		const svfBitView* src[5]={&v.tms,&v.tdi,&v.tdo,&v.tdoCare,&received};
+		hdr.clock=clock;
+		hdr.clocks=to-from;
+		hdr.markCount=0;
+		marks.clear();
+		for(int i=0;i<5;i++) {
+			streams[i].clear();
+			streams[i].appendView(*src[i],from,to-from);
+		}
+	}
+	void addMark(int64_t clock, int line, int op) {
+		svfLineMark m;
+		m.clock=clock;
+		m.line=line;
+		m.op=op;
+		marks.push_back(m);
+		hdr.markCount=marks.size();
+	}
+	bool write(FILE* f) const {
+		uint64_t words=(hdr.clocks+63)/64;
+		bool ok=fwrite(&hdr,sizeof(hdr),1,f)==1;
+		for(int i=0;i<5 && ok;i++)
+			ok=words==0 || fwrite(streams[i].words.data(),8,words,f)==words;
+		if(ok && hdr.markCount>0)
+			ok=fwrite(marks.data(),sizeof(svfLineMark),hdr.markCount,f)==hdr.markCount;
+		return ok;
+	}
+	//false at the end of the file; throws if the block is cut short
+	bool read(FILE* f) {
+		size_t n=fread(&hdr,1,sizeof(hdr),f);
+		if(n==0) return false;
+		bool ok=n==sizeof(hdr) && hdr.clocks<(uint64_t(1)<<40) && hdr.markCount<=hdr.clocks;
+		uint64_t words=ok?(hdr.clocks+63)/64:0;
+		for(int i=0;i<5 && ok;i++) {
+			streams[i].words.resize(words);
+			streams[i].len=hdr.clocks;
+			ok=words==0 || fread(streams[i].words.data(),8,words,f)==words;
+		}
+		if(ok) {
+			marks.resize(hdr.markCount);
+			ok=hdr.markCount==0 || fread(marks.data(),sizeof(svfLineMark),hdr.markCount,f)==hdr.markCount;
+		}
+		if(!ok) throw runtime_error("error: trace file truncated or corrupt");
+		return true;
+	}
+};
+
+//##########################################################################################
+/***************** player *****************/
+//##########################################################################################
+struct svfPlayer {
+	svfState endDR,endIR,runTestState;
+	svfState deviceState;
+	svfData headerIR,headerDR,trailerIR,trailerDR,defaultIR,defaultDR;
+	double frequency=0;		//TCK limit of the last FREQUENCY command, 0: none
+	
+	//generated clock cycles; the caller drains this with out.clear().
+	//out.byteAt()/out.toBytes() give the legacy one byte per clock format
+	svfVectors out;
+	//where the clocks go; point it at another sink to take them as they
+	//are generated instead of collecting them in out
+	svfSink* sink=&out;
+	
+	//SIR/SDR segment cache: svf files repeat the same short scans from the
+	//same state over and over, so the clocks of a scan (including the moves
+	//into and out of the shift state) are kept, keyed by everything they
+	//depend on, and copied on a repeat instead of being generated again.
+	//Only scans of up to one word of clocks are cached: longer ones are
+	//generated a word at a time anyway, and copying them back out of the
+	//cache costs as much as that
+	static constexpr int segmentMaxClocks=64;
+	static constexpr int segmentMaxEntries=4096;		//the cache is emptied when full
+	bool segmentCache=true;
+	int64_t cacheHits=0,cacheMisses=0;
+	//open addressing table with the keys in one arena, so filling the cache
+	//doesn't allocate per entry; hash 0 marks an empty slot
+	struct _segEntry {
+		uint64_t hash;
+		uint32_t keyOff,keyLen;
+		int clocks;
+		uint64_t bits[5];		//tms, tdi, tdo, tdiCare, tdoCare
+	};
+	vector<_segEntry> _segTable;
+	string _segKeys;			//keys of all entries back to back
+	int _segCount=0;
+	//recent lookups and hits for IR and DR scans, see _useSegmentCache()
+	int _segLookups[2]={0,0},_segHits[2]={0,0},_segSkipped[2]={0,0};
+	svfVectors _segScratch;		//misses, when the sink doesn't keep the clocks
+	string _segKey;				//only the first _segKeyLen bytes are the key
+	size_t _segKeyLen=0;
+	uint64_t _segKeyHash=0;		//of _segKey, set by _findSegment()
+	uint32_t _headerGen=0;		//bumped when a header or trailer changes
 	
 	void reset() {
 		endDR=endIR=runTestState=svfState::IDLE;
 		deviceState=svfState::UNKNOWN;
+		frequency=0;
 	}
 	void processCommand(const svfCommand& cmd) {
 		switch(cmd.op) {
@@ -399,7 +1404,8 @@ struct svfPlayer {
 				endIR=cmd.states[0];
 				break;
 			case svfOp::FREQUENCY:
-				_warn("FREQUENCY command not implemented. ignoring.");
+				//no clocks; the caller paces TCK from here on (see svfFreqMark)
+				frequency=cmd.frequency;
 				break;
 			case svfOp::HDR:
 			case svfOp::HIR:
@@ -423,6 +1429,7 @@ struct svfPlayer {
 					if(cmd.data.tdoMask.length()!=0)
 						dst.tdoMask=cmd.data.tdoMask;
 				}
+				_headerGen++;
 				break;
 			}
 			case svfOp::RUNTEST:
@@ -456,13 +1463,50 @@ struct svfPlayer {
 					padData(old);
 				}
 				
-				goToState(ir?svfState::IRSHIFT:svfState::DRSHIFT);
-				doShift(header);
-				doShift(old);
-				doShift(trailer);
-				outBuffer[outBuffer.length()-1]|=1;
-				calculateTransition(1);
-				goToState(ir?endIR:endDR);
+				svfState end=ir?endIR:endDR;
+				int64_t shiftLen=(int64_t)header.dataLen+old.dataLen+trailer.dataLen;
+				if(!segmentCache || shiftLen>segmentMaxClocks || !_useSegmentCache(ir)) {
+					doScan(ir,header,old,trailer,end);
+					break;
+				}
+				_makeSegmentKey(ir,old,end);
+				_segEntry& e=_findSegment();
+				if(++_segLookups[ir]>=1024) {
+					_segLookups[ir]/=2;
+					_segHits[ir]/=2;
+				}
+				if(e.hash!=0) {
+					sink->appendStreams(e.bits,e.clocks);
+					deviceState=end;
+					cacheHits++;
+					_segHits[ir]++;
+					break;
+				}
+				cacheMisses++;
+				svfVectors* v=sink->vectors();
+				int64_t start=0;
+				if(v) {
+					start=v->length();
+					doScan(ir,header,old,trailer,end);
+				} else {
+					//the clocks have to be read back: generate them into
+					//_segScratch, then pass them on
+					v=&_segScratch;
+					v->clear();
+					svfSink* dst=sink;
+					sink=v;
+					try {
+						doScan(ir,header,old,trailer,end);
+					} catch(...) {
+						sink=dst;
+						throw;
+					}
+					sink=dst;
+					_forward(v->view(),0,v->length());
+				}
+				//the moves in and out can take the scan past one word
+				if(v->length()-start<=segmentMaxClocks)
+					_addSegment(e,v->view(),start,v->length()-start);
 				break;
 			}
 			case svfOp::STATE:
@@ -487,54 +1531,131 @@ struct svfPlayer {
 		}
 		if(data.tdoMask.length()==0) data.tdoMask.assign(bytes,255);
 	}
+	//a whole SIR/SDR: into the shift state, header, data and trailer, then
+	//out to end
+	void doScan(bool ir, const svfData& header, const svfData& data, const svfData& trailer, svfState end) {
+		goToState(ir?svfState::IRSHIFT:svfState::DRSHIFT);
+		//the last clock shifted leaves the shift state; data is never empty
+		doShift(header);
+		doShift(data,trailer.dataLen<=0);
+		doShift(trailer,true);
+		calculateTransition(1);
+		goToState(end);
+	}
 	void doShift(const svfData& data, bool exit=false) {
-		for(int i=0;i<data.dataLen;i++) {
-			bool tms,tdi,tdo,tdiEnable,tdoEnable;
-			int mask=1<<(i%8);
-			tms=((i==(data.dataLen-1)) && exit);
-			tdi=(int(data.tdiData[i/8])&mask)!=0;
-			tdo=(int(data.tdoData[i/8])&mask)!=0;
-			tdiEnable=(int(data.tdiMask[i/8])&mask)!=0;
-			tdoEnable=(int(data.tdoMask[i/8])&mask)!=0;
-			outBuffer+=char(tms|(tdi<<1)|(tdo<<2)|(tdiEnable<<3)|(tdoEnable<<4));
-		}
+		if(data.dataLen<=0) return;
+		sink->appendShift(data,exit);
 	}
 	void doRunTest(svfState st, int count) {
 		goToState(st);
 		int tms=(st==svfState::RESET)?1:0;
-		for(int i=0;i<count;i++)
-			doTransition(tms);
+		if(count>0) sink->appendTms(tms,count);
 	}
 	void goToState(svfState st) {
-	_begin:
-		if(deviceState==st) return;
-		if(deviceState==svfState::UNKNOWN) {
-			doTransition(1); doTransition(1); doTransition(1);
-			doTransition(1); doTransition(1); doTransition(1);
-			deviceState=svfState::RESET;
-			goto _begin;
-		}
-		const vector<svfState>& table=svfPathTable[(int)deviceState];
-		for(int i=0;i<(int)table.size();i++) {
-			if(table[i]==svfState::UNDEFINED ||		//all match
-				table[i]==st) {
-				doTransition(0);
-				calculateTransition(0);
-				goto _begin;
-			}
+		const svfTmsPath& p=svfTmsPaths(deviceState,st);
+		if(!p.valid) _err("can not move from state "+string(svfStates[(int)deviceState])+
+			" to "+svfStates[(int)st]);
+		if(p.len>0) sink->appendTmsBits(p.bits,p.len);
+		deviceState=st;
+	}
+	//clocks [pos,pos+n) of src to the sink, a word at a time
+	void _forward(const svfVectorsView& src, int64_t pos, int64_t n) {
+		const svfBitView* streams[5]={&src.tms,&src.tdi,&src.tdo,&src.tdiCare,&src.tdoCare};
+		uint64_t bits[5];
+		for(;n>0;pos+=64,n-=64) {
+			int k=int(min<int64_t>(n,64));
+			for(int i=0;i<5;i++) bits[i]=streams[i]->getBits(pos,k);
+			sink->appendStreams(bits,k);
 		}
-		doTransition(1);
-		calculateTransition(1);
-		goto _begin;
 	}
 	
+	//a miss costs about as much as a hit saves, so scans that keep changing
+	//(e.g. SDRs that carry an address) aren't looked up; one in 16 still is,
+	//to notice when they start repeating
+	bool _useSegmentCache(bool ir) {
+		if(_segLookups[ir]<64 || _segHits[ir]*2>=_segLookups[ir]) return true;
+		return (++_segSkipped[ir]&15)==0;
+	}
+	//everything a scan's clocks depend on: the states it starts and ends in,
+	//the headers and trailers in effect and the (padded) data
+	//(built with memcpy into a reused buffer; string appends cost more than
+	//generating a short scan)
+	void _makeSegmentKey(bool ir, const svfData& data, svfState end) {
+		const string* parts[]={&data.tdiData,&data.tdoData,&data.tdiMask,&data.tdoMask};
+		struct {
+			uchar from,to,ir,pad;
+			uint32_t headerGen;
+			int32_t dataLen;
+			uint32_t lens[4];
+		} head={uchar(deviceState),uchar(end),uchar(ir),0,_headerGen,data.dataLen,{}};
+		size_t len=sizeof(head);
+		for(int i=0;i<4;i++) {
+			head.lens[i]=parts[i]->length();
+			len+=head.lens[i];
+		}
+		if(_segKey.length()<len) _segKey.resize(len);
+		char* p=&_segKey[0];
+		memcpy(p,&head,sizeof(head));
+		p+=sizeof(head);
+		for(int i=0;i<4;i++) {
+			memcpy(p,parts[i]->data(),head.lens[i]);
+			p+=head.lens[i];
+		}
+		_segKeyLen=len;
+	}
+	//the entry for _segKey, or the empty slot to put it in (hash 0)
+	_segEntry& _findSegment() {
+		if(_segTable.empty()) _segTable.resize(64);
+		string_view key(_segKey.data(),_segKeyLen);
+		uint64_t h=std::hash<string_view>()(key)|1;
+		size_t mask=_segTable.size()-1;
+		for(size_t i=h&mask;;i=(i+1)&mask) {
+			_segEntry& e=_segTable[i];
+			if(e.hash==0) {
+				_segKeyHash=h;
+				return e;
+			}
+			if(e.hash==h && e.keyLen==_segKeyLen &&
+					memcmp(_segKeys.data()+e.keyOff,key.data(),e.keyLen)==0)
+				return e;
+		}
+	}
+	void _addSegment(_segEntry& slot, const svfVectorsView& src, int64_t pos, int n) {
+		if(_segCount>=segmentMaxEntries) {
+			//start over; slot is gone with the rest
+			_segTable.clear();
+			_segKeys.clear();
+			_segCount=0;
+			_addSegment(_findSegment(),src,pos,n);
+			return;
+		}
+		if((_segCount+1)*2>(int)_segTable.size()) {
+			//keep the table at most half full; it starts small, as a file
+			//has a few hundred distinct scans at most
+			vector<_segEntry> old(_segTable.size()*2);
+			old.swap(_segTable);
+			size_t mask=_segTable.size()-1;
+			for(const _segEntry& e: old) {
+				if(e.hash==0) continue;
+				size_t i=e.hash&mask;
+				while(_segTable[i].hash!=0) i=(i+1)&mask;
+				_segTable[i]=e;
+			}
+			_addSegment(_findSegment(),src,pos,n);
+			return;
+		}
+		slot.hash=_segKeyHash;
+		slot.keyOff=_segKeys.length();
+		slot.keyLen=_segKeyLen;
+		slot.clocks=n;
+		_segKeys.append(_segKey.data(),_segKeyLen);
+		const svfBitView* streams[5]={&src.tms,&src.tdi,&src.tdo,&src.tdiCare,&src.tdoCare};
+		for(int i=0;i<5;i++) slot.bits[i]=streams[i]->getBits(pos,n);
+		_segCount++;
+	}
 	inline void calculateTransition(int tms) {
 		deviceState=svfTransitionTable[int(deviceState)*2+tms];
 	}
-	
-	inline void doTransition(int tms) {
-		outBuffer+=char(tms);		//all other bit fields are zero
-	}
 	void _warn(string msg) {
 		fprintf(stderr,"warning: %s\n",msg.c_str());
 	}
@@ -543,4 +1664,104 @@ struct svfPlayer {
 	}
 };
 
+//##########################################################################################
+/***************** peephole optimizer *****************/
+//##########################################################################################
+//optional pass between svfParser and svfPlayer: keep() says whether a
+//command is worth playing. dropped are
+//- STATE commands that go nowhere, e.g. STATE IDLE after an SDR whose ENDDR
+//  is IDLE. svfPlayer makes no clocks for them either
+//- STATE commands that only visit RESET and IDLE while the TAP hasn't left
+//  those two since it was last reset, and that end where the TAP already is
+//  or in RESET: a second reset finds nothing to reset. a move from RESET to
+//  IDLE is kept, as the TAP would be left in the wrong state without it
+//RUNTEST, scans and everything else are always kept, so the clocks spent in
+//RUNTEST and the shifted data don't change. adjacent RUNTESTs in the same
+//state need nothing here: svfPlayer emits their clocks back to back, and
+//encoders that pack runs of clocks see one run.
+//clocksSaved compares the TAP moves with and without the pass
+struct svfPeephole {
+	svfState state,origState;	//after the commands kept, and after all of them
+	svfState endIR,endDR,runTestState;
+	bool fresh;					//only RESET and IDLE since the last reset
+	int64_t commands=0,dropped=0,clocksSaved=0;
+	
+	void reset() {
+		state=origState=svfState::UNKNOWN;
+		endIR=endDR=runTestState=svfState::IDLE;
+		fresh=false;
+		commands=dropped=clocksSaved=0;
+	}
+	bool keep(const svfCommand& cmd) {
+		commands++;
+		bool keep=true;
+		switch(cmd.op) {
+			case svfOp::ENDIR:
+				endIR=cmd.states[0];
+				break;
+			case svfOp::ENDDR:
+				endDR=cmd.states[0];
+				break;
+			case svfOp::RUNTEST:
+				if(cmd.states[0]!=svfState::UNDEFINED) runTestState=cmd.states[0];
+				break;
+			case svfOp::STATE:
+			{
+				bool still=true,quiet=fresh;
+				for(svfState st: cmd.states) {
+					still=still && st==state;
+					quiet=quiet && (st==svfState::RESET || st==svfState::IDLE);
+				}
+				svfState last=cmd.states.empty()?state:cmd.states.back();
+				quiet=quiet && (last==state || last==svfState::RESET);
+				keep=!still && !quiet;
+				break;
+			}
+			default:
+				break;
+		}
+		int64_t orig=_moves(cmd,origState,NULL);
+		if(keep) clocksSaved+=orig-_moves(cmd,state,&fresh);
+		else {
+			clocksSaved+=orig;
+			dropped++;
+		}
+		return keep;
+	}
+	//clocks cmd spends moving the TAP from st; the moves out of a shift
+	//state don't depend on where the scan started, so aren't counted
+	int64_t _moves(const svfCommand& cmd, svfState& st, bool* fresh) {
+		int64_t n=0;
+		auto move=[&](svfState to) {
+			const svfTmsPath& p=svfTmsPaths(st,to);
+			if(!p.valid) return;
+			//from UNKNOWN, the path goes through RESET
+			if(fresh && st==svfState::UNKNOWN) *fresh=true;
+			if(fresh && to==svfState::RESET) *fresh=true;
+			else if(fresh && to!=svfState::IDLE) *fresh=false;
+			n+=p.len;
+			st=to;
+		};
+		switch(cmd.op) {
+			case svfOp::STATE:
+				for(svfState to: cmd.states) move(to);
+				break;
+			case svfOp::RUNTEST:
+				move(runTestState);
+				break;
+			case svfOp::SIR:
+				move(svfState::IRSHIFT);
+				st=endIR;
+				break;
+			case svfOp::SDR:
+				move(svfState::DRSHIFT);
+				st=endDR;
+				break;
+			default:
+				break;
+		}
+		return n;
+	}
+};
+
 #endif 
@@ -0,0 +1,393 @@
+// svfbench: measures svf parsing, vector generation and end-to-end playback
+// against svfsim, for the test files and synthetic multi-megabit SDR files,
+// and prints the results as JSON on stdout.
+#include "libsvfplayer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+double now() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+//runs fn repeatedly for at least minTime seconds; returns seconds per run
+template<class F> double timeIt(F fn, double minTime=0.3) {
+	int reps=0;
+	double start=now(),elapsed;
+	do {
+		fn();
+		reps++;
+		elapsed=now()-start;
+	} while(elapsed<minTime);
+	return elapsed/reps;
+}
+
+struct playResult {
+	bool ran=false,ok=false;
+	double seconds=0,tckPerSec=0;
+	long sent=0,received=0;
+	long vectorBytes=0,packedBytes=0;	//shift vectors, as they are and packed
+	int64_t clocks=0;
+	string error;
+};
+struct benchResult {
+	string name,path;
+	int64_t bytes=0,commands=0,clocks=0;
+	double parseMBs=0,parallelParseMBs=0,genClocksPerSec=0,genCommandsPerSec=0;
+	double uncachedClocksPerSec=0,cacheHitRate=0;
+	int64_t peepholeDropped=0,peepholeClocksSaved=0;
+	string error;
+	playResult play,pipelined,unpacked,writeOnly,writeOnlyUnpacked;
+};
+
+//threads for svfParser::processBufferParallel()
+int parseThreads=max(2,(int)thread::hardware_concurrency());
+
+void benchParse(const svfMappedFile& f, benchResult& r) {
+	double dt=timeIt([&] {
+		svfParser parser;
+		svfCommand cmd;
+		int64_t n=0;
+		parser.reset();
+		parser.processBuffer(f.data,f.len);
+		while(parser.nextCommand(cmd)) n++;
+		r.commands=n;
+	});
+	r.parseMBs=f.len/dt/1e6;
+	dt=timeIt([&] {
+		svfParser parser;
+		svfCommand cmd;
+		parser.reset();
+		parser.processBufferParallel(f.data,f.len,parseThreads);
+		while(parser.nextCommand(cmd));
+	});
+	r.parallelParseMBs=f.len/dt/1e6;
+}
+
+//returns clocks per second; cache turns svfPlayer's segment cache on or off
+double benchGenerate(const svfMappedFile& f, benchResult& r, bool cache) {
+	vector<svfCommand> cmds;
+	svfParser parser;
+	svfCommand cmd;
+	parser.reset();
+	parser.processBuffer(f.data,f.len);
+	while(parser.nextCommand(cmd)) cmds.push_back(cmd);
+	//one untimed pass so each warning is shown once, then keep them out of
+	//the timed runs
+	svfPlayer warmup;
+	warmup.segmentCache=cache;
+	warmup.reset();
+	for(const svfCommand& c: cmds) {
+		warmup.processCommand(c);
+		warmup.out.clear();
+	}
+	fflush(stderr);
+	int savedStderr=dup(2),null=open("/dev/null",O_WRONLY);
+	dup2(null,2);
+	close(null);
+	double dt=timeIt([&] {
+		svfPlayer player;
+		int64_t clocks=0;
+		player.segmentCache=cache;
+		player.reset();
+		for(const svfCommand& c: cmds) {
+			player.processCommand(c);
+			//the player plays and clears a block at a time too
+			if(player.out.length()>=(1<<20)) {
+				clocks+=player.out.length();
+				player.out.clear();
+			}
+		}
+		r.clocks=clocks+player.out.length();
+		int64_t lookups=player.cacheHits+player.cacheMisses;
+		r.cacheHitRate=lookups?double(player.cacheHits)/lookups:0;
+	});
+	dup2(savedStderr,2);
+	close(savedStderr);
+	r.genCommandsPerSec=cmds.size()/dt;
+	return r.clocks/dt;
+}
+
+//what svfPeephole (svfplayer -O) would leave out of the file
+void benchPeephole(const svfMappedFile& f, benchResult& r) {
+	svfParser parser;
+	svfPeephole peephole;
+	svfCommand cmd;
+	parser.reset();
+	parser.processBuffer(f.data,f.len);
+	peephole.reset();
+	while(parser.nextCommand(cmd)) peephole.keep(cmd);
+	r.peepholeDropped=peephole.dropped;
+	r.peepholeClocksSaved=peephole.clocksSaved;
+}
+
+//starts args[0] with stdout (and stderr, if merge) on a pipe
+int spawn(const vector<string>& args, bool merge, pid_t& pid) {
+	int fds[2];
+	if(pipe(fds)<0) return -1;
+	pid=fork();
+	if(pid<0) return -1;
+	if(pid==0) {
+		vector<char*> argv;
+		for(const string& a: args) argv.push_back((char*)a.c_str());
+		argv.push_back(NULL);
+		dup2(fds[1],1);
+		if(merge) dup2(fds[1],2);
+		else {
+			int null=open("/dev/null",O_WRONLY);
+			dup2(null,2);
+		}
+		close(fds[0]);
+		execv(argv[0],argv.data());
+		_exit(127);
+	}
+	close(fds[1]);
+	return fds[0];
+}
+
+string readAll(int fd) {
+	string out;
+	char buf[4096];
+	int n;
+	while((n=read(fd,buf,sizeof(buf)))>0) out.append(buf,n);
+	close(fd);
+	return out;
+}
+
+//plays path through svfplayer against a fresh svfsim
+void benchPlay(const string& binDir, const string& path, const vector<string>& simArgs,
+		const vector<string>& playerArgs, playResult& r) {
+	vector<string> sim={binDir+"/svfsim","-1"};
+	sim.insert(sim.end(),simArgs.begin(),simArgs.end());
+	pid_t simPid,playerPid;
+	int simOut=spawn(sim,false,simPid);
+	if(simOut<0) {
+		r.error="could not start svfsim";
+		return;
+	}
+	char pty[256];
+	int len=0;
+	while(len<(int)sizeof(pty)-1 && read(simOut,pty+len,1)==1 && pty[len]!='\n') len++;
+	pty[len]=0;
+	vector<string> player={binDir+"/svfplayer","-y"};
+	player.insert(player.end(),playerArgs.begin(),playerArgs.end());
+	player.push_back(path);
+	player.push_back(pty);
+	string out=readAll(spawn(player,true,playerPid));
+	int status;
+	waitpid(playerPid,&status,0);
+	kill(simPid,SIGTERM);
+	waitpid(simPid,NULL,0);
+	close(simOut);
+	r.ran=true;
+	r.ok=WIFEXITED(status) && WEXITSTATUS(status)==0;
+	size_t pos=out.find(" s elapsed; ");
+	if(pos!=string::npos) {
+		size_t start=out.rfind('\n',pos);
+		start=(start==string::npos)?0:start+1;
+		sscanf(out.c_str()+start,"%lf s elapsed; %lf tclk/s; %ld bytes sent, %ld bytes received",
+			&r.seconds,&r.tckPerSec,&r.sent,&r.received);
+	}
+	size_t packed=out.find("shift vectors: ");
+	if(packed!=string::npos)
+		sscanf(out.c_str()+packed,"shift vectors: %ld bytes packed into %ld",&r.vectorBytes,&r.packedBytes);
+	size_t total=out.find(" tclk cycles total");
+	if(total!=string::npos) {
+		size_t start=out.rfind('\n',total);
+		r.clocks=atoll(out.c_str()+(start==string::npos?0:start+1));
+	}
+	if(!r.ok) {
+		//the last line of output says what went wrong
+		while(!out.empty() && out.back()=='\n') out.pop_back();
+		size_t nl=out.rfind('\n');
+		r.error=(nl==string::npos)?out:out.substr(nl+1);
+	}
+}
+
+//an svf file with count SDRs of mbit megabits of random TDI each
+bool writeSynthetic(const string& path, int mbit, int count) {
+	FILE* f=fopen(path.c_str(),"w");
+	if(!f) return false;
+	fprintf(f,"// synthetic svfbench input: %d SDRs of %d Mbit\n",count,mbit);
+	fprintf(f,"TRST OFF;\nENDIR IDLE;\nENDDR IDLE;\nSTATE RESET;\nSTATE IDLE;\nSIR 10 TDI (290);\n");
+	int64_t bits=(int64_t)mbit<<20;
+	static const char digits[]="0123456789abcdef";
+	char line[81];
+	line[80]=0;
+	for(int i=0;i<count;i++) {
+		fprintf(f,"SDR %lld TDI (\n",(long long)bits);
+		for(int64_t d=0;d<bits/4;d+=80) {
+			for(int j=0;j<80;j++) line[j]=digits[rand()%16];
+			fprintf(f,"%s\n",line);
+		}
+		fprintf(f,");\nRUNTEST 100 TCK;\n");
+	}
+	return fclose(f)==0;
+}
+
+string jsonString(const string& s) {
+	string out="\"";
+	for(unsigned char c: s) {
+		if(c=='"' || c=='\\') out+='\\',out+=c;
+		else if(c<0x20) {
+			char buf[8];
+			snprintf(buf,sizeof(buf),"\\u%04x",c);
+			out+=buf;
+		} else out+=c;
+	}
+	return out+"\"";
+}
+
+void printPlay(const char* key, const playResult& r) {
+	printf(",\n\t\t\t\"%s\": {\"ok\": %s, \"seconds\": %.4f, \"tck_per_s\": %.0f, \"bytes_sent\": %ld, "
+		"\"bytes_received\": %ld, \"wire_bytes_per_tck\": %.4f",key,r.ok?"true":"false",r.seconds,
+		r.tckPerSec,r.sent,r.received,r.clocks>0?double(r.sent+r.received)/r.clocks:0.0);
+	if(r.packedBytes>0)
+		printf(", \"shift_vector_bytes\": %ld, \"shift_vector_bytes_packed\": %ld, \"pack_ratio\": %.3f",
+			r.vectorBytes,r.packedBytes,double(r.vectorBytes)/r.packedBytes);
+	if(!r.ok) printf(", \"error\": %s",jsonString(r.error).c_str());
+	printf("}");
+}
+
+void printUsage(const char* prog) {
+	fprintf(stderr,"usage: %s [-n] [-b <baud>] [-s <mbit>] [-j <threads>] [svf-file...]\n",prog);
+	fprintf(stderr,"\t-n\tskip the end-to-end runs against svfsim\n");
+	fprintf(stderr,"\t-b\temulate a serial link of this baud rate in svfsim\n");
+	fprintf(stderr,"\t-s\tsize of each synthetic SDR in Mbit, 0 for none (default 4)\n");
+	fprintf(stderr,"\t-j\tthreads for the parallel parse (default: one per core, at least 2)\n");
+	fprintf(stderr,"with no files, runs test-files/*.svf\n");
+}
+
+int main(int argc, char** argv) {
+	bool endToEnd=true;
+	string baud;
+	int mbit=4;
+	int opt;
+	while((opt=getopt(argc,argv,"nb:s:j:"))!=-1) {
+		switch(opt) {
+			case 'n': endToEnd=false; break;
+			case 'b': baud=optarg; break;
+			case 's': mbit=atoi(optarg); break;
+			case 'j': parseThreads=atoi(optarg); break;
+			default:
+				printUsage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	string binDir=argv[0];
+	binDir=(binDir.rfind('/')==string::npos)?".":binDir.substr(0,binDir.rfind('/'));
+
+	vector<benchResult> results;
+	for(int i=optind;i<argc;i++) {
+		benchResult r;
+		r.path=argv[i];
+		results.push_back(r);
+	}
+	if(results.empty()) {
+		string dir=binDir+"/test-files";
+		vector<string> names;
+		if(DIR* d=opendir(dir.c_str())) {
+			while(dirent* e=readdir(d)) {
+				string name=e->d_name;
+				if(name.size()>4 && name.compare(name.size()-4,4,".svf")==0) names.push_back(name);
+			}
+			closedir(d);
+		}
+		sort(names.begin(),names.end());
+		for(const string& name: names) {
+			benchResult r;
+			r.path=dir+"/"+name;
+			results.push_back(r);
+		}
+	}
+	char tmpDir[]="/tmp/svfbench.XXXXXX";
+	string synthetic;
+	if(mbit>0 && mkdtemp(tmpDir)) {
+		benchResult r;
+		char name[64];
+		snprintf(name,sizeof(name),"/synthetic-sdr-4x%dM.svf",mbit);
+		synthetic=string(tmpDir)+name;
+		srand(1);
+		if(writeSynthetic(synthetic,mbit,4)) {
+			r.path=synthetic;
+			results.push_back(r);
+		}
+	}
+
+	for(benchResult& r: results) {
+		r.name=r.path.substr(r.path.rfind('/')==string::npos?0:r.path.rfind('/')+1);
+		fprintf(stderr,"%s\n",r.name.c_str());
+		svfMappedFile f;
+		if(!f.open(r.path.c_str())) {
+			r.error="could not open "+r.path;
+			continue;
+		}
+		r.bytes=f.len;
+		try {
+			benchParse(f,r);
+			r.uncachedClocksPerSec=benchGenerate(f,r,false);
+			r.genClocksPerSec=benchGenerate(f,r,true);
+			benchPeephole(f,r);
+		} catch(const exception& e) {
+			r.error=e.what();
+			continue;
+		}
+		if(!endToEnd) continue;
+		//files that check for a 1502 need svfsim to emulate one instead of its
+		//default 1508
+		vector<string> simArgs;
+		if(string_view(f.data,f.len).find("0150203f")!=string_view::npos)
+			simArgs={"-i","0x0150203f","-w","86"};
+		if(!baud.empty()) simArgs.insert(simArgs.end(),{"-b",baud});
+		benchPlay(binDir,r.path,simArgs,{},r.play);
+		benchPlay(binDir,r.path,simArgs,{"-P"},r.pipelined);
+		benchPlay(binDir,r.path,simArgs,{"-u"},r.unpacked);
+		benchPlay(binDir,r.path,simArgs,{"-w"},r.writeOnly);
+		benchPlay(binDir,r.path,simArgs,{"-u","-w"},r.writeOnlyUnpacked);
+	}
+	if(!synthetic.empty()) {
+		unlink(synthetic.c_str());
+		rmdir(tmpDir);
+	}
+
+	printf("{\n\t\"compiler\": %s,\n\t\"baud\": %s,\n\t\"parse_threads\": %d,\n\t\"files\": [",
+		jsonString(__VERSION__).c_str(),baud.empty()?"null":baud.c_str(),parseThreads);
+	bool failed=false;
+	for(size_t i=0;i<results.size();i++) {
+		const benchResult& r=results[i];
+		printf("%s\n\t\t{\n\t\t\t\"name\": %s, \"bytes\": %lld, \"commands\": %lld, \"clocks\": %lld",
+			i?",":"",jsonString(r.name).c_str(),(long long)r.bytes,(long long)r.commands,(long long)r.clocks);
+		if(!r.error.empty()) {
+			printf(",\n\t\t\t\"error\": %s\n\t\t}",jsonString(r.error).c_str());
+			failed=true;
+			continue;
+		}
+		printf(",\n\t\t\t\"parse_mb_per_s\": %.2f, \"parse_parallel_mb_per_s\": %.2f",r.parseMBs,r.parallelParseMBs);
+		printf(",\n\t\t\t\"generate_clocks_per_s\": %.0f, \"generate_commands_per_s\": %.0f",
+			r.genClocksPerSec,r.genCommandsPerSec);
+		printf(",\n\t\t\t\"generate_uncached_clocks_per_s\": %.0f, \"segment_cache_hit_rate\": %.4f",
+			r.uncachedClocksPerSec,r.cacheHitRate);
+		printf(",\n\t\t\t\"peephole\": {\"commands_dropped\": %lld, \"clocks_saved\": %lld}",
+			(long long)r.peepholeDropped,(long long)r.peepholeClocksSaved);
+		const pair<const char*,const playResult*> plays[]={{"end_to_end",&r.play},
+			{"end_to_end_pipelined",&r.pipelined},{"end_to_end_unpacked",&r.unpacked},
+			{"end_to_end_write_only",&r.writeOnly},{"end_to_end_write_only_unpacked",&r.writeOnlyUnpacked}};
+		for(const auto& p: plays) {
+			if(!p.second->ran) continue;
+			printPlay(p.first,*p.second);
+			failed|=!p.second->ok;
+		}
+		printf("\n\t\t}");
+	}
+	printf("\n\t]\n}\n");
+	return failed?EXIT_FAILURE:EXIT_SUCCESS;
+}
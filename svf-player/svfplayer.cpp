@@ -1,4 +1,5 @@
 #include "libsvfplayer.h"
+#include "../arduino/jtagproto.h"
 #include <stdio.h>
 #include <string>
 #include <vector>
@@ -12,169 +13,1248 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #include <assert.h>
 #include <poll.h>
 #include <iostream>
+#include <time.h>
+#include <math.h>
+#include <thread>
+#include <getopt.h>
+#include <mutex>
+#include <sstream>
+#include <deque>
+#include <memory>
+#include <zlib.h>
+#include <lzma.h>
 
 using namespace std;
 
 // #define DEBUG_ON
 
-int uart_open(char* path, speed_t baud){
-    struct termios uart_opts;
-    // Open the file - Remember not to use buffered I/O!
-    int fd = open(path, O_RDWR | O_NOCTTY);
-	
-	if (fd < 0) return fd;
-
-    // Setup the UART as a terminal interface
-    // See http://man7.org/linux/man-pages/man3/termios.3.html
-
-    // Flush data already in/out
-    if (tcflush(fd,TCIFLUSH)==-1)
-        goto err;
-    if (tcflush(fd,TCOFLUSH)==-1)
-        goto err;
-    // Setup modes (8-bit data, disable control signals, readable, no-parity)
-    uart_opts.c_cflag= CBAUD | CS8 | CLOCAL | CREAD;    // control modes
-    uart_opts.c_iflag=IGNPAR;                           // input modes
-    uart_opts.c_oflag=0;                                // output modes
-    uart_opts.c_lflag=0;                                // local modes
-    // Setup input buffer options: Minimum input: 1byte, no-delay
-    uart_opts.c_cc[VMIN]=1;
-    uart_opts.c_cc[VTIME]=0;
-    // Set baud rate
-    cfsetospeed(&uart_opts,baud);
-    cfsetispeed(&uart_opts,baud);
-    // Apply the settings
-    if (tcsetattr(fd,TCSANOW,&uart_opts)==-1)
-        goto err;
-
-    return fd;
-
-err:
-    close(fd);
-    return -1;
-}
-
-void drainfd(int fd) {
-	pollfd pfd;
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	while(poll(&pfd,1,100)>0) {
-		if(!(pfd.revents&POLLIN)) continue;
-		char buf[4096];
-		read(fd,buf,sizeof(buf));
-	}
-}
-
-void uart_readline(int fd, char* outbuf, int n){
-    for (int i = 0 ; i < n ; i++){
-        read(fd, &outbuf[i], 1);
-        if (outbuf[i] == '\n') 
-            return;
-    }
-}
-
-void uart_send_command(int uartfd, char* cmd, int cmd_len, char* resp, int resp_len){
-	write(uartfd, cmd, cmd_len);
+// Bytes moved over the UART, for the summary printed at exit; atomic as
+// several threads write to (or read from) programmers at once
+atomic<long> uart_tx_bytes{0}, uart_rx_bytes{0};
+// Bytes of TDI and expected TDO in shifts to programmers that unpack them,
+// and what went out instead
+atomic<long> pack_raw_bytes{0}, pack_sent_bytes{0};
+
+double mono_now(){
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Instrumentation (--stats): time spent in each phase of the hot path, a
+ * histogram of packet round trips and the clocks each kind of svf command
+ * generated. Every probe tests stats_on first, so a normal run only pays
+ * for a predictable branch. Each thread counts into its own stat_counters
+ * and adds them to stats_total when it's done (stat_flush()), so the
+ * probes need no atomics.
+ */
+enum stat_phase { PHASE_PARSE, PHASE_GENERATE, PHASE_UART_WRITE, PHASE_UART_READ, PHASE_COUNT };
+const char* stat_phase_names[PHASE_COUNT] = {"parse", "generate", "uart_write", "uart_read"};
+#define STAT_RTT_BUCKETS	24		// bucket i counts round trips of [2^i, 2^(i+1)) us
+#define STAT_OPS			ARRSIZE(svfOps)
+
+struct stat_counters {
+	long calls[PHASE_COUNT] = {};
+	double seconds[PHASE_COUNT] = {};
+	long rtt[STAT_RTT_BUCKETS] = {};
+	long op_commands[STAT_OPS] = {};
+	int64_t op_clocks[STAT_OPS] = {};
+	int64_t cache_hits = 0, cache_misses = 0;	// svfPlayer's segment cache
+	long flow_stalls = 0;		// packets held back because the window was full
+	long retransmits = 0;
+	long uart_reads = 0, uart_writes = 0;	// syscalls, waits included
+	// the largest credit, window and startup RTT any link settled on
+	long flow_credits = 0, flow_window = 0;
+	double flow_rtt = 0;
+
+	void add(const stat_counters& o){
+		for (int i = 0; i < PHASE_COUNT; i++) {
+			calls[i] += o.calls[i];
+			seconds[i] += o.seconds[i];
+		}
+		for (int i = 0; i < STAT_RTT_BUCKETS; i++)
+			rtt[i] += o.rtt[i];
+		for (size_t i = 0; i < STAT_OPS; i++) {
+			op_commands[i] += o.op_commands[i];
+			op_clocks[i] += o.op_clocks[i];
+		}
+		cache_hits += o.cache_hits;
+		cache_misses += o.cache_misses;
+		flow_stalls += o.flow_stalls;
+		retransmits += o.retransmits;
+		uart_reads += o.uart_reads;
+		uart_writes += o.uart_writes;
+		flow_credits = max(flow_credits, o.flow_credits);
+		flow_window = max(flow_window, o.flow_window);
+		flow_rtt = max(flow_rtt, o.flow_rtt);
+	}
+};
+bool stats_on = false;
+thread_local stat_counters stats;
+stat_counters stats_total;
+mutex stats_lock;
+
+void stat_flush(){
+	if (!stats_on) return;
+	lock_guard<mutex> lock(stats_lock);
+	stats_total.add(stats);
+	stats = stat_counters();
+}
+// Flushes the calling thread's counters when it leaves the scope
+struct stat_flusher {
+	~stat_flusher(){ stat_flush(); }
+};
+
+// Returns the start time of a timed phase, or 0 when stats are off
+static inline double stat_begin(){
+	return stats_on ? mono_now() : 0;
+}
+static inline void stat_end(stat_phase phase, double start){
+	if (!stats_on) return;
+	stats.calls[phase]++;
+	stats.seconds[phase] += mono_now() - start;
+}
+static inline void stat_syscall(bool write){
+	if (!stats_on) return;
+	if (write) stats.uart_writes++;
+	else stats.uart_reads++;
+}
+static inline void stat_round_trip(double sent){
+	if (!stats_on) return;
+	double us = (mono_now() - sent) * 1e6;
+	int b = 0;
+	while (b < STAT_RTT_BUCKETS - 1 && us >= (2 << b)) b++;
+	stats.rtt[b]++;
+}
+static inline void stat_command(svfOp op, int64_t clocks){
+	if (!stats_on) return;
+	stats.op_commands[(int)op]++;
+	stats.op_clocks[(int)op] += clocks;
+}
+// Called once a player is done with
+static inline void stat_player(const svfPlayer& player){
+	stats.cache_hits += player.cacheHits;
+	stats.cache_misses += player.cacheMisses;
+}
+
+void stats_print_text(FILE* f, double elapsed, int64_t num_tclk){
+	fprintf(f, "time per phase over %.3f s:\n", elapsed);
+	for (int i = 0; i < PHASE_COUNT; i++)
+		fprintf(f, "\t%-10s %9.3f s in %ld calls (%.2f us/call)\n", stat_phase_names[i], stats_total.seconds[i],
+			stats_total.calls[i], stats_total.calls[i] ? stats_total.seconds[i] * 1e6 / stats_total.calls[i] : 0.0);
+	fprintf(f, "packet round trips:\n");
+	for (int i = 0; i < STAT_RTT_BUCKETS; i++)
+		if (stats_total.rtt[i])
+			fprintf(f, "\t%8ld us..: %ld\n", i ? 1L << i : 0L, stats_total.rtt[i]);
+	int64_t lookups = stats_total.cache_hits + stats_total.cache_misses;
+	fprintf(f, "segment cache: %lld hits, %lld misses (%.1f%% hit rate)\n", (long long)stats_total.cache_hits,
+		(long long)stats_total.cache_misses, lookups ? 100.0 * stats_total.cache_hits / lookups : 0.0);
+	if (stats_total.flow_window)
+		fprintf(f, "flow control: %ld byte credit, %ld byte window, %.3f ms startup RTT, %ld stalls, %ld retransmits\n",
+			stats_total.flow_credits, stats_total.flow_window, stats_total.flow_rtt * 1e3,
+			stats_total.flow_stalls, stats_total.retransmits);
+	fprintf(f, "uart syscalls: %ld reads, %ld writes (%.4f per tclk)\n", stats_total.uart_reads, stats_total.uart_writes,
+		num_tclk > 0 ? (double)(stats_total.uart_reads + stats_total.uart_writes) / num_tclk : 0.0);
+	fprintf(f, "clocks per svf command:\n");
+	for (size_t i = 0; i < STAT_OPS; i++)
+		if (stats_total.op_commands[i])
+			fprintf(f, "\t%-10s %8ld commands %12lld clocks\n", svfOps[i], stats_total.op_commands[i],
+				(long long)stats_total.op_clocks[i]);
+}
+
+// One line, so that it can be picked off the end of stderr
+void stats_print_json(FILE* f, double elapsed, bool ok, int num_cmds, int64_t num_tclk){
+	fprintf(f, "{\"ok\": %s, \"seconds\": %.6f, \"commands\": %d, \"clocks\": %lld, "
+		"\"bytes_sent\": %ld, \"bytes_received\": %ld, \"shift_vector_bytes\": %ld, \"shift_vector_bytes_packed\": %ld, "
+		"\"phases\": {", ok ? "true" : "false", elapsed, num_cmds, (long long)num_tclk, uart_tx_bytes.load(),
+		uart_rx_bytes.load(), pack_raw_bytes.load(), pack_sent_bytes.load());
+	for (int i = 0; i < PHASE_COUNT; i++)
+		fprintf(f, "%s\"%s\": {\"calls\": %ld, \"seconds\": %.6f}", i ? ", " : "",
+			stat_phase_names[i], stats_total.calls[i], stats_total.seconds[i]);
+	// keyed by the lower bound of each bucket in microseconds
+	fprintf(f, "}, \"round_trip_us\": {");
+	bool first = true;
+	for (int i = 0; i < STAT_RTT_BUCKETS; i++) {
+		if (!stats_total.rtt[i]) continue;
+		fprintf(f, "%s\"%ld\": %ld", first ? "" : ", ", i ? 1L << i : 0L, stats_total.rtt[i]);
+		first = false;
+	}
+	fprintf(f, "}, \"segment_cache\": {\"hits\": %lld, \"misses\": %lld}, \"flow\": {\"credit\": %ld, "
+		"\"window\": %ld, \"rtt_us\": %.1f, \"stalls\": %ld, \"retransmits\": %ld}, "
+		"\"uart_syscalls\": {\"reads\": %ld, \"writes\": %ld}, \"ops\": {",
+		(long long)stats_total.cache_hits, (long long)stats_total.cache_misses, stats_total.flow_credits,
+		stats_total.flow_window, stats_total.flow_rtt * 1e6, stats_total.flow_stalls, stats_total.retransmits,
+		stats_total.uart_reads, stats_total.uart_writes);
+	first = true;
+	for (size_t i = 0; i < STAT_OPS; i++) {
+		if (!stats_total.op_commands[i]) continue;
+		fprintf(f, "%s\"%s\": {\"commands\": %ld, \"clocks\": %lld}", first ? "" : ", ", svfOps[i],
+			stats_total.op_commands[i], (long long)stats_total.op_clocks[i]);
+		first = false;
+	}
+	fprintf(f, "}}\n");
+}
+
+// Periodic progress line on stderr; the fraction done is taken from the
+// offset reached in the svf file, or from the clock count for vector files
+struct progress_meter {
+	bool on = false;
+	double start = 0, last = 0;
+	bool shown = false;
+
+	void begin(){
+		start = last = mono_now();
+	}
+	void update(int64_t done, int64_t total, int64_t num_tclk){
+		if (!on || done <= 0 || total <= 0) return;
+		double t = mono_now();
+		if (t - last < 0.5) return;
+		last = t;
+		double elapsed = t - start, frac = (double)done / total;
+		int eta = (int)(elapsed * (1 - frac) / frac);
+		fprintf(stderr, "\r%5.1f%%  %.1f kB/s of svf, %.0f tclk/s, %ld bytes sent, ETA %d:%02d   ",
+			100 * frac, done / elapsed / 1e3, num_tclk / elapsed, uart_tx_bytes.load(), eta / 60, eta % 60);
+		shown = true;
+	}
+	void end(){
+		if (shown)
+			fputc('\n', stderr);
+		shown = false;
+	}
+};
+progress_meter progress;
+
+// What the sketch talks at after a reset
+#define UART_DEFAULT_BAUD	115200
+
+#if defined(__linux__) && defined(TCGETS2)
+// From <asm/termbits.h>, which can't be included next to <termios.h>
+struct termios2 {
+	tcflag_t c_iflag, c_oflag, c_cflag, c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed, c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER	0010000
+#endif
+#endif
+
+// Sets any baud rate, not just the ones with a B* constant, where the
+// kernel allows it (termios2 and BOTHER on Linux)
+bool uart_set_baud(int fd, long baud){
+#if defined(__linux__) && defined(TCGETS2)
+	struct termios2 tio;
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return false;
+	tio.c_cflag &= ~CBAUD;
+#ifdef CIBAUD
+	tio.c_cflag &= ~CIBAUD;		// input at the output rate
+#endif
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = tio.c_ospeed = baud;
+	return ioctl(fd, TCSETS2, &tio) == 0;
+#else
+	static const struct { long baud; speed_t speed; } rates[] = {
+		{9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+		{115200, B115200}, {230400, B230400},
+	};
+	struct termios tio;
+	for (size_t i = 0; i < ARRSIZE(rates); i++) {
+		if (rates[i].baud != baud)
+			continue;
+		if (tcgetattr(fd, &tio) < 0)
+			return false;
+		cfsetospeed(&tio, rates[i].speed);
+		cfsetispeed(&tio, rates[i].speed);
+		return tcsetattr(fd, TCSANOW, &tio) == 0;
+	}
+	errno = EINVAL;
+	return false;
+#endif
+}
+
+/**
+ * Transports: how bytes get to and from a programmer.
+ *   tty_transport    a serial port: termios, any baud rate, VMIN/VTIME and
+ *                    optionally ASYNC_LOW_LATENCY
+ *   pty_transport    the slave side of a pseudo-terminal, such as svfsim's
+ *   unix_transport   a Unix stream socket (svfsim -s)
+ * Reads go through a receive buffer that takes whatever has arrived, so a
+ * packet or an ASCII response line costs about one read() instead of one
+ * per header or byte. A programmer that stays silent for UART_TIMEOUT_DS
+ * counts as lost. With --epoll the descriptor is non-blocking, and every
+ * wait for it is an epoll_wait() with that timeout instead.
+ */
+#define UART_TIMEOUT_DS		100		// deciseconds
+#define UART_RX_BUFFER		4096
+
+// --transport, --epoll, --low-latency, --vmin and --vtime
+struct uart_options {
+	const char* kind = NULL;	// NULL: pick one by the kind of file the path is
+	bool epoll = false;
+	bool low_latency = false;
+	int vmin = 0, vtime = UART_TIMEOUT_DS;
+};
+uart_options uart_opts;
+
+struct uart_transport {
+	int fd = -1;
+	// One epoll instance per direction, as the pipelined player reads and
+	// writes from different threads
+	int epoll_in = -1, epoll_out = -1;
+	uint8_t rx[UART_RX_BUFFER];
+	int rx_pos = 0, rx_len = 0;
+
+	virtual ~uart_transport(){ close(); }
+	// Opens path; false with errno set on failure
+	virtual bool open(const char* path) = 0;
+	// Only real serial ports have a baud rate
+	virtual bool set_baud(long /*baud*/){ return true; }
+	// Waits until everything written has left
+	virtual void drain(){}
+
+	// Switches to non-blocking I/O driven by epoll
+	bool use_epoll(){
+		int flags = fcntl(fd, F_GETFL);
+		if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+			return false;
+		epoll_in = epoll_create1(EPOLL_CLOEXEC);
+		epoll_out = epoll_create1(EPOLL_CLOEXEC);
+		epoll_event in = {}, out = {};
+		in.events = EPOLLIN;
+		out.events = EPOLLOUT;
+		return epoll_in >= 0 && epoll_out >= 0 && epoll_ctl(epoll_in, EPOLL_CTL_ADD, fd, &in) == 0 &&
+			epoll_ctl(epoll_out, EPOLL_CTL_ADD, fd, &out) == 0;
+	}
+	// With epoll, waits for fd to become readable (or writable); false
+	// after UART_TIMEOUT_DS or on an error. Without it, an EAGAIN is a
+	// timeout already (SO_RCVTIMEO on a socket)
+	bool wait(bool writable){
+		if (epoll_in < 0)
+			return false;
+		epoll_event ev;
+		int r;
+		do {
+			r = epoll_wait(writable ? epoll_out : epoll_in, &ev, 1, UART_TIMEOUT_DS * 100);
+		} while (r < 0 && errno == EINTR);
+		stat_syscall(false);
+		return r > 0;
+	}
+	// Reads what has arrived into rx, once it is empty; false on a timeout,
+	// hangup or error
+	bool fill(){
+		if (rx_pos < rx_len)
+			return true;
+		while (true) {
+			ssize_t r = ::read(fd, rx, sizeof(rx));
+			stat_syscall(false);
+			if (r > 0) {
+				rx_pos = 0;
+				rx_len = (int)r;
+				uart_rx_bytes += r;
+				return true;
+			}
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0 && errno == EAGAIN && wait(false))
+				continue;
+			return false;
+		}
+	}
+	bool read_exact(uint8_t* buf, int n){
+		while (n > 0) {
+			if (!fill())
+				return false;
+			int k = min(n, rx_len - rx_pos);
+			memcpy(buf, rx + rx_pos, k);
+			rx_pos += k;
+			buf += k;
+			n -= k;
+		}
+		return true;
+	}
+	// Reads up to and including a '\n', or until n bytes are in buf; false
+	// on a timeout, hangup or error before that
+	bool read_line(char* buf, int n){
+		for (int i = 0; i < n; i++) {
+			if (!fill())
+				return false;
+			buf[i] = rx[rx_pos++];
+			if (buf[i] == '\n')
+				break;
+		}
+		return true;
+	}
+	bool write_all(const uint8_t* buf, int n){
+		while (n > 0) {
+			ssize_t r = ::write(fd, buf, n);
+			stat_syscall(true);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0 && errno == EAGAIN && wait(true))
+				continue;
+			if (r <= 0)
+				return false;
+			buf += r;
+			n -= r;
+			uart_tx_bytes += r;
+		}
+		return true;
+	}
+	// Throws away everything that arrives until the line has been quiet
+	// for 100 ms
+	void discard(){
+		rx_pos = rx_len = 0;
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		while (poll(&pfd, 1, 100) > 0) {
+			if (!(pfd.revents & POLLIN)) break;
+			char buf[4096];
+			if (::read(fd, buf, sizeof(buf)) <= 0) break;
+		}
+	}
+	void close(){
+		for (int* p : {&fd, &epoll_in, &epoll_out})
+			if (*p >= 0) {
+				::close(*p);
+				*p = -1;
+			}
+	}
+};
+
+// A terminal in raw mode with reads that return what has arrived, or
+// nothing after --vtime of silence (VMIN 0)
+struct pty_transport : uart_transport {
+	bool open(const char* path) override {
+		struct termios tio = {};
+		if ((fd = ::open(path, O_RDWR | O_NOCTTY)) < 0)
+			return false;
+		// Setup modes (8-bit data, disable control signals, readable, no-parity)
+		// See http://man7.org/linux/man-pages/man3/termios.3.html
+		tio.c_cflag = CBAUD | CS8 | CLOCAL | CREAD;
+		tio.c_iflag = IGNPAR;
+		tio.c_cc[VMIN] = uart_opts.vmin;
+		tio.c_cc[VTIME] = uart_opts.vtime;
+		cfsetospeed(&tio, B115200);
+		cfsetispeed(&tio, B115200);
+		// Flush data already in/out
+		if (tcflush(fd, TCIOFLUSH) < 0 || tcsetattr(fd, TCSANOW, &tio) < 0) {
+			close();
+			return false;
+		}
+		return true;
+	}
+};
+
+struct tty_transport : pty_transport {
+	bool open(const char* path) override {
+		if (!pty_transport::open(path))
+			return false;
+#ifdef ASYNC_LOW_LATENCY
+		// Asks USB serial drivers such as ftdi_sio to pass on every byte
+		// at once instead of batching them up for milliseconds
+		struct serial_struct serial;
+		if (uart_opts.low_latency && (ioctl(fd, TIOCGSERIAL, &serial) < 0 ||
+				(serial.flags |= ASYNC_LOW_LATENCY, ioctl(fd, TIOCSSERIAL, &serial) < 0)))
+			fprintf(stderr, "note: %s doesn't support low latency mode\n", path);
+#endif
+		return true;
+	}
+	bool set_baud(long baud) override {
+		return uart_set_baud(fd, baud);
+	}
+	void drain() override {
+		tcdrain(fd);
+	}
+};
+
+struct unix_transport : uart_transport {
+	bool open(const char* path) override {
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return false;
+		}
+		strcpy(addr.sun_path, path);
+		// reads give up after the same silence as a terminal's
+		timeval timeout = {UART_TIMEOUT_DS / 10, 0};
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+				connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+			int e = errno;
+			close();
+			errno = e;
+			return false;
+		}
+		return true;
+	}
+};
+
+// Opens the programmer at path with the transport --transport names, or
+// else the one that fits what path is; NULL with errno set on failure
+unique_ptr<uart_transport> uart_open(const char* path){
+	const char* kind = uart_opts.kind;
+	struct stat st;
+	if (!kind) {
+		kind = "tty";
+		if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+			kind = "unix";
+		// Unix98 pty slaves
+		else if (stat(path, &st) == 0 && S_ISCHR(st.st_mode) && major(st.st_rdev) >= 136 && major(st.st_rdev) <= 143)
+			kind = "pty";
+	}
+	unique_ptr<uart_transport> io;
+	if (!strcmp(kind, "unix"))
+		io.reset(new unix_transport);
+	else if (!strcmp(kind, "pty"))
+		io.reset(new pty_transport);
+	else
+		io.reset(new tty_transport);
+	if (!io->open(path) || (uart_opts.epoll && !io->use_epoll()))
+		return NULL;
+	return io;
+}
+
+// Sends an ASCII command and reads the response line into resp; false if
+// the link failed either way
+bool uart_send_command(uart_transport& io, const char* cmd, int cmd_len, char* resp, int resp_len){
+	double t = stat_begin();
+	bool ok = io.write_all((const uint8_t*)cmd, cmd_len);
+	stat_end(PHASE_UART_WRITE, t);
+	if (!ok)
+		return false;
+	double sent = stat_begin();
 	memset(resp, 0, resp_len);
-	uart_readline(uartfd, resp, resp_len);
+	ok = io.read_line(resp, resp_len);
+	stat_end(PHASE_UART_READ, sent);
+	if (ok)
+		stat_round_trip(sent);
+	return ok;
 }
 
-int main(int argc, char** argv) {
-	//Variables for handling the SVF file and parser 
-	FILE* fp;
-	svfParser parser;
-	svfPlayer player;
-	int num_cmds; // # of commands completed
-	int num_tclk; // # of JTAG clock-cycles completed
-	int cur_line;
-	char* line;
-	size_t n;
-	string sent_tms, sent_tdi, expected_tdo, received_tdo;
+// Binary protocol (see arduino/jtagproto.h)
+bool uart_send_packet(uart_transport& io, uint8_t op, const uint8_t* payload, int len){
+	uint8_t pkt[JP_HDR_LEN + JP_MAX_PAYLOAD];
+	if (len > JP_MAX_PAYLOAD) return false;
+	pkt[0] = JP_SYNC;
+	pkt[1] = op;
+	pkt[2] = len & 0xff;
+	pkt[3] = len >> 8;
+	memcpy(pkt + JP_HDR_LEN, payload, len);
+	double t = stat_begin();
+	bool ok = io.write_all(pkt, JP_HDR_LEN + len);
+	stat_end(PHASE_UART_WRITE, t);
+	return ok;
+}
 
-	// Variables for handling the UART JTAG Programmer
-	int ttydevice;
-	char outBuff[6];
-	char resp[256];
+// Returns the payload length, or -1 on a read error or oversized packet
+int uart_recv_packet(uart_transport& io, uint8_t* op, uint8_t* payload, int maxlen){
+	uint8_t hdr[JP_HDR_LEN];
+	double t = stat_begin();
+	int len = -1;
+	// Skip anything that isn't a packet, e.g. a stale ASCII line
+	do {
+		if (!io.read_exact(hdr, 1)) goto out;
+	} while (hdr[0] != JP_SYNC);
+	if (!io.read_exact(hdr + 1, JP_HDR_LEN - 1)) goto out;
+	len = hdr[2] | (hdr[3] << 8);
+	if (len > maxlen || !io.read_exact(payload, len)) {
+		len = -1;
+		goto out;
+	}
+	*op = hdr[1];
+out:
+	stat_end(PHASE_UART_READ, t);
+	return len;
+}
 
-	// Command-line syntax check
-	if(argc < 3) {
-	print_usage:
-		fprintf(stderr,"usage: %s <input-svf-file> <uart-device-path>\n",argv[0]);
-		return EXIT_FAILURE;
+// jtagproto.h carries its own copy of the TAP model for the sketch; the
+// batch encoder below relies on it agreeing with libsvfplayer.h
+constexpr unsigned char jp_transitions[JP_ST_COUNT][2] = JP_TAP_TRANSITIONS;
+constexpr bool jp_matches_svf(){
+	for (int s = 0; s < JP_ST_COUNT; s++)
+		for (int t = 0; t < 2; t++)
+			if (jp_transitions[s][t] != (int)svfTransitionTable[s * 2 + t])
+				return false;
+	return true;
+}
+static_assert(JP_ST_COUNT == svfNumStates && jp_matches_svf(), "JP_TAP_TRANSITIONS differs from svfTransitionTable");
+static_assert(JP_ST_UNKNOWN == (int)svfState::UNKNOWN && JP_ST_RESET == (int)svfState::RESET &&
+	JP_ST_IDLE == (int)svfState::IDLE && JP_ST_DRSHIFT == (int)svfState::DRSHIFT &&
+	JP_ST_DRPAUSE == (int)svfState::DRPAUSE && JP_ST_IRSHIFT == (int)svfState::IRSHIFT &&
+	JP_ST_IRPAUSE == (int)svfState::IRPAUSE, "JP_ST_* numbering differs from svfState");
+
+/**
+ * Batch encoding (JP_OP_BATCH). The programmer keeps its own TAP state, so
+ * the encoder tracks it too and lowers the clocks into sub-ops:
+ *   shifts in Shift-DR/IR, up to the clock that exits     JP_SUB_SHIFT
+ *   runs of constant TMS/TDI that check nothing            JP_SUB_CLOCK
+ *   the svf path from one stable state to the next         JP_SUB_GOTO
+ *   anything else                                           JP_SUB_RAW
+ * Only SHIFT and RAW clocks are sampled. The others read back as 1, the
+ * pulled-up level of an undriven TDO, and never have TDO checked.
+ * In JP_OP_VERIFY packets (-w) every SHIFT or RAW with checked clocks is
+ * followed by a JP_SUB_EXPECT, and the programmer compares TDO itself.
+ */
+#define BATCH_MIN_RUN	4	// shorter constant runs go out as RAW
+
+// Shifts are packed (JP_SUB_ZSHIFT, JP_SUB_ZEXPECT) whenever that is
+// shorter, unless -u
+bool pack_shifts = true;
+
+struct batch_tap {
+	uint8_t state = JP_ST_UNKNOWN;
+	uint8_t ones = 0;
+};
+// The response carries TDO of clocks [clock, clock + count)
+struct batch_capture {
+	int64_t clock;
+	int count;
+};
+
+/**
+ * Credit-based flow control. The sketch's receive buffer (JP_OP_CREDIT)
+ * is the credit: the packet it is running has already left the buffer,
+ * and everything sent after it must fit. Within that, the window keeps
+ * just enough bytes in flight to cover the round trip measured at
+ * startup, as more only adds latency before a TDO error shows up.
+ */
+#define FLOW_RTT_PROBES		4
+#define FLOW_MAX_RETRIES	3
+// The smallest payload encode_packet() always gets clocks into: a
+// JP_SUB_SHIFT or JP_SUB_RAW of eight clocks with their JP_SUB_EXPECT.
+// A sketch with less buffer than that gets packets of this size one at a
+// time, which it reads out of its buffer as they arrive
+#define FLOW_MIN_PAYLOAD	11
+
+struct flow_control {
+	long credits = JP_DEFAULT_CREDIT;
+	int payload = JP_DEFAULT_CREDIT - JP_HDR_LEN;	// largest payload that fits the credit
+	long window = 2 * JP_DEFAULT_CREDIT;
+	double rtt = 0;				// seconds, of an empty request
+	deque<int> in_flight;		// wire size of each unanswered packet
+	long bytes = 0;
+
+	// The oldest packet is always sendable, so a window smaller than one
+	// packet still makes progress
+	bool can_send(int size) const {
+		if (in_flight.empty()) return true;
+		return bytes - in_flight.front() + size <= credits && bytes + size <= window;
 	}
+	void sent(int size){
+		in_flight.push_back(size);
+		bytes += size;
+	}
+	void answered(){
+		bytes -= in_flight.front();
+		in_flight.pop_front();
+	}
+	void tune(double rtt_seconds, long baud){
+		rtt = rtt_seconds;
+		payload = (int)max<long>(FLOW_MIN_PAYLOAD, min<long>(JP_MAX_PAYLOAD, credits - JP_HDR_LEN));
+		long packet = JP_HDR_LEN + payload;
+		long idle = (long)ceil(rtt * baud / 10);	// bytes the line could carry meanwhile
+		window = packet + min(credits, max(packet, idle));
+	}
+};
 
-	// Open the SVF file and the UART device
-    fp = fopen(argv[1], "r");
-    if (!fp){
-        printf("Could not open the svf file: %s\n", argv[1]);
-        goto abort;
-    }
-	if((ttydevice = uart_open(argv[2], B115200)) < 0) {
-		perror("open");
-		fprintf(stderr, "ERROR: could not open %s\n", argv[2]);
-		goto abort;
+// A programmer on a serial port, and what we know about its sketch
+struct prog_link {
+	unique_ptr<uart_transport> io;
+	bool batch = false;		// the sketch knows JP_OP_BATCH; set by probe_batch()
+	batch_tap tap;			// its TAP state after all we've sent
+	bool freq = false;		// the sketch paces TCK (JP_OP_FREQ); set by probe_frequency()
+	double freq_hz = 0;		// the last FREQUENCY asked for, 0: full speed
+	uint32_t tck_hz = 0;	// what the sketch paces TCK to, 0: not paced
+	bool freq_warned = false;
+	long baud = UART_DEFAULT_BAUD;
+	flow_control flow;		// set up by probe_flow()
+	bool verify = false;	// -w, and the sketch knows JP_OP_VERIFY; set by probe_verify()
+	bool mismatched = false;	// a JP_OP_VERIFY packet failed; nothing more is sent
+	bool pack = false;		// the sketch unpacks JP_SUB_ZSHIFT/ZEXPECT; set by probe_pack()
+};
+
+// Checks whether the sketch knows JP_OP_BATCH; older ones answer JP_ERR_OPCODE
+bool probe_batch(prog_link& link){
+	uint8_t resp[JP_MAX_PAYLOAD], op;
+	link.tap = batch_tap();
+	if (!uart_send_packet(*link.io, JP_OP_BATCH, NULL, 0))
+		return false;
+	int len = uart_recv_packet(*link.io, &op, resp, sizeof(resp));
+	if (len < 0)
+		return false;
+	link.batch = (op == JP_OP_BATCH && len == 0);
+	return true;
+}
+
+// Checks whether the sketch unpacks shift vectors, with a JP_SUB_ZSHIFT of
+// no clocks; older ones answer JP_ERR_OPCODE
+bool probe_pack(prog_link& link){
+	uint8_t req[5] = {JP_SUB_ZSHIFT, 0, 0, 0, 0}, resp[JP_MAX_PAYLOAD], op;
+	if (!uart_send_packet(*link.io, JP_OP_BATCH, req, sizeof(req)))
+		return false;
+	int len = uart_recv_packet(*link.io, &op, resp, sizeof(resp));
+	if (len < 0)
+		return false;
+	link.pack = (op == JP_OP_BATCH && len == 0);
+	return true;
+}
+
+// Checks whether the sketch knows JP_OP_VERIFY, and clears its sticky
+// error flag
+bool probe_verify(prog_link& link){
+	uint8_t resp[JP_MAX_PAYLOAD], op;
+	link.mismatched = false;
+	if (!uart_send_packet(*link.io, JP_OP_VERIFY, NULL, 0))
+		return false;
+	int len = uart_recv_packet(*link.io, &op, resp, sizeof(resp));
+	if (len < 0)
+		return false;
+	link.verify = (op == JP_OP_VERIFY && len == 0);
+	return true;
+}
+
+// Sends a JP_OP_FREQ or JP_OP_BAUD request with a uint32 argument; returns
+// 1 and the programmer's answer in got, 0 if the sketch doesn't know the
+// op, or -1 if the link is lost
+int request_u32(prog_link& link, uint8_t req_op, uint32_t value, uint32_t& got){
+	uint8_t req[4], resp[JP_MAX_PAYLOAD], op;
+	jp_put_u32(req, value);
+	double sent = stat_begin();
+	if (!uart_send_packet(*link.io, req_op, req, sizeof(req)))
+		return -1;
+	int len = uart_recv_packet(*link.io, &op, resp, sizeof(resp));
+	if (len < 0)
+		return -1;
+	stat_round_trip(sent);
+	if (op == JP_OP_ERROR && len == 1 && resp[0] == JP_ERR_OPCODE)
+		return 0;
+	if (op != req_op || len != 4)
+		return -1;
+	got = jp_get_u32(resp);
+	return 1;
+}
+
+// A FREQUENCY in JP_OP_FREQ's terms, rounded down so TCK stays below it
+uint32_t freq_arg(double hz){
+	if (hz <= 0) return 0;
+	if (hz >= 4294967295.0) return 0xffffffff;
+	return max<uint32_t>(1, (uint32_t)hz);
+}
+
+// Checks whether the sketch can pace TCK, leaving it at full speed
+bool probe_frequency(prog_link& link){
+	int r = request_u32(link, JP_OP_FREQ, 0, link.tck_hz);
+	link.freq = (r == 1);
+	link.freq_hz = 0;
+	return r >= 0;
+}
+
+// Keeps TCK at or below hz from here on; 0 lifts the limit. Sketches that
+// can't pace TCK run at their own speed, with a warning
+bool set_frequency(prog_link& link, double hz){
+	if (hz == link.freq_hz)
+		return true;
+	link.freq_hz = hz;
+	if (!link.freq) {
+		if (hz > 0 && !link.freq_warned) {
+			fprintf(stderr, "warning: the programmer's sketch can't pace TCK; FREQUENCY %.0f HZ ignored\n", hz);
+			link.freq_warned = true;
+		}
+		return true;
 	}
-	
-	// Talking to the JTAG Programmer I made with Arduino
-	//// 1) Reset the JTAG Programmer by sending a $RST command
-	uart_send_command(ttydevice, (char*)"$RST\n", 5, resp, 256);
-	cout<<"Devices connected to the JTAG interface are:"<<endl<<resp<<endl;
-	cout<<"Continue? (y/n): ";
-	cin>>resp;
-	if (strncmp(resp, "y",1))
-		return EXIT_SUCCESS;
-	//// 2) Send the commands from SVF	
-	num_cmds=0;
-	num_tclk=0;
-	cur_line=1;
-	parser.reset();
-	player.reset();
-	while(true) {
-		// Read a line from the SVF file
-		line=NULL;
-		if(getline(&line, &n, fp)<0)
-			break;
-	#ifdef DEBUG_ON
-        cout<<"Processing Line "<< cur_line <<": "<<line; 
-	#endif
-
-		// Parse the line until we can execute something
-		parser.processLine(line,strlen(line));
-		svfCommand cmd;
-		while(parser.nextCommand(cmd)) {
-			player.processCommand(cmd);
-			num_cmds++;
-		}
-		cur_line = parser.lineNum;		
-		num_tclk += player.outBuffer.length();
-
-		//
-		sent_tdi.clear();
-		sent_tms.clear();
-		expected_tdo.clear();
-		received_tdo.clear();
-		for (int i = 0 ; i < player.outBuffer.length(); i++){
-			// Each command translates into one byte per clock cycle;
-			// format of each byte:
-			//	bit 0: value to put on tms
-			//	bit 1: value to put on tdi
-			//	bit 2: value expected on tdo
-			//	bit 3: 0 if tdi is don't care, 1 otherwise
-			//	bit 4: 0 if tdo is don't care, 1 otherwise
-			uint8_t b = player.outBuffer[i];
+	if (request_u32(link, JP_OP_FREQ, freq_arg(hz), link.tck_hz) != 1) {
+		fprintf(stderr, "ERROR: the programmer didn't accept FREQUENCY %.0f HZ\n", hz);
+		return false;
+	}
+	return true;
+}
+
+// Moves the link to baud: the sketch answers at the old rate and switches,
+// then we follow and check that we still hear each other
+bool set_baud(prog_link& link, long baud){
+	uint32_t got = 0;
+	int r = request_u32(link, JP_OP_BAUD, baud, got);
+	if (r < 0)
+		return false;
+	if (r == 0 || got == 0) {
+		fprintf(stderr, "note: the programmer can't switch to %ld baud; staying at %d\n", baud, UART_DEFAULT_BAUD);
+		return true;
+	}
+	link.io->drain();
+	if (!link.io->set_baud(got)) {
+		perror("ioctl");
+		fprintf(stderr, "ERROR: could not set %u baud\n", got);
+		return false;
+	}
+	// Give the sketch time to restart its UART
+	usleep(20000);
+	uint8_t resp[JP_MAX_PAYLOAD], op;
+	if (!uart_send_packet(*link.io, JP_OP_BATCH, NULL, 0) ||
+			uart_recv_packet(*link.io, &op, resp, sizeof(resp)) != 0 || op != JP_OP_BATCH) {
+		fprintf(stderr, "ERROR: no answer from the programmer at %u baud\n", got);
+		return false;
+	}
+	link.baud = got;
+	return true;
+}
+
+// Asks the sketch for its credit and times a few round trips to size the
+// window; older sketches get JP_DEFAULT_CREDIT
+bool probe_flow(prog_link& link){
+	uint8_t resp[JP_MAX_PAYLOAD], op;
+	double best = 0;
+	link.flow = flow_control();
+	for (int i = 0; i < FLOW_RTT_PROBES; i++) {
+		double sent = mono_now();
+		if (!uart_send_packet(*link.io, JP_OP_CREDIT, NULL, 0))
+			return false;
+		int len = uart_recv_packet(*link.io, &op, resp, sizeof(resp));
+		if (len < 0)
+			return false;
+		double rtt = mono_now() - sent;
+		if (i == 0 || rtt < best)
+			best = rtt;
+		if (op == JP_OP_CREDIT && len == 2)
+			link.flow.credits = max(resp[0] | (resp[1] << 8), JP_HDR_LEN + 1);
+		else if (op != JP_OP_ERROR)
+			return false;
+	}
+	link.flow.tune(best, link.baud);
+	stats.flow_credits = link.flow.credits;
+	stats.flow_window = link.flow.window;
+	stats.flow_rtt = best;
+	return true;
+}
+
+// Clocks per packet while TCK is paced, so a packet runs for at most about
+// PACED_PACKET_SECONDS even if the sketch paces at half the requested rate
+#define PACED_PACKET_SECONDS	0.125
+int64_t packet_clock_limit(bool paced, double hz){
+	if (!paced || hz <= 0)
+		return INT64_MAX;
+	return max<int64_t>(1, (int64_t)(hz * PACED_PACKET_SECONDS));
+}
+
+bool is_stable_state(uint8_t st){
+	return st == JP_ST_RESET || st == JP_ST_IDLE || st == JP_ST_DRSHIFT ||
+		st == JP_ST_DRPAUSE || st == JP_ST_IRSHIFT || st == JP_ST_IRPAUSE;
+}
+
+// Length of the run at pos of clocks equal to pos in tms and tdi and with
+// no TDO check, up to limit
+int64_t constant_run(const svfVectorsView& v, int64_t pos, int64_t limit){
+	uint64_t tms = v.tms.get(pos) ? ~uint64_t(0) : 0;
+	uint64_t tdi = v.tdi.get(pos) ? ~uint64_t(0) : 0;
+	int64_t run = 0;
+	while (run < limit) {
+		int k = (int)min<int64_t>(64, limit - run);
+		uint64_t diff = (v.tms.getBits(pos + run, k) ^ tms) | (v.tdi.getBits(pos + run, k) ^ tdi) |
+			v.tdoCare.getBits(pos + run, k);
+		if (k < 64) diff &= (uint64_t(1) << k) - 1;
+		if (diff) return run + __builtin_ctzll(diff);
+		run += k;
+	}
+	return run;
+}
+
+// Encodes clocks from pos on into one packet of at most max_len payload bytes:
+// JP_OP_BATCH, JP_OP_VERIFY if verify is set, or JP_OP_SHIFT if batch is
+// false (sketches that don't know batches). With pack, shifts are packed
+// where that helps. Advances pos and tap, and lists the clocks the
+// programmer samples.
+int encode_packet(const svfVectorsView& v, int64_t& pos, int64_t end, bool batch, bool verify, bool pack,
+		batch_tap& tap, uint8_t& op, uint8_t* payload, int max_len, vector<batch_capture>& captures){
+	int len = 0, captured = 0;
+	captures.clear();
+	if (!batch) {
+		int n = (int)min<int64_t>(end - pos, min((max_len - 2) / 2 * 8, JP_MAX_CLOCKS));
+		int nbytes = JP_BYTES(n);
+		payload[0] = n & 0xff;
+		payload[1] = n >> 8;
+		v.tms.copyBytes(pos, n, payload + 2);
+		v.tdi.copyBytes(pos, n, payload + 2 + nbytes);
+		captures.push_back({pos, n});
+		pos += n;
+		op = JP_OP_SHIFT;
+		return 2 + 2 * nbytes;
+	}
+	op = verify ? JP_OP_VERIFY : JP_OP_BATCH;
+	auto capture = [&](int64_t from, int n) {
+		if (!captures.empty() && captures.back().clock + captures.back().count == from)
+			captures.back().count += n;
+		else
+			captures.push_back({from, n});
+		captured += n;
+	};
+	// The JP_SUB_EXPECT for clocks [from, from + n): sets its flags and
+	// returns its size, 0 if none of them is checked or the programmer
+	// doesn't check
+	auto expect_size = [&](int64_t from, int64_t n, uint8_t& flags) -> int {
+		bool any = false, all = true, ones = true, zeros = true;
+		for (int64_t i = 0; verify && i < n; i += 64) {
+			int k = (int)min<int64_t>(64, n - i);
+			uint64_t care = v.tdoCare.getBits(from + i, k);
+			uint64_t tdo = v.tdo.getBits(from + i, k) & care;
+			any |= care != 0;
+			all &= care == (k < 64 ? (uint64_t(1) << k) - 1 : ~uint64_t(0));
+			ones &= tdo == care;
+			zeros &= tdo == 0;
+		}
+		if (!any) return 0;
+		flags = (all ? JP_EXPECT_ALL : 0) | (ones || zeros ? JP_EXPECT_FILL : 0) | (ones ? JP_EXPECT_ONES : 0);
+		return jp_expect_len(flags, n);
+	};
+	auto expect = [&](int64_t from, int64_t n, uint8_t flags, int size) {
+		if (size == 0) return;
+		uint8_t* x = payload + len;
+		x[0] = JP_SUB_EXPECT;
+		x[1] = flags;
+		x[2] = n & 0xff;
+		x[3] = n >> 8;
+		x += 4;
+		if (!(flags & JP_EXPECT_FILL)) {
+			v.tdo.copyBytes(from, n, x);
+			x += JP_BYTES(n);
+		}
+		if (!(flags & JP_EXPECT_ALL))
+			v.tdoCare.copyBytes(from, n, x);
+		len += size;
+	};
+	// Up to and including the clock with TMS high, if it's in reach
+	auto shift_length = [&](int64_t limit, bool& exit) {
+		int64_t n = 0;
+		exit = false;
+		while (n < limit && !exit) {
+			int k = (int)min<int64_t>(64, limit - n);
+			uint64_t tms = v.tms.getBits(pos + n, k);
+			if (tms) {
+				n += __builtin_ctzll(tms) + 1;
+				exit = true;
+			} else n += k;
+		}
+		return n;
+	};
+	// Moves past a shift of n clocks, the last of them with TMS high if exit
+	auto shifted = [&](int64_t n, bool exit) {
+		capture(pos, (int)n);
+		if (n > 1 || !exit) tap.ones = 0;
+		if (exit) tap.state = jp_tap_step(tap.state, 1, &tap.ones);
+		pos += n;
+	};
+	// The shift at pos as a JP_SUB_ZSHIFT, followed by its JP_SUB_EXPECT or,
+	// if that is shorter, a JP_SUB_ZEXPECT. Halves the clocks until they fit
+	// in room; false if TDI doesn't pack any shorter than it is
+	auto packed_shift = [&](int room) {
+		uint8_t vectors[2 * JP_BYTES(JP_MAX_CLOCKS)];
+		for (int64_t limit = min<int64_t>(end - pos, JP_MAX_CLOCKS - captured); limit > 0 && room > 5; limit /= 2) {
+			bool exit;
+			uint8_t flags = 0;
+			int64_t n = shift_length(limit, exit);
+			int nbytes = JP_BYTES(n);
+			if (nbytes < 3)
+				return false;
+			// A JP_SUB_ZSHIFT has one byte more than a JP_SUB_SHIFT
+			uint8_t* z = payload + len;
+			v.tdi.copyBytes(pos, n, vectors);
+			int size = jp_pack(vectors, nbytes, z + 5, min(room - 5, nbytes - 2));
+			if (size == 0) {
+				if (room - 5 >= nbytes - 2)
+					return false;
+				continue;
+			}
+			int check = expect_size(pos, n, flags);
+			int vbytes = check > 0 ? jp_expect_vectors(flags, n) : 0;
+			int left = room - 5 - size, xsize = 0;
+			if (vbytes > 0 && check > 6 && left > 5) {
+				uint8_t* x = vectors;
+				if (!(flags & JP_EXPECT_FILL)) {
+					v.tdo.copyBytes(pos, n, x);
+					x += nbytes;
+				}
+				if (!(flags & JP_EXPECT_ALL))
+					v.tdoCare.copyBytes(pos, n, x);
+				xsize = jp_pack(vectors, vbytes, z + 5 + size + 5, min(left - 5, check - 6));
+			}
+			if ((xsize ? 5 + xsize : check) > left)
+				continue;
+			z[0] = JP_SUB_ZSHIFT;
+			z[1] = exit ? JP_SHIFT_EXIT : 0;
+			z[2] = n & 0xff;
+			z[3] = n >> 8;
+			z[4] = size;
+			len += 5 + size;
+			if (xsize) {
+				uint8_t* x = payload + len;
+				x[0] = JP_SUB_ZEXPECT;
+				x[1] = flags;
+				x[2] = n & 0xff;
+				x[3] = n >> 8;
+				x[4] = xsize;
+				len += 5 + xsize;
+			} else expect(pos, n, flags, check);
+			pack_raw_bytes += nbytes + vbytes;
+			pack_sent_bytes += size + (xsize ? xsize : vbytes);
+			shifted(n, exit);
+			return true;
+		}
+		return false;
+	};
+	while (pos < end) {
+		int room = max_len - len;
+		uint8_t st = tap.state;
+		if (st == JP_ST_DRSHIFT || st == JP_ST_IRSHIFT) {
+			if (pack && packed_shift(room))
+				continue;
+			int64_t limit = min<int64_t>(min<int64_t>(end - pos, (int64_t)(room - 4) * 8),
+				min(JP_MAX_CLOCKS - captured, 0xffff));
+			if (limit <= 0) break;
+			bool exit;
+			uint8_t flags = 0;
+			int64_t n = shift_length(limit, exit);
+			int check = expect_size(pos, n, flags);
+			// Checked clocks take one to three bytes per eight, depending on
+			// the vectors the JP_SUB_EXPECT carries
+			for (int per = 3 - !!(flags & JP_EXPECT_ALL) - !!(flags & JP_EXPECT_FILL);
+					4 + JP_BYTES(n) + check > room && limit > 0; per = 3) {
+				limit = min<int64_t>(limit, (int64_t)(room - 8) / per * 8);
+				n = shift_length(limit, exit);
+				check = expect_size(pos, n, flags);
+			}
+			if (limit <= 0) break;
+			payload[len] = JP_SUB_SHIFT;
+			payload[len + 1] = exit ? JP_SHIFT_EXIT : 0;
+			payload[len + 2] = n & 0xff;
+			payload[len + 3] = n >> 8;
+			v.tdi.copyBytes(pos, n, payload + len + 4);
+			len += 4 + JP_BYTES(n);
+			expect(pos, n, flags, check);
+			if (pack) {
+				int bytes = JP_BYTES(n) + (check > 0 ? jp_expect_vectors(flags, n) : 0);
+				pack_raw_bytes += bytes;
+				pack_sent_bytes += bytes;
+			}
+			shifted(n, exit);
+			continue;
+		}
+		int64_t run = constant_run(v, pos, min<int64_t>(end - pos, 0xffff));
+		if (run >= BATCH_MIN_RUN) {
+			if (room < 4) break;
+			bool tms = v.tms.get(pos);
+			payload[len] = JP_SUB_CLOCK;
+			payload[len + 1] = (tms ? JP_CLK_TMS : 0) | (v.tdi.get(pos) ? JP_CLK_TDI : 0);
+			payload[len + 2] = run & 0xff;
+			payload[len + 3] = run >> 8;
+			len += 4;
+			// Constant TMS settles in a state within five clocks
+			for (int64_t i = 0; i < min<int64_t>(run, 8); i++)
+				tap.state = jp_tap_step(tap.state, tms, &tap.ones);
+			pos += run;
+			continue;
+		}
+		if (st >= JP_ST_RESET) {
+			// The svf path to the next stable state, with TDI low
+			batch_tap t = tap;
+			uint16_t bits = 0;
+			int n = 0;
+			while (n < 16 && pos + n < end && !v.tdoCare.get(pos + n) && !v.tdi.get(pos + n)) {
+				bool tms = v.tms.get(pos + n);
+				bits |= tms << n;
+				t.state = jp_tap_step(t.state, tms, &t.ones);
+				n++;
+				if (is_stable_state(t.state)) break;
+			}
+			const svfTmsPath& path = svfTmsPaths(svfState(st), svfState(t.state));
+			if (n > 0 && is_stable_state(t.state) && path.valid && path.len == n && path.bits == bits) {
+				if (room < 2) break;
+				payload[len++] = JP_SUB_GOTO;
+				payload[len++] = t.state;
+				tap = t;
+				pos += n;
+				continue;
+			}
+		}
+		// Raw clocks, until the encoder finds something better to do
+		int n = 0;
+		int limit = (int)min<int64_t>(min<int64_t>(end - pos, 8), JP_MAX_CLOCKS - captured);
+		uint8_t flags = 0;
+		if (limit <= 0 || room < 4 + (expect_size(pos, limit, flags) > 0 ? 6 : 0)) break;
+		uint8_t* raw = payload + len;
+		raw[0] = JP_SUB_RAW;
+		raw[2] = raw[3] = 0;
+		while (n < limit) {
+			bool tms = v.tms.get(pos + n);
+			raw[2] |= tms << n;
+			raw[3] |= v.tdi.get(pos + n) << n;
+			tap.state = jp_tap_step(tap.state, tms, &tap.ones);
+			n++;
+			if (tap.state == JP_ST_DRSHIFT || tap.state == JP_ST_IRSHIFT || is_stable_state(tap.state))
+				break;
+		}
+		raw[1] = n;
+		len += 4;
+		capture(pos, n);
+		expect(pos, n, flags, expect_size(pos, n, flags));
+		pos += n;
+	}
+	return len;
+}
+
+// Appends TDO for clocks [from, to) to received: the sampled bits in resp
+// for the captured clocks, 1 for the rest
+void decode_response(const uint8_t* resp, int len, const vector<batch_capture>& captures,
+		int64_t from, int64_t to, svfBitVector& received){
+	svfBitVector sampled;
+	sampled.appendBytes(resp, len * 8);
+	int64_t pos = from, bit = 0;
+	for (const batch_capture& c : captures) {
+		received.appendRun(1, c.clock - pos);
+		received.appendView(sampled.view(), bit, c.count);
+		bit += c.count;
+		pos = c.clock + c.count;
+	}
+	received.appendRun(1, to - pos);
+}
+
+int captured_bytes(const vector<batch_capture>& captures){
+	int n = 0;
+	for (const batch_capture& c : captures)
+		n += c.count;
+	return JP_BYTES(n);
+}
+
+// Appends the TDO clocks [from, to) of v read back when they match: the
+// expected value where it is checked, 1 elsewhere
+void append_expected(const svfVectorsView& v, int64_t from, int64_t to, svfBitVector& received){
+	for (int64_t pos = from; pos < to; pos += 64) {
+		int k = (int)min<int64_t>(64, to - pos);
+		received.appendBits(v.tdo.getBits(pos, k) | ~v.tdoCare.getBits(pos, k), k);
+	}
+}
+
+bool verify_response_fits(int len, const vector<batch_capture>& captures){
+	return len == 0 || (len >= 2 && len <= 2 + captured_bytes(captures));
+}
+
+// Appends TDO for clocks [from, to) to received from a JP_OP_VERIFY
+// response. A match sends nothing back, so its clocks get append_expected().
+// After a mismatch they get the sampled bits up to the failing clock, which
+// firstMismatch() then finds again
+void decode_verify(const uint8_t* resp, int len, const vector<batch_capture>& captures,
+		const svfVectorsView& v, int64_t from, int64_t to, svfBitVector& received){
+	svfBitVector sampled;
+	if (len >= 2)
+		sampled.appendBytes(resp + 2, min((resp[0] | (resp[1] << 8)) + 1, (len - 2) * 8));
+	int64_t pos = from, bit = 0;
+	for (const batch_capture& c : captures) {
+		int64_t k = max<int64_t>(0, min<int64_t>(c.count, sampled.len - bit));
+		append_expected(v, pos, c.clock, received);
+		received.appendView(sampled.view(), bit, k);
+		append_expected(v, c.clock + k, c.clock + c.count, received);
+		bit += c.count;
+		pos = c.clock + c.count;
+	}
+	append_expected(v, pos, to, received);
+}
+
+// Clocks sent before their TDO is checked. Commands are batched up to this
+// size; a mismatch is mapped back to its line through an svfLineIndex
+#define VERIFY_BLOCK_CLOCKS	(JP_MAX_CLOCKS * 16)
+
+// A packet sent by play_vectors whose response is still to come
+struct flow_packet {
+	int64_t start, end;				// the clocks it carries
+	vector<batch_capture> captures;
+	uint8_t op;
+	int len;
+	uint8_t payload[JP_MAX_PAYLOAD];	// kept for a retransmit
+	double sent;
+	int wire_bytes() const { return JP_HDR_LEN + len; }
+};
+
+// Receives the response to the oldest packet in flight and appends its TDO to
+// received. A packet the sketch got truncated (JP_ERR_LENGTH) is sent again,
+// but only when nothing followed it: the sketch has then discarded it without
+// running it, whereas with more behind it the stream is out of step.
+bool receive_oldest(prog_link& link, const svfVectorsView& vectors, deque<flow_packet>& in_flight,
+		svfBitVector& received){
+	uint8_t resp[JP_MAX_PAYLOAD], op;
+	flow_packet& p = in_flight.front();
+	for (int tries = 0; ; tries++) {
+		int len = uart_recv_packet(*link.io, &op, resp, sizeof(resp));
+		if (len < 0) return false;
+		stat_round_trip(p.sent);
+		if (op == JP_OP_ERROR && len == 1 && resp[0] == JP_ERR_LENGTH && in_flight.size() == 1 &&
+				tries < FLOW_MAX_RETRIES) {
+			link.io->discard();
+			stats.retransmits++;
+			p.sent = stat_begin();
+			if (!uart_send_packet(*link.io, p.op, p.payload, p.len))
+				return false;
+			continue;
+		}
+		if (op == JP_OP_ERROR && len == 1 && resp[0] == JP_ERR_VERIFY && link.mismatched) {
+			// Skipped after the mismatch, which is what gets reported
+			append_expected(vectors, p.start, p.end, received);
+			break;
+		}
+		if (op == JP_OP_ERROR) {
+			fprintf(stderr, "ERROR: programmer rejected packet (code %d)\n", len > 0 ? resp[0] : -1);
+			return false;
+		}
+		if (op != p.op || (op == JP_OP_VERIFY ? !verify_response_fits(len, p.captures) : len != captured_bytes(p.captures))) {
+			fprintf(stderr, "ERROR: unexpected response from programmer\n");
+			return false;
+		}
+		if (op == JP_OP_VERIFY) {
+			decode_verify(resp, len, p.captures, vectors, p.start, p.end, received);
+			if (len > 0)
+				link.mismatched = true;
+		} else {
+			decode_response(resp, len, p.captures, p.start, p.end, received);
+		}
+		break;
+	}
+	link.flow.answered();
+	in_flight.pop_front();
+	return true;
+}
+
+// Plays clocks [from, to) of vectors through the programmer and appends the
+// sampled TDO bits to received, which must already hold clocks [0, from).
+// Nothing is checked here; callers verify whole blocks afterwards with
+// svfVectorsView::firstMismatch. Returns false if communication with the
+// programmer failed.
+bool play_vectors(prog_link& link, bool ascii, const svfVectorsView& vectors, int64_t from, int64_t to, svfBitVector& received,
+		const svfFreqMark* freqs = NULL, int64_t freq_count = 0){
+	int64_t f = 0;
+	char outBuff[6], line[256];
+	if (ascii) {
+		for (int64_t i = from; i < to; i++){
+			// Each clock cycle becomes one "$<tms><tdi><tdo>" command
+			uint8_t b = vectors.byteAt(i);
 			outBuff[0] = '$'; // We send this to Arduino
 			// TMS
 			outBuff[1] = (b & 0x1) + '0';
-			sent_tms.append(1, outBuff[1]);
 			// TDI
-			outBuff[2] = (b & 0x8)  ? (char)((player.outBuffer[i] & 0x2)>>1) + '0' : 'x';
-			sent_tdi.append(1, outBuff[2]);
+			outBuff[2] = (b & 0x8)  ? (char)((b & 0x2)>>1) + '0' : 'x';
 			// Expected TDO
-			outBuff[3] = (b & 0x10) ? (char)((player.outBuffer[i] & 0x4)>>2) + '0' : 'x';
-			expected_tdo.append(1, outBuff[3]);
+			outBuff[3] = (b & 0x10) ? (char)((b & 0x4)>>2) + '0' : 'x';
 			// End of the command
 			outBuff[4] = '\n';
 		#ifdef DEBUG_ON
@@ -182,34 +1262,1459 @@ int main(int argc, char** argv) {
 					", TDI: "<< outBuff[2] <<
 					", TDO? "<< outBuff[3] << endl;
 		#endif
-			uart_send_command(ttydevice, outBuff, 5, resp, 256);
-			received_tdo.append(1, resp[5]);
+			if (!uart_send_command(*link.io, outBuff, 5, line, 256))
+				return false;
 		#ifdef DEBUG_ON
-			printf("Response: %s\n", resp);
+			printf("Response: %s\n", line);
 		#endif
-			if (resp[0] == 'T' && resp[1] == 'D' &&	resp[2] == 'O' &&
-				resp[3] == ':' && resp[4] == ' '){
-				// Valid resp
-				if (outBuff[3]!= 'x' && resp[5] != outBuff[3]){
-					cout<<"Error while executing command at line "<<cur_line<<endl;
-					cout<<"\tLine: "<<line;
-					cout<<"\tSent: TMS<"<<sent_tms<<">, TDI<"<<sent_tdi<<">"<<endl;
-					cout<<"\tExpected TDO<"<<expected_tdo<<">"<<endl;
-					cout<<"\tReceived TDO<"<<received_tdo<<">"<<endl;
-					return EXIT_FAILURE;
+			if (strncmp(line, "TDO: ", 5) != 0) {
+				fprintf(stderr, "ERROR: unexpected response from programmer: %s", line);
+				return false;
+			}
+			received.appendBits(line[5] == '1', 1);
+		}
+		return true;
+	}
+	// Packets go out as long as the flow control lets them, and responses
+	// are read when it doesn't
+	deque<flow_packet> in_flight;
+	while (f < freq_count && freqs[f].clock < from)
+		f++;
+	for (int64_t pos = from; !link.mismatched; ) {
+		// FREQUENCY takes effect between the packets around its clock, once
+		// all before it are answered
+		if (f < freq_count && freqs[f].clock <= pos) {
+			while (!in_flight.empty())
+				if (!receive_oldest(link, vectors, in_flight, received))
+					return false;
+			for (; f < freq_count && freqs[f].clock <= pos; f++)
+				if (!set_frequency(link, freqs[f].hz))
+					return false;
+		}
+		if (pos >= to)
+			break;
+		int64_t end = pos + min(to - pos, packet_clock_limit(link.freq, link.freq_hz));
+		if (f < freq_count)
+			end = min(end, freqs[f].clock);
+		flow_packet p;
+		p.start = pos;
+		p.len = encode_packet(vectors, pos, end, link.batch, link.verify, link.pack, link.tap, p.op, p.payload,
+			link.flow.payload, p.captures);
+		p.end = pos;
+		if (p.end == p.start) {
+			fprintf(stderr, "ERROR: no clocks fit in a %d byte packet\n", link.flow.payload);
+			return false;
+		}
+		if (!link.flow.can_send(p.wire_bytes())) {
+			stats.flow_stalls++;
+			while (!link.flow.can_send(p.wire_bytes()))
+				if (!receive_oldest(link, vectors, in_flight, received))
+					return false;
+		}
+		p.sent = stat_begin();
+		if (!uart_send_packet(*link.io, p.op, p.payload, p.len))
+			return false;
+		link.flow.sent(p.wire_bytes());
+		in_flight.push_back(move(p));
+	}
+	while (!in_flight.empty())
+		if (!receive_oldest(link, vectors, in_flight, received))
+			return false;
+	// What the programmer skipped can't fail before the mismatch does
+	if (received.len < to)
+		append_expected(vectors, received.len, to, received);
+	return true;
+}
+
+// Renders clocks [from, to) the way the ASCII protocol sends them, for error reports
+void describe_clocks(const svfVectorsView& vectors, const svfBitVector& received, int64_t from, int64_t to,
+		string& sent_tms, string& sent_tdi, string& expected_tdo, string& received_tdo){
+	sent_tms.clear();
+	sent_tdi.clear();
+	expected_tdo.clear();
+	received_tdo.clear();
+	for (int64_t i = from; i < to; i++) {
+		uint8_t b = vectors.byteAt(i);
+		sent_tms.append(1, (b & 0x1) + '0');
+		sent_tdi.append(1, (b & 0x8) ? (char)((b & 0x2)>>1) + '0' : 'x');
+		expected_tdo.append(1, (b & 0x10) ? (char)((b & 0x4)>>2) + '0' : 'x');
+		received_tdo.append(1, i < received.len ? received.get(i) + '0' : 'x');
+	}
+}
+
+// line is the text of the offending svf line, or empty if it isn't at hand
+void report_tdo_error(int cur_line, string_view line, const string& sent_tms, const string& sent_tdi,
+		const string& expected_tdo, const string& received_tdo, ostream& out = cout){
+	out<<"Error while executing command at line "<<cur_line<<endl;
+	if (!line.empty())
+		out<<"\tLine: "<<line;
+	out<<"\tSent: TMS<"<<sent_tms<<">, TDI<"<<sent_tdi<<">"<<endl;
+	out<<"\tExpected TDO<"<<expected_tdo<<">"<<endl;
+	out<<"\tReceived TDO<"<<received_tdo<<">"<<endl;
+}
+
+// Reports the TDO mismatch at clock bad, attributed through the line index;
+// texts holds the source line of each mark, or is NULL
+void report_mismatch(const svfVectorsView& vectors, const svfBitVector& received, int64_t bad,
+		const svfLineMark* marks, int64_t count, const string* texts, ostream& out = cout){
+	string sent_tms, sent_tdi, expected_tdo, received_tdo;
+	int64_t m = svfLineIndex::lookup(marks, count, bad);
+	int64_t from = m >= 0 ? marks[m].clock : 0;
+	int64_t to = (m + 1 < count) ? marks[m+1].clock : received.len;
+	describe_clocks(vectors, received, from, min(to, received.len),
+		sent_tms, sent_tdi, expected_tdo, received_tdo);
+	report_tdo_error(m >= 0 ? marks[m].line : 0, (m >= 0 && texts) ? string_view(texts[m]) : string_view(),
+		sent_tms, sent_tdi, expected_tdo, received_tdo, out);
+}
+
+// -t: every clock played and the TDO read back go to a trace file, which
+// svftrace turns into VCD. record() copies each verified block of clocks;
+// a thread of its own writes them out
+#define TRACE_RING_BLOCKS	16
+struct trace_recorder {
+	FILE* f = NULL;
+	string path;
+	svfRing<svfTraceBlock> blocks{TRACE_RING_BLOCKS};
+	thread writer;
+	atomic<bool> closing{false}, failed{false};
+	int64_t clocks = 0;			// recorded so far
+
+	~trace_recorder(){
+		close();
+	}
+	bool open(const string& trace_path){
+		path = trace_path;
+		f = fopen(path.c_str(), "wb");
+		if (f == NULL || fwrite(SVF_TRACE_MAGIC, 1, 8, f) != 8) {
+			perror(path.c_str());
+			if (f) fclose(f);
+			f = NULL;
+			return false;
+		}
+		writer = thread(&trace_recorder::write_blocks, this);
+		return true;
+	}
+	void write_blocks(){
+		svfBackoff backoff;
+		svfTraceBlock block;
+		while (true) {
+			// everything pushed before closing was set is in the ring
+			bool last = closing;
+			if (blocks.pop(block)) {
+				if (!block.write(f))
+					failed = true;
+				backoff.reset();
+			} else if (last) {
+				return;
+			} else {
+				backoff.wait();
+			}
+		}
+	}
+	// Clocks [from, to) of v with their TDO in received, which is indexed
+	// like v; marks (also indexed like v) says which commands made them
+	void record(const svfVectorsView& v, const svfBitVector& received, int64_t from, int64_t to,
+			const svfLineMark* marks, int64_t count){
+		if (f == NULL || to <= from)
+			return;
+		svfTraceBlock block;
+		block.assign(v, received.view(), from, to, clocks);
+		for (int64_t m = max<int64_t>(0, svfLineIndex::lookup(marks, count, from)); m < count && marks[m].clock < to; m++)
+			block.addMark(clocks + max(marks[m].clock, from) - from, marks[m].line, marks[m].op);
+		clocks += to - from;
+		svfBackoff backoff;
+		while (!blocks.push(block))
+			backoff.wait();
+	}
+	// Waits for the writer; false if the trace couldn't be written
+	bool close(){
+		if (f == NULL)
+			return true;
+		closing = true;
+		writer.join();
+		if (fclose(f) != 0)
+			failed = true;
+		f = NULL;
+		if (failed)
+			fprintf(stderr, "ERROR: could not write the trace to %s\n", path.c_str());
+		return !failed;
+	}
+};
+
+// -O: commands go through the peephole optimizer before the player. Only
+// one thread parses at a time, so one is enough
+bool optimize = false;
+svfPeephole peephole;
+
+void print_peephole(){
+	printf("peephole: dropped %lld of %lld commands, saved %lld clocks\n", (long long)peephole.dropped,
+		(long long)peephole.commands, (long long)peephole.clocksSaved);
+}
+
+// Keeps the source line of a command for error reports, cut short if it
+// holds a whole huge scan
+#define REPORT_LINE_MAX	200
+string line_text(string_view line){
+	if (line.size() <= REPORT_LINE_MAX)
+		return string(line);
+	return string(line.substr(0, REPORT_LINE_MAX)) + "...\n";
+}
+
+// Thrown by a block_sink's play once it has reported why playing failed
+struct play_failed {};
+
+// The sequential path's sink: collects the player's clocks into a block and
+// calls play as soon as VERIFY_BLOCK_CLOCKS are in, in the middle of a
+// command if need be. A long SDR or RUNTEST thus goes out a block at a time
+// while it is being generated, instead of being generated whole first
+struct block_sink : svfSink {
+	svfVectors block;
+	int64_t clocks = 0;			// all clocks so far
+	double play_seconds = 0;	// spent in play, with --stats
+	function<void()> play;		// plays and clears block; throws play_failed
+
+	void appendTms(bool v, int64_t n) override {
+		while (n > 0) {
+			int64_t k = min(n, room());
+			block.appendTms(v, k);
+			added(k);
+			n -= k;
+		}
+	}
+	void appendTmsBits(uint64_t bits, int n) override {
+		block.appendTmsBits(bits, n);
+		added(n);
+	}
+	void appendStreams(const uint64_t bits[5], int n) override {
+		block.appendStreams(bits, n);
+		added(n);
+	}
+	void appendShift(const svfData& data, bool exit) override {
+		// the pieces start on a byte of data
+		for (int64_t pos = 0; pos < data.dataLen; ) {
+			int64_t k = min<int64_t>(data.dataLen - pos, (room() + 7) & ~7);
+			block.appendShift(data, pos, k, exit);
+			added(k);
+			pos += k;
+		}
+	}
+	int64_t room() const {
+		return max<int64_t>(1, VERIFY_BLOCK_CLOCKS - block.length());
+	}
+	void added(int64_t n) {
+		clocks += n;
+		if (block.length() < VERIFY_BLOCK_CLOCKS)
+			return;
+		double t = stat_begin();
+		play();
+		if (stats_on)
+			play_seconds += mono_now() - t;
+	}
+};
+
+/**
+ * Compressed svf files. Input that starts with the gzip or xz magic bytes
+ * is decompressed SVF_INPUT_CHUNK bytes at a time into the parser's stream
+ * mode; anything else is memory mapped as before.
+ */
+#define SVF_INPUT_CHUNK		(1 << 16)
+enum svf_compression { SVF_PLAIN, SVF_GZIP, SVF_XZ };
+
+struct svf_input {
+	int fd = -1;
+	svf_compression kind = SVF_PLAIN;
+	z_stream gz;
+	lzma_stream xz = LZMA_STREAM_INIT;
+	uint8_t in[SVF_INPUT_CHUNK];
+	size_t in_len = 0, in_pos = 0;
+	bool in_end = false, done = false;
+	bool between_members = true;	// gzip: no member is half decoded
+	int64_t size = 0, consumed = 0;	// of the file, i.e. compressed bytes
+
+	~svf_input(){ close(); }
+	// Opens path and finds out how it's compressed; false if it can't be read
+	bool open(const char* path){
+		static const uint8_t gz_magic[] = {0x1f, 0x8b};
+		static const uint8_t xz_magic[] = {0xfd, '7', 'z', 'X', 'Z', 0};
+		struct stat st;
+		close();
+		if ((fd = ::open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0 || !fill())
+			return false;
+		size = st.st_size;
+		kind = SVF_PLAIN;
+		if (in_len >= sizeof(gz_magic) && !memcmp(in, gz_magic, sizeof(gz_magic))) {
+			memset(&gz, 0, sizeof(gz));
+			// 15 + 16: a gzip wrapper around a full size deflate window
+			if (inflateInit2(&gz, 15 + 16) != Z_OK)
+				return false;
+			kind = SVF_GZIP;
+		} else if (in_len >= sizeof(xz_magic) && !memcmp(in, xz_magic, sizeof(xz_magic))) {
+			if (lzma_stream_decoder(&xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+				return false;
+			kind = SVF_XZ;
+		}
+		return true;
+	}
+	void close(){
+		if (kind == SVF_GZIP) inflateEnd(&gz);
+		if (kind == SVF_XZ) lzma_end(&xz);
+		kind = SVF_PLAIN;
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+		in_len = in_pos = 0;
+		in_end = done = false;
+		between_members = true;
+		consumed = 0;
+	}
+	// Reads the next chunk of the file once the last one is used up
+	bool fill(){
+		if (in_pos < in_len || in_end)
+			return true;
+		ssize_t r = ::read(fd, in, sizeof(in));
+		if (r < 0)
+			return false;
+		in_pos = 0;
+		in_len = r;
+		in_end = (r == 0);
+		return true;
+	}
+	// Up to n bytes of svf text; 0 at the end. Throws on a read error or
+	// corrupt data
+	size_t read(char* out, size_t n){
+		size_t got = 0;
+		while (got < n && !done) {
+			if (!fill())
+				throw runtime_error("error: could not read the svf file");
+			size_t avail = in_len - in_pos;
+			if (kind == SVF_PLAIN) {
+				size_t k = min(avail, n - got);
+				memcpy(out + got, in + in_pos, k);
+				in_pos += k;
+				got += k;
+				consumed += k;
+				done = in_end;
+				continue;
+			}
+			size_t left;
+			if (kind == SVF_GZIP) {
+				// another member may follow the end of a stream, as in cat a.gz b.gz
+				gz.next_in = in + in_pos;
+				gz.avail_in = avail;
+				gz.next_out = (Bytef*)out + got;
+				gz.avail_out = n - got;
+				int r = inflate(&gz, Z_NO_FLUSH);
+				left = gz.avail_in;
+				if (r == Z_STREAM_END) {
+					inflateReset(&gz);
+					between_members = true;
+				} else if (r == Z_OK) {
+					between_members = false;
+				} else if (r != Z_BUF_ERROR) {
+					throw runtime_error("error: corrupt gzip data in the svf file");
 				}
+				got = n - gz.avail_out;
+				if (in_end && left == 0) {
+					if (!between_members)
+						throw runtime_error("error: the gzip svf file is truncated");
+					done = true;
+				}
+			} else {
+				xz.next_in = in + in_pos;
+				xz.avail_in = avail;
+				xz.next_out = (uint8_t*)out + got;
+				xz.avail_out = n - got;
+				lzma_ret r = lzma_code(&xz, in_end ? LZMA_FINISH : LZMA_RUN);
+				got = n - xz.avail_out;
+				left = xz.avail_in;
+				if (r == LZMA_STREAM_END)
+					done = true;
+				else if (r != LZMA_OK && r != LZMA_BUF_ERROR)
+					throw runtime_error("error: corrupt xz data in the svf file");
+				else if (in_end && r == LZMA_BUF_ERROR)
+					throw runtime_error("error: the xz svf file is truncated");
+			}
+			consumed += avail - left;
+			in_pos = in_len - left;
+		}
+		return got;
+	}
+};
+
+// The svf file being played: mapped and parsed in place, or streamed
+// -j: threads that parse an uncompressed svf file. 0 (the default) means
+// one per core, for files of at least PARALLEL_PARSE_MIN bytes
+#define PARALLEL_PARSE_MIN	(16 << 20)
+int parse_threads = 0;
+
+struct svf_source {
+	svfMappedFile map;
+	svf_input input;
+	bool stream = false;
+
+	bool open(const char* path){
+		if (!input.open(path))
+			return false;
+		stream = (input.kind != SVF_PLAIN);
+		if (!stream) {
+			input.close();
+			return map.open(path);
+		}
+		return true;
+	}
+	// Hands the file to parser; a stream can only be parsed once
+	void start(svfParser& parser){
+		parser.reset();
+		int threads = parse_threads;
+		if (threads == 0)
+			threads = map.len >= PARALLEL_PARSE_MIN ? (int)thread::hardware_concurrency() : 1;
+		if (stream)
+			parser.processStream([this](char* buf, size_t n) { return input.read(buf, n); });
+		else if (threads > 1)
+			parser.processBufferParallel(map.data, map.len, threads);
+		else
+			parser.processBuffer(map.data, map.len);
+	}
+	// How far parser got and how far it has to go, in bytes of the file
+	int64_t position(const svfParser& parser) const { return stream ? input.consumed : parser.cmdEnd; }
+	int64_t size() const { return stream ? input.size : map.len; }
+};
+
+// Parses and generates the whole svf file into vectors, recording which
+// command produced which clocks and where FREQUENCY changes, and if texts
+// isn't NULL, the source line of each index mark. Returns the number of
+// commands.
+int compile_svf(svf_source& svf, svfVectors& vectors, svfLineIndex& index,
+		vector<string>* texts = NULL){
+	svfParser parser;
+	svfPlayer player;
+	svfCommand cmd;
+	int num_cmds = 0;
+	svf.start(parser);
+	player.reset();
+	player.sink = &vectors;
+	peephole.reset();
+	while (true) {
+		double t = stat_begin();
+		bool more = parser.nextCommand(cmd);
+		stat_end(PHASE_PARSE, t);
+		if (!more) break;
+		num_cmds++;
+		if (optimize && !peephole.keep(cmd))
+			continue;
+		int64_t start = vectors.length();
+		t = stat_begin();
+		player.processCommand(cmd);
+		stat_end(PHASE_GENERATE, t);
+		if (vectors.length() > start) {
+			index.add(start, parser.lineNum, cmd.op);
+			if (texts)
+				texts->push_back(line_text(parser.currentLine()));
+		}
+		if (cmd.op == svfOp::FREQUENCY)
+			index.addFrequency(start, player.frequency);
+	}
+	stat_player(player);
+	return num_cmds;
+}
+
+// Hash and size of a file, for the compiled vector cache
+bool hash_file(const char* path, uint64_t& hash, uint64_t& size){
+	svfMappedFile f;
+	if (!f.open(path)) return false;
+	hash = svfHash(f.data, f.len);
+	size = f.len;
+	return true;
+}
+
+// Compiles svf_path into out_path
+void compile_to_file(const char* svf_path, const char* out_path){
+	svfVectors vectors;
+	svfLineIndex index;
+	uint64_t hash, size;
+	if (!hash_file(svf_path, hash, size))
+		throw runtime_error(string("error: could not read ") + svf_path);
+	svf_source svf;
+	if (!svf.open(svf_path))
+		throw runtime_error(string("error: could not open ") + svf_path);
+	int num_cmds = compile_svf(svf, vectors, index);
+	svfVecFile::write(out_path, vectors, index, hash, size, num_cmds);
+}
+
+/**
+ * Pipelined mode (-P): parsing, vector generation and the UART run
+ * concurrently, connected by lock-free SPSC rings:
+ *   parse thread --commands--> generate thread --chunks--> write thread
+ *   --in_flight--> read/verify (main thread)
+ * The writer keeps as much in flight as the link's flow_control allows;
+ * the reader hands the credit of each answered packet back through
+ * `answered`.
+ */
+#define PIPE_MAX_CLOCKS		4096	// clocks generated before cutting a packet
+
+struct pipe_command {
+	svfCommand cmd;
+	int line = 0;
+	string text;			// source line
+	int64_t offset = 0;		// svf_source::position() after it
+	bool done = false;
+	string error;
+};
+struct pipe_mark {
+	int offset;				// first clock of a command within the chunk
+	int line;
+	string text;
+	int64_t file_offset;	// pipe_command::offset
+	int op;					// svfOp
+	int64_t clock;			// first clock of the command in the whole run
+};
+struct pipe_chunk {
+	svfVectors vectors;				// the clocks the packet carries
+	uint8_t op = 0;
+	int payload_len = 0;
+	uint8_t payload[JP_MAX_PAYLOAD];
+	vector<batch_capture> captures;	// relative to the chunk
+	vector<pipe_mark> marks;
+	double sent = 0;				// when the packet was written, for --stats
+	bool done = false;
+	string error;
+	int wire_bytes() const { return JP_HDR_LEN + payload_len; }
+	bool response_fits(int len) const {
+		if (op == JP_OP_VERIFY) return verify_response_fits(len, captures);
+		return len == (op == JP_OP_FREQ ? 4 : captured_bytes(captures));
+	}
+};
+struct pipe_stats {
+	double busy = 0;		// seconds spent working, not waiting on a ring
+	long items = 0;
+	long stalls = 0;		// times the stage found its input empty or output full
+};
+struct pipe_state {
+	svfRing<pipe_command> commands{64};
+	svfRing<pipe_chunk> chunks{64};
+	svfRing<pipe_chunk> in_flight{32};
+	atomic<bool> abort{false};
+	atomic<long> answered{0};		// responses received
+	uart_transport* io = NULL;
+	svf_source* svf = NULL;
+	bool batch = false;				// see prog_link
+	bool device_verify = false;		// prog_link::verify
+	bool pack = false;				// prog_link::pack
+	bool freq = false;
+	batch_tap tap;					// programmer's TAP state, owned by the generator
+	flow_control flow;				// owned by the writer
+	pipe_stats parse, generate, write, read, verify;
+	trace_recorder* trace = NULL;
+	atomic<int> num_cmds{0};
+	int64_t num_tclk = 0;
+};
+
+// Pushes item, backing off while the ring is full; false if aborted
+template<class T> bool pipe_push(pipe_state* st, svfRing<T>& ring, T& item, pipe_stats& stats){
+	svfBackoff backoff;
+	if (ring.push(item)) return true;
+	stats.stalls++;
+	while (!st->abort) {
+		if (ring.push(item)) return true;
+		backoff.wait();
+	}
+	return false;
+}
+template<class T> bool pipe_pop(pipe_state* st, svfRing<T>& ring, T& item, pipe_stats& stats){
+	svfBackoff backoff;
+	if (ring.pop(item)) return true;
+	stats.stalls++;
+	while (!st->abort) {
+		if (ring.pop(item)) return true;
+		backoff.wait();
+	}
+	return false;
+}
+
+void pipe_parse_stage(pipe_state* st, svf_source* svf){
+	stat_flusher flush;
+	svfParser parser;
+	svf->start(parser);
+	peephole.reset();
+	while (true) {
+		pipe_command item;
+		double t = mono_now();
+		try {
+			item.done = !parser.nextCommand(item.cmd);
+		} catch (const exception& e) {
+			item.done = true;
+			item.error = e.what();
+		}
+		stat_end(PHASE_PARSE, t);
+		// dropped commands still count as done
+		bool dropped = !item.done && optimize && !peephole.keep(item.cmd);
+		if (!dropped) {
+			item.line = parser.lineNum;
+			item.text = line_text(parser.currentLine());
+			item.offset = svf->position(parser);
+		}
+		st->parse.busy += mono_now() - t;
+		st->parse.items++;
+		if (dropped) {
+			st->num_cmds++;
+			continue;
+		}
+		bool done = item.done;
+		if (!pipe_push(st, st->commands, item, st->parse) || done)
+			return;
+	}
+}
+
+// Encodes the next packet's worth of vectors, at most limit clocks, into a
+// chunk, and moves the marks along. A chunk that no clocks fit in comes
+// back done, with the error
+void pipe_cut_chunk(pipe_chunk& chunk, svfVectors& vectors, vector<pipe_mark>& marks, bool batch, bool verify,
+		bool pack, batch_tap& tap, int max_payload, int64_t limit){
+	svfVectorsView v = vectors.view();
+	int64_t pos = 0;
+	chunk.payload_len = encode_packet(v, pos, min<int64_t>(v.length(), min<int64_t>(limit, PIPE_MAX_CLOCKS)), batch, verify,
+		pack, tap, chunk.op, chunk.payload, max_payload, chunk.captures);
+	int n = (int)pos;
+	if (n == 0) {
+		chunk.done = true;
+		chunk.error = "ERROR: no clocks fit in a " + to_string(max_payload) + " byte packet";
+		return;
+	}
+	chunk.vectors.clear();
+	chunk.vectors.append(v, 0, n);
+	vectors.dropFront(n);
+	// marks[0] always covers clock 0; the last mark starting inside the
+	// chunk also covers the start of the next one
+	size_t inside = 0, keep = 0;
+	while (inside < marks.size() && marks[inside].offset < n) inside++;
+	chunk.marks.assign(marks.begin(), marks.begin() + inside);
+	while (keep + 1 < marks.size() && marks[keep + 1].offset <= n) keep++;
+	marks.erase(marks.begin(), marks.begin() + keep);
+	for (size_t i = 0; i < marks.size(); i++)
+		marks[i].offset = max(marks[i].offset - n, 0);
+}
+
+void pipe_generate_stage(pipe_state* st){
+	stat_flusher flush;
+	svfPlayer player;
+	vector<pipe_mark> marks;
+	int64_t cut = 0;			// clocks cut into chunks so far
+	double freq = 0;			// as far as the chunks pushed so far go
+	bool warned = false;
+	player.reset();
+	while (true) {
+		pipe_command item;
+		if (!pipe_pop(st, st->commands, item, st->generate))
+			return;
+		double t = mono_now();
+		pipe_chunk chunk;
+		if (!item.done) {
+			int64_t start = player.out.length();
+			try {
+				player.processCommand(item.cmd);
+			} catch (const exception& e) {
+				item.done = true;
+				item.error = e.what();
+			}
+			stat_end(PHASE_GENERATE, t);
+			stat_command(item.cmd.op, player.out.length() - start);
+			if (player.out.length() > start)
+				marks.push_back({(int)start, item.line, item.text, item.offset, (int)item.cmd.op, cut + start});
+			st->num_cmds++;
+		}
+		st->generate.items++;
+		// A new FREQUENCY goes out as its own packet once the clocks before
+		// it have been cut
+		bool new_freq = !item.done && item.cmd.op == svfOp::FREQUENCY && player.frequency != freq;
+		if (new_freq && !st->freq) {
+			if (player.frequency > 0 && !warned) {
+				fprintf(stderr, "warning: the programmer's sketch can't pace TCK; FREQUENCY %.0f HZ ignored\n", player.frequency);
+				warned = true;
+			}
+			freq = player.frequency;
+			new_freq = false;
+		}
+		while (player.out.length() >= PIPE_MAX_CLOCKS ||
+				((item.done || new_freq) && player.out.length() > 0)) {
+			pipe_cut_chunk(chunk, player.out, marks, st->batch, st->device_verify, st->pack, st->tap,
+				st->flow.payload, packet_clock_limit(st->freq, freq));
+			cut += chunk.vectors.length();
+			st->generate.busy += mono_now() - t;
+			if (!pipe_push(st, st->chunks, chunk, st->generate) || chunk.done)
+				return;
+			t = mono_now();
+		}
+		if (new_freq) {
+			freq = player.frequency;
+			chunk = pipe_chunk();
+			chunk.op = JP_OP_FREQ;
+			chunk.payload_len = 4;
+			jp_put_u32(chunk.payload, freq_arg(freq));
+			if (!pipe_push(st, st->chunks, chunk, st->generate))
+				return;
+		}
+		st->generate.busy += mono_now() - t;
+		if (item.done) {
+			stat_player(player);
+			chunk = pipe_chunk();
+			chunk.done = true;
+			chunk.error = item.error;
+			pipe_push(st, st->chunks, chunk, st->generate);
+			return;
+		}
+	}
+}
+
+void pipe_write_stage(pipe_state* st){
+	stat_flusher flush;
+	svfBackoff backoff;
+	long answered = 0;
+	while (true) {
+		pipe_chunk chunk;
+		if (!pipe_pop(st, st->chunks, chunk, st->write))
+			return;
+		if (!chunk.done) {
+			long size = chunk.wire_bytes();
+			backoff.reset();
+			for (bool stalled = false; ; stalled = true) {
+				for (long n = st->answered; answered < n; answered++)
+					st->flow.answered();
+				if (st->flow.can_send(size)) break;
+				if (!stalled) stats.flow_stalls++;
+				if (st->abort) return;
+				backoff.wait();
 			}
+			double t = mono_now();
+			chunk.sent = stat_begin();
+			st->flow.sent(size);
+			if (!uart_send_packet(*st->io, chunk.op, chunk.payload, chunk.payload_len)) {
+				chunk.done = true;
+				chunk.error = "ERROR: lost communication with the programmer";
+			}
+			st->write.busy += mono_now() - t;
+			st->write.items++;
 		}
-		player.outBuffer.clear();
-		free(line);
+		bool done = chunk.done;
+		if (!pipe_push(st, st->in_flight, chunk, st->write) || done)
+			return;
 	}
+}
+
+// Reports a TDO mismatch in the command of mark, which ends at clock to of
+// the run. vectors and received hold the clocks from clock first on, so
+// they cover the whole command even if it spans several chunks
+void pipe_report_error(const pipe_mark& mark, const svfVectors& vectors, const svfBitVector& received,
+		int64_t first, int64_t to){
+	string sent_tms, sent_tdi, expected_tdo, received_tdo;
+	describe_clocks(vectors.view(), received, mark.clock - first, to - first,
+		sent_tms, sent_tdi, expected_tdo, received_tdo);
+	report_tdo_error(mark.line, mark.text, sent_tms, sent_tdi, expected_tdo, received_tdo);
+}
+
+// Receives the response to chunk and appends its TDO to received. After a
+// mismatch with -w, the programmer skips the packets behind it, which then
+// read as their expected TDO like in receive_oldest()
+bool pipe_receive(pipe_state* st, const pipe_chunk& chunk, bool mismatched, svfBitVector& received){
+	uint8_t resp[JP_MAX_PAYLOAD], op;
+	double t = mono_now();
+	int len = uart_recv_packet(*st->io, &op, resp, sizeof(resp));
+	st->answered++;
+	st->read.busy += mono_now() - t;
+	st->read.items++;
+	int64_t clocks = chunk.vectors.length();
+	if (mismatched && op == JP_OP_ERROR && len == 1 && resp[0] == JP_ERR_VERIFY) {
+		append_expected(chunk.vectors.view(), 0, clocks, received);
+		return true;
+	}
+	if (len < 0 || op != chunk.op || !chunk.response_fits(len)) {
+		fprintf(stderr, "ERROR: lost communication with the programmer\n");
+		return false;
+	}
+	stat_round_trip(chunk.sent);
+	if (op == JP_OP_VERIFY)
+		decode_verify(resp, len, chunk.captures, chunk.vectors.view(), 0, clocks, received);
+	else
+		decode_response(resp, len, chunk.captures, 0, clocks, received);
+	return true;
+}
+
+// Receives and verifies responses in the calling thread
+bool pipe_read_stage(pipe_state* st){
+	svfBitVector received;
+	vector<svfLineMark> trace_marks;
+	// the clocks since the start of the command the last chunk ended in,
+	// for error reports
+	svfVectors open_vectors;
+	svfBitVector open_received;
+	int64_t open_from = 0, open_to = 0;
+	// Receives chunk and keeps its clocks with those of the open command
+	auto take = [&](const pipe_chunk& chunk, bool mismatched) {
+		received.clear();
+		if (!pipe_receive(st, chunk, mismatched, received))
+			return false;
+		int64_t clocks = chunk.vectors.length();
+		if (st->trace) {
+			trace_marks.clear();
+			for (const pipe_mark& m : chunk.marks)
+				trace_marks.push_back({m.offset, m.line, m.op});
+			st->trace->record(chunk.vectors.view(), received, 0, clocks, trace_marks.data(), trace_marks.size());
+		}
+		open_vectors.append(chunk.vectors.view(), 0, clocks);
+		open_received.appendView(received.view(), 0, clocks);
+		open_to += clocks;
+		return true;
+	};
+	while (true) {
+		pipe_chunk chunk;
+		if (!pipe_pop(st, st->in_flight, chunk, st->read))
+			return false;
+		if (chunk.done) {
+			if (!chunk.error.empty()) {
+				fprintf(stderr, "%s\n", chunk.error.c_str());
+				return false;
+			}
+			return true;
+		}
+		if (!take(chunk, false))
+			return false;
+		double t = mono_now();
+		int64_t clocks = chunk.vectors.length();
+		int64_t bad = chunk.vectors.view().firstMismatch(received.view(), 0, clocks);
+		if (bad >= 0) {
+			size_t m = 0;
+			while (m + 1 < chunk.marks.size() && chunk.marks[m + 1].offset <= bad) m++;
+			pipe_mark mark = chunk.marks[m];
+			int64_t to = -1;
+			if (m + 1 < chunk.marks.size())
+				to = chunk.marks[m + 1].clock;
+			// The rest of the command is in the chunks behind this one
+			while (to < 0) {
+				pipe_chunk next;
+				if (!pipe_pop(st, st->in_flight, next, st->read) || next.done || !take(next, true))
+					break;
+				for (const pipe_mark& n : next.marks)
+					if (n.clock > mark.clock) {
+						to = n.clock;
+						break;
+					}
+			}
+			pipe_report_error(mark, open_vectors, open_received, open_from, to < 0 ? open_to : to);
+			return false;
+		}
+		if (!chunk.marks.empty()) {
+			open_vectors.dropFront(chunk.marks.back().clock - open_from);
+			open_received.dropFront(chunk.marks.back().clock - open_from);
+			open_from = chunk.marks.back().clock;
+		}
+		st->num_tclk += clocks;
+		st->verify.busy += mono_now() - t;
+		st->verify.items++;
+		if (progress.on && !chunk.marks.empty()) {
+			progress.update(chunk.marks.back().file_offset, st->svf->size(), st->num_tclk);
+		}
+	}
+}
+
+void pipe_print_stats(const pipe_state& st, double elapsed){
+	const char* names[] = {"parse", "generate", "write", "read", "verify"};
+	const pipe_stats* stats[] = {&st.parse, &st.generate, &st.write, &st.read, &st.verify};
+	printf("pipeline stage utilization over %.3f s:\n", elapsed);
+	for (int i = 0; i < 5; i++)
+		printf("\t%-8s %5.1f%% busy, %ld items, %ld stalls\n", names[i],
+			elapsed > 0 ? 100 * stats[i]->busy / elapsed : 0.0, stats[i]->items, stats[i]->stalls);
+}
+
+// Runs the whole svf file through the pipeline; returns false on any error
+bool run_pipelined(prog_link& link, svf_source& svf, trace_recorder& trace, int& num_cmds, int64_t& num_tclk){
+	pipe_state st;
+	st.trace = &trace;
+	st.io = link.io.get();
+	st.svf = &svf;
+	st.batch = link.batch;
+	st.device_verify = link.verify;
+	st.pack = link.pack;
+	st.freq = link.freq;
+	st.tap = link.tap;
+	st.flow = link.flow;
+	double start = mono_now();
+	thread parse_thread(pipe_parse_stage, &st, &svf);
+	thread generate_thread(pipe_generate_stage, &st);
+	thread write_thread(pipe_write_stage, &st);
+	bool ok = pipe_read_stage(&st);
+	st.abort = true;
+	write_thread.join();
+	generate_thread.join();
+	parse_thread.join();
+	num_cmds = st.num_cmds;
+	num_tclk = st.num_tclk;
+	if (ok)
+		pipe_print_stats(st, mono_now() - start);
+	return ok;
+}
+
+// Opens the programmer on path, resets it with $RST, finds out what its
+// sketch supports, moves the link to baud and sizes the flow control window
+// for it. With write_only, TDO is compared on the programmer if it can.
+// idcode gets the $RST response.
+bool open_programmer(const char* path, bool ascii, bool write_only, long baud, prog_link& link, string& idcode){
+	char resp[256];
+	if (!(link.io = uart_open(path))) {
+		perror("open");
+		fprintf(stderr, "ERROR: could not open %s\n", path);
+		return false;
+	}
+	if (!uart_send_command(*link.io, "$RST\n", 5, resp, sizeof(resp) - 1)) {
+		fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+		return false;
+	}
+	idcode = resp;
+	if (!ascii) {
+		if (!probe_batch(link)) {
+			fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+			return false;
+		}
+		if (!link.batch)
+			fprintf(stderr, "note: the programmer's sketch on %s predates batch packets; update it for faster transfers\n", path);
+		if (pack_shifts && link.batch && !probe_pack(link)) {
+			fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+			return false;
+		}
+		if (write_only && link.batch && !probe_verify(link)) {
+			fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+			return false;
+		}
+		if (write_only && !link.verify)
+			fprintf(stderr, "note: the programmer's sketch on %s can't compare TDO itself; reading TDO back instead\n", path);
+		if (!probe_frequency(link)) {
+			fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+			return false;
+		}
+	}
+	if (baud != UART_DEFAULT_BAUD && !set_baud(link, baud)) {
+		fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+		return false;
+	}
+	if (!ascii && !probe_flow(link)) {
+		fprintf(stderr, "ERROR: lost communication with the programmer on %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+// Gang programming: one compiled vector stream played to several programmers
+// at once, each from its own thread. The vectors and the index are shared
+// read-only; every unit has its own link, received bits and report.
+struct gang_unit {
+	const char* path = NULL;
+	prog_link link;
+	string idcode;				// the programmer's answer to $RST
+	bool ok = false;
+	double seconds = 0;
+	ostringstream report;		// why it failed
+	atomic<int64_t> clocks_done{0};
+	atomic<bool> finished{false};
+	trace_recorder trace;		// -t, to <trace-file>.<n>
+};
+
+void gang_play(gang_unit* unit, bool ascii, const svfVectorsView* vectors,
+		const svfLineMark* marks, int64_t count, const string* texts,
+		const svfFreqMark* freqs, int64_t freq_count){
+	stat_flusher flush;
+	svfBitVector received;
+	double start = mono_now();
+	int64_t length = vectors->length();
+	for (int64_t base = 0; base < length; base += VERIFY_BLOCK_CLOCKS) {
+		int64_t end = min(base + VERIFY_BLOCK_CLOCKS, length);
+		if (!play_vectors(unit->link, ascii, *vectors, base, end, received, freqs, freq_count)) {
+			int64_t m = svfLineIndex::lookup(marks, count, base);
+			unit->report<<"Lost communication with the programmer near line "<<(m >= 0 ? marks[m].line : 0)<<endl;
+			goto out;
+		}
+		unit->trace.record(*vectors, received, base, end, marks, count);
+		int64_t bad = vectors->firstMismatch(received.view(), base, end);
+		if (bad >= 0) {
+			report_mismatch(*vectors, received, bad, marks, count, texts, unit->report);
+			goto out;
+		}
+		unit->clocks_done = end;
+	}
+	unit->ok = true;
+out:
+	unit->seconds = mono_now() - start;
+	unit->finished = true;
+}
+
+// Plays vectors to every unit concurrently and prints a pass/fail summary.
+// Returns true if all of them passed.
+bool run_gang(vector<gang_unit>& units, bool ascii, const svfVectorsView& vectors,
+		const svfLineMark* marks, int64_t count, const string* texts,
+		const svfFreqMark* freqs, int64_t freq_count){
+	vector<thread> threads;
+	for (gang_unit& u : units)
+		threads.emplace_back(gang_play, &u, ascii, &vectors, marks, count, texts, freqs, freq_count);
+	// Progress follows the slowest programmer
+	while (progress.on) {
+		int64_t done = vectors.length();
+		int running = 0;
+		for (gang_unit& u : units) {
+			done = min<int64_t>(done, u.clocks_done);
+			if (!u.finished)
+				running++;
+		}
+		if (running == 0)
+			break;
+		progress.update(done, vectors.length(), done);
+		usleep(100000);
+	}
+	for (thread& t : threads)
+		t.join();
+	progress.end();
+
+	int passed = 0;
+	printf("%-4s  %-24s %8s  %s\n", "#", "programmer", "seconds", "result");
+	for (size_t i = 0; i < units.size(); i++) {
+		printf("%-4zu  %-24s %8.3f  %s\n", i + 1, units[i].path, units[i].seconds, units[i].ok ? "PASS" : "FAIL");
+		if (units[i].ok)
+			passed++;
+	}
+	for (size_t i = 0; i < units.size(); i++) {
+		if (units[i].ok)
+			continue;
+		cout<<endl<<"#"<<i + 1<<" "<<units[i].path<<":"<<endl<<units[i].report.str();
+	}
+	printf("%d of %zu programmers passed\n", passed, units.size());
+	return passed == (int)units.size();
+}
+
+int main(int argc, char** argv) {
+	//Variables for handling the SVF file and parser 
+	svf_source svf;
+	svfParser parser;
+	svfPlayer player;
+	svfVecFile compiled;
+	int num_cmds = 0; // # of commands completed
+	int64_t num_tclk = 0; // # of JTAG clock-cycles completed
+	svfLineIndex index; // maps clocks of the current block back to svf lines
+	vector<string> index_text; // source line of each index mark
+	svfBitVector received;
+	bool ascii_proto = false;
+	bool no_prompt = false;
+	bool pipelined = false;
+	bool write_only = false;
+	const char* compile_out = NULL;
+	const char* cache_dir = NULL;
+	const char* trace_path = NULL;
+	trace_recorder trace;
+	const char* svf_path;
+	string cache_path;
+	int opt;
+	timespec t_start, t_end;
+	double elapsed;
+	const char* stats_format = NULL;
+	bool started = false, ok = false;
+	static const option long_opts[] = {
+		{"stats", required_argument, NULL, 's'},
+		{"progress", no_argument, NULL, 'p'},
+		{"transport", required_argument, NULL, 'T'},
+		{"epoll", no_argument, NULL, 'e'},
+		{"low-latency", no_argument, NULL, 'l'},
+		{"vmin", required_argument, NULL, 'm'},
+		{"vtime", required_argument, NULL, 'v'},
+		{NULL, 0, NULL, 0}
+	};
+
+	// Variables for handling the UART JTAG Programmer(s)
+	prog_link link;
+	vector<gang_unit> units;	// gang mode, when given more than one device
+	svfVectors gang_vectors;
+	svfLineIndex gang_index;
+	vector<string> gang_text;
+	string idcode;
+	char resp[256];
+	long baud = UART_DEFAULT_BAUD;
+
+	// Command-line syntax check
+	while ((opt = getopt_long(argc, argv, "aPywuOb:c:C:t:j:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = atol(optarg);
+			if (baud <= 0)
+				goto print_usage;
+			break;
+		case 'a':
+			ascii_proto = true;
+			break;
+		case 'P':
+			pipelined = true;
+			break;
+		case 'y':
+			no_prompt = true;
+			break;
+		case 'w':
+			write_only = true;
+			break;
+		case 'u':
+			pack_shifts = false;
+			break;
+		case 'O':
+			optimize = true;
+			break;
+		case 'c':
+			compile_out = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 't':
+			trace_path = optarg;
+			break;
+		case 'j':
+			parse_threads = atoi(optarg);
+			if (parse_threads <= 0)
+				goto print_usage;
+			break;
+		case 's':
+			if (strcmp(optarg, "text") && strcmp(optarg, "json"))
+				goto print_usage;
+			stats_format = optarg;
+			stats_on = true;
+			break;
+		case 'p':
+			progress.on = true;
+			break;
+		case 'T':
+			if (strcmp(optarg, "tty") && strcmp(optarg, "pty") && strcmp(optarg, "unix"))
+				goto print_usage;
+			uart_opts.kind = optarg;
+			break;
+		case 'e':
+			uart_opts.epoll = true;
+			break;
+		case 'l':
+			uart_opts.low_latency = true;
+			break;
+		case 'm':
+		case 'v': {
+			int v = atoi(optarg);
+			if (v < 0 || v > 255)
+				goto print_usage;
+			(opt == 'm' ? uart_opts.vmin : uart_opts.vtime) = v;
+			break;
+		}
+		default:
+			goto print_usage;
+		}
+	}
+	if(argc - optind < (compile_out ? 1 : 2)) {
+	print_usage:
+		fprintf(stderr,"usage: %s [-a|-P] [-y] [-w] [-u] [-O] [-b <baud>] [-C <cache-dir>] [-t <trace-file>] [-j <threads>]\n",argv[0]);
+		fprintf(stderr,"       %*s [--stats=text|json] [--progress] [--transport=tty|pty|unix] [--epoll]\n",(int)strlen(argv[0]),"");
+		fprintf(stderr,"       %*s [--low-latency] [--vmin=<bytes>] [--vtime=<ds>]\n",(int)strlen(argv[0]),"");
+		fprintf(stderr,"       %*s <input-svf-file> <uart-device-path>...\n",(int)strlen(argv[0]),"");
+		fprintf(stderr,"       %s [-O] [-j <threads>] -c <output-file> <input-svf-file>\n",argv[0]);
+		fprintf(stderr,"\t-a\tuse the legacy one-clock-per-line ASCII protocol\n");
+		fprintf(stderr,"\t-P\tpipelined mode: parse, generate and transfer in separate threads\n");
+		fprintf(stderr,"\t-y\tdon't ask for confirmation before programming\n");
+		fprintf(stderr,"\t-w\twrite-only streaming: the programmer compares TDO itself and\n");
+		fprintf(stderr,"\t\tonly reports mismatches, and stops at the first one\n");
+		fprintf(stderr,"\t-u\tsend shift vectors as they are, without packing them\n");
+		fprintf(stderr,"\t-O\tleave out STATE commands that can't make a difference to the\n");
+		fprintf(stderr,"\t\tdevice, and report the clocks saved\n");
+		fprintf(stderr,"\t-b\tswitch the link to this baud rate after the reset (default %d);\n", UART_DEFAULT_BAUD);
+		fprintf(stderr,"\t\tthe sketch has to support it\n");
+		fprintf(stderr,"\t-c\tcompile the svf file into a binary vector file and exit;\n");
+		fprintf(stderr,"\t\ta vector file can be passed instead of an svf file to play it\n");
+		fprintf(stderr,"\t-C\tcompile svf files into this directory, and reuse them while\n");
+		fprintf(stderr,"\t\tthe svf file's contents don't change\n");
+		fprintf(stderr,"\t-t\trecord every clock and the TDO read back to a trace file;\n");
+		fprintf(stderr,"\t\tsvftrace converts it to VCD. With several devices, each gets\n");
+		fprintf(stderr,"\t\t<trace-file>.1, .2, ...\n");
+		fprintf(stderr,"\t-j\tparse with this many threads (default: one per core for svf\n");
+		fprintf(stderr,"\t\tfiles of %d MB and up, else one)\n", PARALLEL_PARSE_MIN >> 20);
+		fprintf(stderr,"\t--stats\tprint time per phase, packet round trips and clocks per\n");
+		fprintf(stderr,"\t\tcommand type and UART syscalls to stderr at exit\n");
+		fprintf(stderr,"\t--progress\n\t\tshow progress and ETA (the default when stderr is a terminal)\n");
+		fprintf(stderr,"\t--transport\n\t\thow to reach the programmer: a serial port, a pseudo-terminal\n");
+		fprintf(stderr,"\t\tor a Unix socket (default: detected from the path)\n");
+		fprintf(stderr,"\t--epoll\twait for the link with epoll instead of blocking reads\n");
+		fprintf(stderr,"\t--low-latency\n\t\tset ASYNC_LOW_LATENCY on the serial port\n");
+		fprintf(stderr,"\t--vmin, --vtime\n\t\tthe termios VMIN and VTIME of the link (default 0 and %d)\n", UART_TIMEOUT_DS);
+		fprintf(stderr,"The svf file may be gzip or xz compressed; it is then decompressed as it is played.\n");
+		fprintf(stderr,"With more than one device, the svf file is compiled once and played to all of\n");
+		fprintf(stderr,"their programmers at the same time, each verified on its own.\n");
+		return EXIT_FAILURE;
+	}
+	svf_path = argv[optind];
+	if (isatty(2))
+		progress.on = true;
+	if (pipelined && ascii_proto) {
+		fprintf(stderr, "ERROR: -P needs the binary protocol\n");
+		return EXIT_FAILURE;
+	}
+	if (write_only && ascii_proto) {
+		fprintf(stderr, "ERROR: -w needs the binary protocol\n");
+		return EXIT_FAILURE;
+	}
+	if (argc - optind > 2 && !compile_out) {
+		if (pipelined) {
+			fprintf(stderr, "ERROR: -P drives a single programmer\n");
+			return EXIT_FAILURE;
+		}
+		units = vector<gang_unit>(argc - optind - 1);
+	}
+
+	// Ahead of time compilation, either on request or through the cache
+	try {
+		if (compile_out) {
+			compile_to_file(svf_path, compile_out);
+			compiled.open(compile_out);
+			printf("%s: %lu commands, %lu tclk cycles\n", compile_out,
+				(unsigned long)compiled.hdr.commands, (unsigned long)compiled.hdr.clocks);
+			if (optimize)
+				print_peephole();
+			return EXIT_SUCCESS;
+		}
+		if (svfVecFile::isVecFile(svf_path)) {
+			compiled.open(svf_path);
+		} else if (cache_dir) {
+			uint64_t hash, size;
+			char name[32];
+			if (!hash_file(svf_path, hash, size)) {
+				printf("Could not open the svf file: %s\n", svf_path);
+				goto abort;
+			}
+			// -O makes different vectors from the same file
+			snprintf(name, sizeof(name), optimize ? "/%016llx-O.svfv" : "/%016llx.svfv", (unsigned long long)hash);
+			cache_path = string(cache_dir) + name;
+			if (svfVecFile::isVecFile(cache_path.c_str()))
+				compiled.open(cache_path.c_str());
+			if (compiled.map == NULL || compiled.hdr.sourceHash != hash || compiled.hdr.sourceSize != size) {
+				compile_to_file(svf_path, cache_path.c_str());
+				compiled.open(cache_path.c_str());
+			}
+		}
+	} catch (const exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		goto abort;
+	}
+
+	// Open the SVF file and the UART device
+	if (compiled.map == NULL) {
+		if (!svf.open(svf_path)){
+			printf("Could not open the svf file: %s\n", svf_path);
+			goto abort;
+		}
+	}
+	
+	// Talking to the JTAG Programmer I made with Arduino
+	//// 1) Reset the JTAG Programmer by sending a $RST command
+	if (units.empty()) {
+		if (!open_programmer(argv[optind+1], ascii_proto, write_only, baud, link, idcode))
+			goto abort;
+		cout<<"Devices connected to the JTAG interface are:"<<endl<<idcode<<endl;
+	} else {
+		cout<<"Devices connected to the JTAG interfaces are:"<<endl;
+		for (size_t i = 0; i < units.size(); i++) {
+			units[i].path = argv[optind+1+i];
+			if (!open_programmer(units[i].path, ascii_proto, write_only, baud, units[i].link, units[i].idcode))
+				goto abort;
+			cout<<units[i].path<<": "<<units[i].idcode;
+		}
+		cout<<endl;
+	}
+	if (trace_path) {
+		bool opened = true;
+		if (units.empty())
+			opened = trace.open(trace_path);
+		for (size_t i = 0; i < units.size() && opened; i++)
+			opened = units[i].trace.open(string(trace_path) + "." + to_string(i + 1));
+		if (!opened)
+			goto abort;
+	}
+	if (!no_prompt) {
+		cout<<"Continue? (y/n): ";
+		cin>>resp;
+		if (strncmp(resp, "y",1))
+			return EXIT_SUCCESS;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	started = true;
+	progress.begin();
+	if (!units.empty()) {
+		//// 2) Compile once, then play the same vectors to every programmer
+		svfVectorsView vectors = compiled.vectors;
+		const svfLineMark* marks = compiled.index;
+		int64_t count = compiled.hdr.indexCount;
+		const svfFreqMark* freqs = compiled.freqs;
+		int64_t freq_count = compiled.hdr.freqCount;
+		if (compiled.map == NULL) {
+			try {
+				num_cmds = compile_svf(svf, gang_vectors, gang_index, &gang_text);
+			} catch (const exception& e) {
+				fprintf(stderr, "%s\n", e.what());
+				goto abort;
+			}
+			vectors = gang_vectors.view();
+			marks = gang_index.marks.data();
+			count = gang_index.marks.size();
+			freqs = gang_index.freqs.data();
+			freq_count = gang_index.freqs.size();
+		} else {
+			num_cmds = compiled.hdr.commands;
+		}
+		for (int64_t i = 0; stats_on && i < count; i++) {
+			int64_t end = i + 1 < count ? marks[i+1].clock : vectors.length();
+			stat_command((svfOp)marks[i].op, end - marks[i].clock);
+		}
+		if (!run_gang(units, ascii_proto, vectors, marks, count, gang_text.empty() ? NULL : gang_text.data(),
+				freqs, freq_count))
+			goto abort;
+		num_tclk = vectors.length();
+	} else if (compiled.map != NULL) {
+		//// 2) Stream the precompiled vectors; nothing left to parse
+		// Commands are gone, but the index still says which made which clocks
+		for (int64_t i = 0; stats_on && i < (int64_t)compiled.hdr.indexCount; i++) {
+			const svfLineMark& m = compiled.index[i];
+			int64_t end = i + 1 < (int64_t)compiled.hdr.indexCount ? compiled.index[i+1].clock : compiled.vectors.length();
+			stat_command((svfOp)m.op, end - m.clock);
+		}
+		for (int64_t base = 0; base < compiled.vectors.length(); base += VERIFY_BLOCK_CLOCKS) {
+			int64_t end = min(base + VERIFY_BLOCK_CLOCKS, compiled.vectors.length());
+			if (!play_vectors(link, ascii_proto, compiled.vectors, base, end, received,
+					compiled.freqs, compiled.hdr.freqCount)) {
+				fprintf(stderr, "ERROR: lost communication with the programmer\n");
+				goto abort;
+			}
+			trace.record(compiled.vectors, received, base, end, compiled.index, compiled.hdr.indexCount);
+			int64_t bad = compiled.vectors.firstMismatch(received.view(), base, end);
+			if (bad >= 0) {
+				progress.end();
+				report_mismatch(compiled.vectors, received, bad, compiled.index, compiled.hdr.indexCount, NULL);
+				goto abort;
+			}
+			num_tclk = end;
+			progress.update(end, compiled.vectors.length(), num_tclk);
+		}
+		num_cmds = compiled.hdr.commands;
+		num_tclk = compiled.hdr.clocks;
+	} else if (pipelined) {
+		//// 2) Send the commands from SVF, with all stages overlapped
+		if (!run_pipelined(link, svf, trace, num_cmds, num_tclk))
+			goto abort;
+	} else {
+		//// 2) Send the commands from SVF, a block of clocks at a time. The
+		// player hands its clocks to the sink as it makes them, and every
+		// full block is played right away
+		num_cmds=0;
+		num_tclk=0;
+		block_sink sink;
+		sink.play = [&]() {
+			svfVectors& block = sink.block;
+			num_tclk += block.length();
+			received.clear();
+			if (!play_vectors(link, ascii_proto, block.view(), 0, block.length(), received,
+					index.freqs.data(), index.freqs.size())) {
+				fprintf(stderr, "ERROR: lost communication with the programmer near line %d\n",
+					index.marks.empty() ? parser.lineNum : index.marks.back().line);
+				throw play_failed();
+			}
+			trace.record(block.view(), received, 0, block.length(), index.marks.data(), index.marks.size());
+			int64_t bad = block.view().firstMismatch(received.view(), 0, received.len);
+			if (bad >= 0) {
+				progress.end();
+				report_mismatch(block.view(), received, bad, index.marks.data(), index.marks.size(), index_text.data());
+				throw play_failed();
+			}
+			block.clear();
+			// the command being generated goes on into the next block
+			svfLineMark current = index.marks.back();
+			string current_text = std::move(index_text.back());
+			index.clear();
+			index_text.clear();
+			index.add(0, current.line, (svfOp)current.op);
+			index_text.push_back(std::move(current_text));
+			progress.update(svf.position(parser), svf.size(), num_tclk);
+		};
+		svf.start(parser);
+		player.reset();
+		player.sink = &sink;
+		peephole.reset();
+		try {
+			svfCommand cmd;
+			while (true) {
+				double t = stat_begin();
+				bool more = parser.nextCommand(cmd);
+				stat_end(PHASE_PARSE, t);
+				if (!more)
+					break;
+				num_cmds++;
+			#ifdef DEBUG_ON
+				cout<<"Processing Line "<< parser.lineNum <<": "<<parser.currentLine();
+			#endif
+				if (optimize && !peephole.keep(cmd))
+					continue;
+				// the mark goes first, as the command may fill a block
+				int64_t start = sink.clocks;
+				double played = sink.play_seconds;
+				index.add(sink.block.length(), parser.lineNum, cmd.op);
+				index_text.push_back(line_text(parser.currentLine()));
+				t = stat_begin();
+				player.processCommand(cmd);
+				stat_end(PHASE_GENERATE, t + sink.play_seconds - played);
+				stat_command(cmd.op, sink.clocks - start);
+				if (index.marks.back().clock == sink.block.length()) {
+					// no clocks in this block
+					index.marks.pop_back();
+					index_text.pop_back();
+				}
+				if (cmd.op == svfOp::FREQUENCY)
+					index.addFrequency(sink.block.length(), player.frequency);
+			}
+			if (sink.block.length() > 0) {
+				sink.play();
+				index.clear();
+				index_text.clear();
+			}
+		} catch (const play_failed&) {
+			goto abort;
+		} catch (const exception& e) {
+			fprintf(stderr, "%s\n", e.what());
+			goto abort;
+		}
+	}
+	progress.end();
 	cout<<num_cmds<<" commands executed successfully; "<<endl;
 	cout<<num_tclk<<" tclk cycles total"<<endl;
-	return EXIT_SUCCESS;
+	// a cached vector file was optimized when it was compiled
+	if (optimize && peephole.commands > 0)
+		print_peephole();
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	elapsed = (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) * 1e-9;
+	printf("%.3f s elapsed; %.0f tclk/s; %ld bytes sent, %ld bytes received (%.2f bytes/tclk)\n",
+		elapsed, elapsed > 0 ? num_tclk / elapsed : 0.0, uart_tx_bytes.load(), uart_rx_bytes.load(),
+		num_tclk > 0 ? (double)(uart_tx_bytes + uart_rx_bytes) / num_tclk : 0.0);
+	if (pack_raw_bytes > 0)
+		printf("shift vectors: %ld bytes packed into %ld (%.2fx)\n", pack_raw_bytes.load(), pack_sent_bytes.load(),
+			pack_sent_bytes > 0 ? (double)pack_raw_bytes / pack_sent_bytes : 0.0);
+	ok = true;
 abort:
-	if (fp)
-		fclose(fp);
-	if (ttydevice)
-		close(ttydevice);
-	return EXIT_FAILURE;
-} 
+	progress.end();
+	stat_player(player);
+	stat_flush();
+	if (started && stats_format) {
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		elapsed = (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) * 1e-9;
+		if (!strcmp(stats_format, "json"))
+			stats_print_json(stderr, elapsed, ok, num_cmds, num_tclk);
+		else
+			stats_print_text(stderr, elapsed, num_tclk);
+	}
+	link.io.reset();
+	for (gang_unit& u : units)
+		u.link.io.reset();
+	if (!trace.close())
+		ok = false;
+	for (gang_unit& u : units)
+		if (!u.trace.close())
+			ok = false;
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,727 @@
+// svfsim: a virtual JTAG programmer + CPLD, served on a pseudo-terminal or a
+// Unix socket.
+// It speaks the same protocol as arduino/myjtag.ino, so svfplayer can be run
+// end to end (and benchmarked) without an Arduino or a part on the bench.
+#include "libsvfplayer.h"
+#include "../arduino/jtagproto.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+using namespace std;
+
+// ATF15xx ISP instructions used by the ATMISP generated svf files
+#define ISP_IDCODE		0x059
+#define ISP_ADDRESS		0x2a1
+#define ISP_READ		0x28c
+#define ISP_DATA		0x290	// 0x290..0x293: row data and the three fuse rows
+#define ISP_ERASE		0x2b3
+#define ISP_PROGRAM		0x29e
+
+//##########################################################################################
+/***************** device model *****************/
+//##########################################################################################
+
+// a shift register of fixed width; shifting is O(1) per clock
+struct simShiftReg {
+	vector<uchar> bits;
+	int head=0;
+	void resize(int width) {
+		bits.assign(width>0?width:1,0);
+		head=0;
+	}
+	int width() const { return bits.size(); }
+	// bit i of the value, LSB (first shifted out) at i=0
+	uchar get(int i) const { return bits[(head+i)%bits.size()]; }
+	void load(const vector<uchar>& v) {
+		head=0;
+		for(int i=0;i<(int)bits.size();i++)
+			bits[i]=(i<(int)v.size())?v[i]:0;
+	}
+	void loadInt(uint64_t v) {
+		head=0;
+		for(int i=0;i<(int)bits.size();i++)
+			bits[i]=(i<64)?((v>>i)&1):0;
+	}
+	uint64_t toInt() const {
+		uint64_t v=0;
+		for(int i=0;i<(int)bits.size() && i<64;i++)
+			v|=uint64_t(get(i))<<i;
+		return v;
+	}
+	uchar shift(uchar in) {
+		uchar out=bits[head];
+		bits[head]=in;
+		head=(head+1)%bits.size();
+		return out;
+	}
+};
+
+struct simDevice {
+	// configuration
+	int irLen=10;
+	uint32_t idcode=0x0150803f;
+	int rowWidth=326;
+
+	svfState state;
+	int instruction;
+	bool pending;		//instruction has an action to run in RUN-TEST/IDLE
+	bool eraseArmed;
+	int address;
+	simShiftReg ir,dr;
+	vector<uchar> latch;
+	map<int,vector<uchar>> flash;	//rows that aren't here read back erased
+	long clocks=0;
+
+	void reset() {
+		state=svfState::RESET;
+		eraseArmed=false;
+		address=0;
+		flash.clear();
+		clocks=0;
+		latch.assign(rowWidth>32?rowWidth:32,1);
+		ir.resize(irLen);
+		_testLogicReset();
+	}
+	int _drWidth() {
+		switch(instruction) {
+			case ISP_IDCODE: return 32;
+			case ISP_ADDRESS: return 11;
+			case ISP_DATA: return rowWidth;
+			case ISP_DATA+1: return 32;
+			case ISP_DATA+2: return 4;
+			case ISP_DATA+3: return 16;
+			default: return 1;		//bypass
+		}
+	}
+	void _testLogicReset() {
+		instruction=ISP_IDCODE;
+		pending=false;
+	}
+	void _captureDR() {
+		dr.resize(_drWidth());
+		if(instruction==ISP_IDCODE) dr.loadInt(idcode);
+		else if(instruction==ISP_ADDRESS) dr.loadInt(address);
+		else if(instruction>=ISP_DATA && instruction<=ISP_DATA+3) dr.load(latch);
+	}
+	void _updateDR() {
+		if(instruction==ISP_ADDRESS) {
+			address=(int)dr.toInt();
+		} else if(instruction>=ISP_DATA && instruction<=ISP_DATA+3) {
+			for(int i=0;i<dr.width();i++) latch[i]=dr.get(i);
+		}
+	}
+	void _runIdle() {
+		if(!pending) return;
+		pending=false;
+		switch(instruction) {
+			case ISP_READ:
+			{
+				auto it=flash.find(address);
+				if(it==flash.end()) latch.assign(latch.size(),1);
+				else latch=it->second;
+				break;
+			}
+			case ISP_ERASE:
+				eraseArmed=true;
+				break;
+			case ISP_PROGRAM:
+				if(eraseArmed) flash.clear();
+				else flash[address]=latch;
+				eraseArmed=false;
+				break;
+		}
+	}
+	// one TCK cycle: TDO is sampled before the rising edge, like the sketch does
+	uchar clock(uchar tms, uchar tdi) {
+		uchar tdo=1;		//TDO is pulled up while the part isn't driving it
+		clocks++;
+		switch(state) {
+			case svfState::IDLE: _runIdle(); break;
+			case svfState::DRCAPTURE: _captureDR(); break;
+			case svfState::IRCAPTURE: ir.loadInt(1); break;
+			case svfState::DRSHIFT: tdo=dr.shift(tdi); break;
+			case svfState::IRSHIFT: tdo=ir.shift(tdi); break;
+			default: break;
+		}
+		state=svfTransitionTable[int(state)*2+(tms?1:0)];
+		if(state==svfState::RESET) {
+			_testLogicReset();
+		} else if(state==svfState::DRUPDATE) {
+			_updateDR();
+		} else if(state==svfState::IRUPDATE) {
+			instruction=(int)ir.toInt();
+			pending=true;
+		}
+		return tdo;
+	}
+};
+
+//##########################################################################################
+/***************** link emulation *****************/
+//##########################################################################################
+struct simLink {
+	int fd=-1;
+	long baud=0;			//0: no baud rate emulation
+	long latencyUs=0;		//extra delay per byte, on top of the baud rate
+	long bytesIn=0,bytesOut=0;
+	double deadline=0;
+	uchar rxBuf[4096];
+	int rxPos=0,rxLen=0;
+
+	static double now() {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC,&ts);
+		return ts.tv_sec+ts.tv_nsec*1e-9;
+	}
+	// the link is modelled half duplex: every byte in either direction
+	// occupies it for 10 bit times plus the configured latency
+	void delay(int bytes) {
+		double perByte=(baud?10.0/baud:0)+latencyUs*1e-6;
+		if(perByte==0 && deadline==0) return;
+		double t=now();
+		if(deadline<t) deadline=t;
+		deadline+=bytes*perByte;
+		double wait=deadline-t;
+		if(wait>0) {
+			timespec ts;
+			ts.tv_sec=(time_t)wait;
+			ts.tv_nsec=(long)((wait-ts.tv_sec)*1e9);
+			nanosleep(&ts,NULL);
+		}
+	}
+	// time the programmer spends clocking; waited out with the next byte
+	void busy(double seconds) {
+		double t=now();
+		if(deadline<t) deadline=t;
+		deadline+=seconds;
+	}
+	// returns the next byte, or -1 once the client has hung up
+	int getByte() {
+		if(rxPos==rxLen) {
+			int r=::read(fd,rxBuf,sizeof(rxBuf));
+			if(r<=0) return -1;		//EIO: slave side closed
+			rxPos=0;
+			rxLen=r;
+			bytesIn+=r;
+		}
+		delay(1);
+		return rxBuf[rxPos++];
+	}
+	// bytes the client has sent that haven't been read yet
+	int pending() {
+		int n=0;
+		if(ioctl(fd,FIONREAD,&n)<0) n=0;
+		return rxLen-rxPos+n;
+	}
+	bool readExact(uchar* buf, int n) {
+		for(int i=0;i<n;i++) {
+			int c=getByte();
+			if(c<0) return false;
+			buf[i]=c;
+		}
+		return true;
+	}
+	void write(const void* buf, int n) {
+		delay(n);
+		bytesOut+=n;
+		const uchar* p=(const uchar*)buf;
+		while(n>0) {
+			int r=::write(fd,p,n);
+			if(r<=0) return;
+			p+=r;
+			n-=r;
+		}
+	}
+};
+
+//##########################################################################################
+/***************** programmer firmware *****************/
+//##########################################################################################
+struct simProgrammer {
+	simDevice dev;
+	simLink link;
+	char command[21];
+	int cmdIndx=0;
+	uchar tdi=0;
+	uchar tap=JP_ST_UNKNOWN,ones=0;		//the sketch's idea of the TAP state
+	long asciiCmds=0,packets=0;
+	int rxBuffer=JP_DEFAULT_CREDIT;	//receive buffer the sketch reports (JP_OP_CREDIT)
+	long overruns=0;		//responses sent with more than that queued up behind
+	long baud0=0;			//link.baud the session started with
+	double tckPeriod=0;		//set by JP_OP_FREQ, 0: TCK isn't paced
+	bool verifyFailed=false;	//sticky JP_OP_VERIFY mismatch flag
+	long mismatches=0;		//JP_OP_VERIFY packets that stopped on a mismatch
+	// the sketch's limits (see exec_baud() and exec_freq())
+	static constexpr long minBaud=1200,maxBaud=2000000;
+	static constexpr unsigned long tckMaxHz=1000000;
+
+	void reset() {
+		dev.reset();
+		cmdIndx=0;
+		tdi=0;
+		tap=JP_ST_UNKNOWN;
+		ones=0;
+		asciiCmds=packets=overruns=0;
+		tckPeriod=0;
+		verifyFailed=false;
+		mismatches=0;
+		link.baud=baud0;
+		link.deadline=0;
+		link.bytesIn=link.bytesOut=0;
+		link.rxPos=link.rxLen=0;
+	}
+	// matches scan_idcode() in the sketch, including the TAP moves it makes
+	void scanIdcode() {
+		const char* seq[]={"11111","111110100"};
+		for(int s=0;s<2;s++)
+			for(const char* c=seq[s];*c;c++) dev.clock(*c-'0',tdi);
+		uint32_t idcodes[4];
+		int i;
+		for(i=0;i<4;i++) {
+			idcodes[i]=0;
+			for(int j=0;j<32;j++) {
+				tdi=0;
+				if(dev.clock(0,0)) idcodes[i]|=uint32_t(1)<<j;
+			}
+			if(!(idcodes[i]&1) || idcodes[i]==0xffffffff) break;
+		}
+		char buf[128];
+		if(i>0) {
+			int len=snprintf(buf,sizeof(buf),"JTAG Devices: %d",i);
+			for(int j=0;j<i;j++)
+				len+=snprintf(buf+len,sizeof(buf)-len," 0x%X",idcodes[j]);
+			snprintf(buf+len,sizeof(buf)-len,"\r\n");
+		} else snprintf(buf,sizeof(buf),"No JTAG Devices\r\n");
+		link.write(buf,strlen(buf));
+		tap=JP_ST_UNKNOWN;
+	}
+	// exec_svf_bit() in the sketch
+	uchar clock(uchar tms, uchar tdiBit) {
+		tap=jp_tap_step(tap,tms,&ones);
+		tdi=tdiBit;
+		if(tckPeriod>0) link.busy(tckPeriod);
+		return dev.clock(tms,tdi);
+	}
+	// exec_baud(): answers at the old rate, then switches. Only the emulated
+	// rate changes; a pty has none
+	void execBaud(const uchar* pkt, int len) {
+		uchar resp[4];
+		if(len!=4) {
+			sendError(JP_ERR_LENGTH);
+			return;
+		}
+		unsigned long rate=jp_get_u32(pkt);
+		if(rate<(unsigned long)minBaud || rate>(unsigned long)maxBaud) rate=0;
+		jp_put_u32(resp,rate);
+		sendPacket(JP_OP_BAUD,resp,4);
+		if(rate && link.baud) link.baud=rate;
+	}
+	// exec_freq(): every clock takes at least a whole number of microseconds
+	void execFreq(const uchar* pkt, int len) {
+		uchar resp[4];
+		if(len!=4) {
+			sendError(JP_ERR_LENGTH);
+			return;
+		}
+		unsigned long hz=jp_get_u32(pkt),got=0;
+		tckPeriod=0;
+		if(hz>0 && hz<tckMaxHz) {
+			unsigned long us=(1000000UL+hz-1)/hz;
+			tckPeriod=us*1e-6;
+			got=1000000UL/us;
+		}
+		jp_put_u32(resp,got);
+		sendPacket(JP_OP_FREQ,resp,4);
+	}
+	// exec_batch() in the sketch: checks the whole batch, then runs it. With
+	// verify (JP_OP_VERIFY) TDO is compared here instead of sent back
+	void execBatch(const uchar* pkt, int len, bool verify) {
+		uchar out[JP_BYTES(JP_MAX_CLOCKS)]={};
+		int total=0;
+		if(verify && len==0) {
+			verifyFailed=false;
+			sendPacket(JP_OP_VERIFY,out,0);
+			return;
+		}
+		if(verify && verifyFailed) {
+			sendError(JP_ERR_VERIFY);
+			return;
+		}
+		for(int i=0;i<len;) {
+			int n=0;
+			switch(pkt[i]) {
+				case JP_SUB_GOTO: n=2; break;
+				case JP_SUB_CLOCK: n=4; break;
+				case JP_SUB_SHIFT:
+					if(i+4>len) break;
+					n=4+JP_BYTES(pkt[i+2]|(pkt[i+3]<<8));
+					total+=pkt[i+2]|(pkt[i+3]<<8);
+					break;
+				case JP_SUB_ZSHIFT:
+				{
+					if(i+5>len || i+5+pkt[i+4]>len) break;
+					int count=pkt[i+2]|(pkt[i+3]<<8);
+					if(jp_unpack(pkt+i+5,pkt[i+4],NULL,JP_BYTES(count))) n=5+pkt[i+4];
+					total+=count;
+					break;
+				}
+				case JP_SUB_RAW:
+					if(i+2>len) break;
+					n=2+2*JP_BYTES(pkt[i+1]);
+					total+=pkt[i+1];
+					break;
+				case JP_SUB_EXPECT:
+				case JP_SUB_ZEXPECT:
+				{
+					if(!verify) {
+						sendError(JP_ERR_OPCODE);
+						return;
+					}
+					if(i+4>len) break;
+					int count=pkt[i+2]|(pkt[i+3]<<8);
+					if(pkt[i]==JP_SUB_EXPECT) n=jp_expect_len(pkt[i+1],count);
+					else if(i+5<=len && i+5+pkt[i+4]<=len &&
+							jp_unpack(pkt+i+5,pkt[i+4],NULL,jp_expect_vectors(pkt[i+1],count)))
+						n=5+pkt[i+4];
+					if(count>total) n=0;
+					break;
+				}
+				default:
+					sendError(JP_ERR_OPCODE);
+					return;
+			}
+			if(n==0 || i+n>len || total>JP_MAX_CLOCKS) {
+				sendError(JP_ERR_LENGTH);
+				return;
+			}
+			i+=n;
+		}
+		int captured=0;
+		uchar unpacked[4+2*JP_BYTES(JP_MAX_CLOCKS)];	//pkt_unpacked in the sketch
+		auto capture=[&](uchar tdo) {
+			if(tdo) out[captured/8]|=1<<(captured%8);
+			captured++;
+		};
+		//shift_sub()
+		auto shift=[&](uchar flags, int count, const uchar* tdiv) {
+			if(tap!=JP_ST_DRSHIFT && tap!=JP_ST_IRSHIFT) return false;
+			for(int k=0;k<count;k++)
+				capture(clock((flags&JP_SHIFT_EXIT) && k==count-1,(tdiv[k/8]>>(k%8))&1));
+			return true;
+		};
+		//check_expect() and send_mismatch(); false if a mismatch was sent
+		auto expect=[&](const uchar* sub) {
+			int count=sub[2]|(sub[3]<<8);
+			uchar flags=sub[1];
+			const uchar* tdo=(flags&JP_EXPECT_FILL)?NULL:sub+4;
+			const uchar* mask=(flags&JP_EXPECT_ALL)?NULL:sub+4+(tdo?JP_BYTES(count):0);
+			for(int k=0;k<count;k++) {
+				int p=captured-count+k;
+				int want=tdo?(tdo[k/8]>>(k%8))&1:(flags&JP_EXPECT_ONES)!=0;
+				if(mask && !((mask[k/8]>>(k%8))&1)) continue;
+				if(((out[p/8]>>(p%8))&1)==want) continue;
+				uchar resp[2+JP_BYTES(JP_MAX_CLOCKS)]={uchar(p&0xff),uchar(p>>8)};
+				memcpy(resp+2,out,JP_BYTES(captured));
+				verifyFailed=true;
+				mismatches++;
+				sendPacket(JP_OP_VERIFY,resp,2+JP_BYTES(captured));
+				return false;
+			}
+			return true;
+		};
+		for(int i=0;i<len;) {
+			switch(pkt[i]) {
+				case JP_SUB_GOTO:
+				{
+					uchar dst=pkt[i+1],dist[JP_ST_COUNT];
+					if(dst<JP_ST_RESET || dst>=JP_ST_COUNT || tap<JP_ST_RESET) {
+						sendError(JP_ERR_STATE);
+						return;
+					}
+					jp_tap_distances(dst,dist);
+					while(tap!=dst) {
+						const uchar* next=jp_tap_next[tap];
+						clock(dist[next[1]]<dist[next[0]],0);
+					}
+					i+=2;
+					break;
+				}
+				case JP_SUB_CLOCK:
+				{
+					int count=pkt[i+2]|(pkt[i+3]<<8);
+					for(int k=0;k<count;k++)
+						clock((pkt[i+1]&JP_CLK_TMS)!=0,(pkt[i+1]&JP_CLK_TDI)!=0);
+					i+=4;
+					break;
+				}
+				case JP_SUB_SHIFT:
+				{
+					int count=pkt[i+2]|(pkt[i+3]<<8);
+					if(!shift(pkt[i+1],count,pkt+i+4)) {
+						sendError(JP_ERR_STATE);
+						return;
+					}
+					i+=4+JP_BYTES(count);
+					break;
+				}
+				case JP_SUB_ZSHIFT:
+				{
+					int count=pkt[i+2]|(pkt[i+3]<<8);
+					if(count>0) {
+						jp_unpack(pkt+i+5,pkt[i+4],unpacked,JP_BYTES(count));
+						if(!shift(pkt[i+1],count,unpacked)) {
+							sendError(JP_ERR_STATE);
+							return;
+						}
+					}
+					i+=5+pkt[i+4];
+					break;
+				}
+				case JP_SUB_RAW:
+				{
+					int count=pkt[i+1];
+					const uchar* tmsv=pkt+i+2;
+					const uchar* tdiv=tmsv+JP_BYTES(count);
+					for(int k=0;k<count;k++)
+						capture(clock((tmsv[k/8]>>(k%8))&1,(tdiv[k/8]>>(k%8))&1));
+					i+=2+2*JP_BYTES(count);
+					break;
+				}
+				case JP_SUB_EXPECT:
+					if(!expect(pkt+i)) return;
+					i+=jp_expect_len(pkt[i+1],pkt[i+2]|(pkt[i+3]<<8));
+					break;
+				case JP_SUB_ZEXPECT:
+					memcpy(unpacked,pkt+i,4);
+					jp_unpack(pkt+i+5,pkt[i+4],unpacked+4,jp_expect_vectors(pkt[i+1],pkt[i+2]|(pkt[i+3]<<8)));
+					if(!expect(unpacked)) return;
+					i+=5+pkt[i+4];
+					break;
+			}
+		}
+		if(verify) sendPacket(JP_OP_VERIFY,out,0);
+		else sendPacket(JP_OP_BATCH,out,JP_BYTES(total));
+	}
+	// a real sketch would have lost the bytes beyond rxBuffer that arrived
+	// while it ran the packet
+	void sendPacket(uchar op, const uchar* payload, int len) {
+		if(link.pending()>rxBuffer) overruns++;
+		uchar pkt[JP_HDR_LEN+JP_MAX_PAYLOAD]={JP_SYNC,op,uchar(len&0xff),uchar(len>>8)};
+		memcpy(pkt+JP_HDR_LEN,payload,len);
+		link.write(pkt,JP_HDR_LEN+len);
+	}
+	void sendError(uchar code) {
+		sendPacket(JP_OP_ERROR,&code,1);
+	}
+	// sync byte has been consumed; returns false if the client hung up
+	bool execPacket() {
+		uchar hdr[JP_HDR_LEN-1],pkt[JP_MAX_PAYLOAD],out[JP_BYTES(JP_MAX_CLOCKS)];
+		if(!link.readExact(hdr,sizeof(hdr))) return false;
+		int len=hdr[1]|(hdr[2]<<8);
+		if(len>JP_MAX_PAYLOAD) {
+			sendError(JP_ERR_LENGTH);
+			return true;
+		}
+		if(!link.readExact(pkt,len)) return false;
+		packets++;
+		switch(hdr[0]) {
+			case JP_OP_SHIFT:
+			{
+				int clocks=len>=2?(pkt[0]|(pkt[1]<<8)):-1;
+				int nbytes=JP_BYTES(clocks);
+				if(clocks<0 || clocks>JP_MAX_CLOCKS || len!=2+2*nbytes) {
+					sendError(JP_ERR_LENGTH);
+					break;
+				}
+				const uchar* tms=pkt+2;
+				const uchar* tdiv=tms+nbytes;
+				memset(out,0,nbytes);
+				for(int i=0;i<clocks;i++) {
+					int mask=1<<(i%8);
+					if(clock((tms[i/8]&mask)!=0,(tdiv[i/8]&mask)!=0))
+						out[i/8]|=mask;
+				}
+				sendPacket(JP_OP_SHIFT,out,nbytes);
+				break;
+			}
+			case JP_OP_BATCH:
+				execBatch(pkt,len,false);
+				break;
+			case JP_OP_VERIFY:
+				execBatch(pkt,len,true);
+				break;
+			case JP_OP_BAUD:
+				execBaud(pkt,len);
+				break;
+			case JP_OP_FREQ:
+				execFreq(pkt,len);
+				break;
+			case JP_OP_CREDIT:
+			{
+				uchar resp[2]={uchar(rxBuffer&0xff),uchar(rxBuffer>>8)};
+				if(len!=0) sendError(JP_ERR_LENGTH);
+				else sendPacket(JP_OP_CREDIT,resp,2);
+				break;
+			}
+			default:
+				sendError(JP_ERR_OPCODE);
+				break;
+		}
+		return true;
+	}
+	void execCommand() {
+		if(strncmp(command,"$RST",4)==0) {
+			scanIdcode();
+		} else if(cmdIndx==4 && command[0]=='$') {
+			// 'x' leaves TDI where it was, like the sketch
+			uchar tdo=clock(command[1]=='1',(command[2]=='0' || command[2]=='1')?command[2]-'0':tdi);
+			asciiCmds++;
+			link.write(tdo?"TDO: 1\r\n":"TDO: 0\r\n",8);
+		}
+	}
+	// serves one client until it closes the pty or socket
+	void serve() {
+		int c;
+		while((c=link.getByte())>=0) {
+			if(cmdIndx==0 && c==JP_SYNC) {
+				if(!execPacket()) return;
+			} else if(c=='\n' || c=='\r') {
+				command[cmdIndx]=0;
+				execCommand();
+				cmdIndx=0;
+			} else if(cmdIndx<(int)sizeof(command)-2) {
+				command[cmdIndx++]=c;
+			}
+		}
+	}
+};
+
+void print_usage(const char* prog) {
+	fprintf(stderr,"usage: %s [options]\n",prog);
+	fprintf(stderr,"\t-i <idcode>\tIDCODE of the simulated part (default 0x0150803f)\n");
+	fprintf(stderr,"\t-w <bits>\twidth of the flash row register (default 326)\n");
+	fprintf(stderr,"\t-I <bits>\tinstruction register length (default 10)\n");
+	fprintf(stderr,"\t-b <baud>\temulate a serial link of this baud rate (default: unlimited);\n");
+	fprintf(stderr,"\t\t\tthe player can switch it with -b\n");
+	fprintf(stderr,"\t-l <us>\t\textra link latency per byte in microseconds\n");
+	fprintf(stderr,"\t-r <bytes>\treceive buffer reported to the player (default %d)\n",JP_DEFAULT_CREDIT);
+	fprintf(stderr,"\t-s <path>\tlisten on a Unix socket at this path instead of a pty\n");
+	fprintf(stderr,"\t-1\t\texit after the first client disconnects\n");
+	fprintf(stderr,"The pty or socket path is printed on stdout; statistics of each session go to stderr.\n");
+}
+
+int main(int argc, char** argv) {
+	simProgrammer prog;
+	bool once=false;
+	const char* sockPath=NULL;
+	int opt;
+	while((opt=getopt(argc,argv,"i:w:I:b:l:r:s:1"))!=-1) {
+		switch(opt) {
+			case 'i': prog.dev.idcode=strtoul(optarg,NULL,0); break;
+			case 'w': prog.dev.rowWidth=atoi(optarg); break;
+			case 'I': prog.dev.irLen=atoi(optarg); break;
+			case 'b': prog.link.baud=atol(optarg); break;
+			case 'l': prog.link.latencyUs=atol(optarg); break;
+			case 'r': prog.rxBuffer=atoi(optarg); break;
+			case 's': sockPath=optarg; break;
+			case '1': once=true; break;
+			default:
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if(prog.dev.rowWidth<=0 || prog.dev.irLen<=0 || prog.link.baud<0 || prog.link.latencyUs<0 ||
+			prog.rxBuffer<=JP_HDR_LEN || prog.rxBuffer>0xffff) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	prog.baud0=prog.link.baud;
+	auto session=[&]() {
+		prog.reset();
+		double start=simLink::now();
+		prog.serve();
+		double elapsed=simLink::now()-start;
+		fprintf(stderr,"session: %.3f s, %ld bytes in, %ld bytes out, %ld clocks (%.0f TCK/s), "
+			"%ld ascii commands, %ld packets, %ld rx overruns, %ld verify mismatches\n",elapsed,prog.link.bytesIn,prog.link.bytesOut,
+			prog.dev.clocks,elapsed>0?prog.dev.clocks/elapsed:0.0,prog.asciiCmds,prog.packets,prog.overruns,prog.mismatches);
+	};
+
+	if(sockPath) {
+		// one client at a time, as on a serial port
+		sockaddr_un addr={};
+		addr.sun_family=AF_UNIX;
+		if(strlen(sockPath)>=sizeof(addr.sun_path)) {
+			fprintf(stderr,"%s: socket path too long\n",sockPath);
+			return EXIT_FAILURE;
+		}
+		strcpy(addr.sun_path,sockPath);
+		unlink(sockPath);
+		int lfd=socket(AF_UNIX,SOCK_STREAM,0);
+		if(lfd<0 || bind(lfd,(sockaddr*)&addr,sizeof(addr))<0 || listen(lfd,1)<0) {
+			perror(sockPath);
+			return EXIT_FAILURE;
+		}
+		signal(SIGPIPE,SIG_IGN);
+		printf("%s\n",sockPath);
+		fflush(stdout);
+		while(true) {
+			int c=accept(lfd,NULL,NULL);
+			if(c<0) {
+				if(errno==EINTR) continue;
+				perror("accept");
+				break;
+			}
+			prog.link.fd=c;
+			session();
+			close(c);
+			if(once) break;
+		}
+		close(lfd);
+		unlink(sockPath);
+		return EXIT_SUCCESS;
+	}
+
+	int master=posix_openpt(O_RDWR|O_NOCTTY);
+	if(master<0 || grantpt(master)<0 || unlockpt(master)<0) {
+		perror("posix_openpt");
+		return EXIT_FAILURE;
+	}
+	termios tio;
+	if(tcgetattr(master,&tio)==0) {
+		cfmakeraw(&tio);
+		tcsetattr(master,TCSANOW,&tio);
+	}
+	printf("%s\n",ptsname(master));
+	fflush(stdout);
+	prog.link.fd=master;
+
+	while(true) {
+		// until a client opens the slave, reads on the master fail with EIO
+		pollfd pfd={master,POLLIN,0};
+		poll(&pfd,1,-1);
+		if(!(pfd.revents&POLLIN)) {
+			usleep(10000);
+			continue;
+		}
+		session();
+		if(once) break;
+	}
+	close(master);
+	return EXIT_SUCCESS;
+}
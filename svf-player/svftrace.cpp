@@ -0,0 +1,233 @@
+// svftrace: converts a clock trace recorded with `svfplayer -t` to VCD, for
+// GTKWave or any other waveform viewer. One TCK period takes two time units:
+// TCK falls (and TMS, TDI and TDO change) at even times and rises at odd ones.
+#include "libsvfplayer.h"
+#include "../arduino/jtagproto.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+using namespace std;
+
+// one VCD variable; only changes are written
+struct vcdSignal {
+	const char* id;
+	const char* name;
+	int width;
+	int64_t value=-2;		// -2: not written yet, -1: x
+
+	void set(string& out, int64_t v) {
+		if(v==value) return;
+		value=v;
+		if(width==1) {
+			out+=v<0?'x':char('0'+v);
+		} else {
+			char buf[72];
+			int n=0;
+			for(int b=width-1;b>=0;b--) {
+				if(n==0 && b>0 && !((v>>b)&1)) continue;	// no leading zeros
+				buf[n++]='0'+((v>>b)&1);
+			}
+			out+='b';
+			out.append(buf,n);
+			out+=' ';
+		}
+		out+=id;
+		out+='\n';
+	}
+};
+
+enum { SIG_TCK, SIG_TMS, SIG_TDI, SIG_TDO_EXPECTED, SIG_TDO, SIG_MISMATCH, SIG_TAP_STATE, SIG_SVF_LINE, SIG_COUNT };
+
+struct vcdWriter {
+	FILE* out;
+	string buf;
+	vcdSignal sig[SIG_COUNT]={
+		{"!","tck",1},{"\"","tms",1},{"#","tdi",1},{"$","tdo_expected",1},
+		{"%","tdo",1},{"&","mismatch",1},{"'","tap_state",5},{"(","svf_line",32}};
+
+	void header(const char* source) {
+		time_t now=::time(NULL);
+		char date[64];
+		strftime(date,sizeof(date),"%Y-%m-%d %H:%M:%S",localtime(&now));
+		fprintf(out,"$date %s $end\n$version svftrace %s $end\n$comment\n",date,source);
+		fprintf(out,"  tap_state:");
+		for(int s=int(svfState::UNKNOWN);s<svfNumStates;s++) fprintf(out," %d=%s",s,svfStates[s]);
+		fprintf(out,"\n  tdo_expected is x where TDO isn't checked\n$end\n");
+		fprintf(out,"$timescale 1 ns $end\n$scope module jtag $end\n");
+		for(int i=0;i<SIG_COUNT;i++)
+			fprintf(out,"$var %s %d %s %s $end\n",sig[i].width==1?"wire":"reg",sig[i].width,sig[i].id,sig[i].name);
+		fprintf(out,"$upscope $end\n$enddefinitions $end\n");
+	}
+	void time(int64_t t) {
+		buf+='#';
+		buf+=to_string(t);
+		buf+='\n';
+	}
+	void flush(bool force=false) {
+		if(!force && buf.size()<(1<<16)) return;
+		fwrite(buf.data(),1,buf.size(),out);
+		buf.clear();
+	}
+};
+
+// a translate filter file for tap_state: one "<hex value> <name>" per line,
+// as GTKWave's Data Format > Translate Filter File expects
+bool write_filter(const char* path) {
+	FILE* f=fopen(path,"w");
+	if(f==NULL) return false;
+	for(int s=0;s<svfNumStates;s++) fprintf(f,"%02X %s\n",s,svfStates[s]);
+	return fclose(f)==0;
+}
+
+// the trace's magic; false if it's not a trace file
+bool read_magic(FILE* f) {
+	char magic[8];
+	return fread(magic,1,8,f)==8 && memcmp(magic,SVF_TRACE_MAGIC,8)==0;
+}
+
+// clock of the first TDO mismatch in the trace, or -1
+int64_t first_mismatch(FILE* f) {
+	svfTraceBlock b;
+	while(b.read(f)) {
+		svfVectorsView v;
+		v.tdo=b.streams[2].view();
+		v.tdoCare=b.streams[3].view();
+		int64_t bad=v.firstMismatch(b.streams[4].view(),0,b.hdr.clocks);
+		if(bad>=0) return b.hdr.clock+bad;
+	}
+	return -1;
+}
+
+void print_usage(const char* prog) {
+	fprintf(stderr,"usage: %s [options] <trace-file> [<vcd-file>]\n",prog);
+	fprintf(stderr,"\t-s <clock>\tfirst clock to export (default 0)\n");
+	fprintf(stderr,"\t-n <clocks>\tnumber of clocks to export (default: all)\n");
+	fprintf(stderr,"\t-e <clocks>\texport only this many clocks either side of the first\n");
+	fprintf(stderr,"\t\t\tTDO mismatch\n");
+	fprintf(stderr,"\t-f <file>\talso write a GTKWave translate filter for tap_state\n");
+	fprintf(stderr,"The VCD goes to stdout unless a file is given. A summary goes to stderr.\n");
+}
+
+int main(int argc, char** argv) {
+	int64_t from=0,count=-1,around=-1;
+	const char* filter=NULL;
+	int opt;
+	while((opt=getopt(argc,argv,"s:n:e:f:"))!=-1) {
+		switch(opt) {
+			case 's': from=atoll(optarg); break;
+			case 'n': count=atoll(optarg); break;
+			case 'e': around=atoll(optarg); break;
+			case 'f': filter=optarg; break;
+			default:
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if(argc-optind<1 || argc-optind>2 || from<0 || around<-1) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	const char* path=argv[optind];
+	FILE* in=fopen(path,"rb");
+	if(in==NULL) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	if(!read_magic(in)) {
+		fprintf(stderr,"%s: not a trace file\n",path);
+		return EXIT_FAILURE;
+	}
+	try {
+		if(around>=0) {
+			int64_t bad=first_mismatch(in);
+			if(bad<0) {
+				fprintf(stderr,"%s: no TDO mismatch in the trace\n",path);
+				return EXIT_FAILURE;
+			}
+			from=max<int64_t>(0,bad-around);
+			count=bad+around+1-from;
+			rewind(in);
+			read_magic(in);
+		}
+	} catch(const exception& e) {
+		fprintf(stderr,"%s: %s\n",path,e.what());
+		return EXIT_FAILURE;
+	}
+	int64_t to=count<0?INT64_MAX:from+count;
+	if(filter && !write_filter(filter)) {
+		perror(filter);
+		return EXIT_FAILURE;
+	}
+	vcdWriter vcd;
+	vcd.out=stdout;
+	if(argc-optind==2 && (vcd.out=fopen(argv[optind+1],"w"))==NULL) {
+		perror(argv[optind+1]);
+		return EXIT_FAILURE;
+	}
+	vcd.header(path);
+
+	// the TAP state and line are followed from clock 0 on, but only the
+	// clocks in [from,to) are written
+	uchar state=JP_ST_UNKNOWN,ones=0;
+	int64_t line=0,clocks=0,mismatches=0,firstBad=-1,firstBadLine=0,written=0;
+	svfTraceBlock b;
+	try {
+		while(b.read(in) && clocks<to) {
+			if(b.hdr.clock!=(uint64_t)clocks) throw runtime_error("error: trace blocks out of order");
+			const svfBitVector* st=b.streams;
+			size_t m=0;
+			for(int64_t i=0;i<(int64_t)b.hdr.clocks;i++) {
+				int64_t c=clocks+i;
+				while(m<b.marks.size() && (int64_t)b.marks[m].clock<=c) line=b.marks[m++].line;
+				bool tms=st[0].get(i),care=st[3].get(i),tdo=st[4].get(i);
+				bool bad=care && st[2].get(i)!=tdo;
+				if(bad) {
+					if(firstBad<0) {
+						firstBad=c;
+						firstBadLine=line;
+					}
+					mismatches++;
+				}
+				if(c>=from && c<to) {
+					vcd.time(2*c);
+					vcd.sig[SIG_TCK].set(vcd.buf,0);
+					vcd.sig[SIG_TMS].set(vcd.buf,tms);
+					vcd.sig[SIG_TDI].set(vcd.buf,st[1].get(i));
+					vcd.sig[SIG_TDO_EXPECTED].set(vcd.buf,care?st[2].get(i):-1);
+					vcd.sig[SIG_TDO].set(vcd.buf,tdo);
+					vcd.sig[SIG_MISMATCH].set(vcd.buf,bad);
+					vcd.sig[SIG_TAP_STATE].set(vcd.buf,state);
+					vcd.sig[SIG_SVF_LINE].set(vcd.buf,line);
+					vcd.time(2*c+1);
+					vcd.sig[SIG_TCK].set(vcd.buf,1);
+					vcd.flush();
+					written++;
+				}
+				state=jp_tap_step(state,tms,&ones);
+			}
+			clocks+=b.hdr.clocks;
+		}
+	} catch(const exception& e) {
+		fprintf(stderr,"%s: %s\n",path,e.what());
+	}
+	if(written>0) vcd.time(2*(from+written));
+	vcd.flush(true);
+	if(vcd.out!=stdout && fclose(vcd.out)!=0) {
+		perror(argv[optind+1]);
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr,"%s: %lld clocks read, %lld written",path,(long long)clocks,(long long)written);
+	if(firstBad>=0)
+		fprintf(stderr,"; %lld TDO mismatches, the first at clock %lld (line %lld)\n",
+			(long long)mismatches,(long long)firstBad,(long long)firstBadLine);
+	else
+		fprintf(stderr,"; no TDO mismatches\n");
+	fclose(in);
+	return EXIT_SUCCESS;
+}